@@ -1,56 +1,277 @@
 #include "async_log.h"
 #include <ctime>
 #include <time.h>
-#include <sys/timeb.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sstream>
-#include <iostream>
+#include <chrono>
 #include <stdarg.h>
+#include <algorithm>
+#include <deque>
 #include "platform.h"
+#include "log_ring.h"
+#include "log_sink.h"
+#include "timestamp.h"
 
 #define MAX_LINE_LENGTH   256
-#define DEFAULT_ROLL_SIZE 10 * 1024 * 1024
+
+//x86-64 always has SSE2, other targets use the table only
+#if defined(__SSE2__) || defined(_M_X64)
+#define LOG_HEX_SSE2
+#include <emmintrin.h>
+#endif
 
 BEGIN_NS(base)
 
+// the writer gathers lines into a block this large before writing them
+static const size_t kLogBlockSize = 4 * 1024 * 1024;
+static const int kDefaultFlushIntervalMs = 1000;
+static const size_t kDefaultThreadBufferSize = 1024 * 1024;
+// bytes the writer takes from the rings before it flushes and looks for new rings
+static const size_t kMaxBytesPerRound = 4 * kLogBlockSize;
+static const int64_t kDropReportIntervalUs = 1000 * 1000;
+// longest a producer of a full ring sleeps before it looks again, in case the writer stopped
+static const int kSpaceWaitMs = 10;
+
+struct LogBlock
+{
+    explicit LogBlock(size_t nCapacity)
+        : data(new char[nCapacity]),
+          capacity(nCapacity),
+          used(0),
+          minLevel(LOG_LEVEL_CRITICAL),
+          writes(0)
+    {
+    }
+
+    size_t avail() const { return capacity - used; }
+
+    void append(const char* pszData, size_t nLength, long nLevel)
+    {
+        memcpy(data.get() + used, pszData, nLength);
+        used += nLength;
+        lines.push_back(LogLineEnd{ used, nLevel });
+        if (nLevel < minLevel)
+            minLevel = nLevel;
+    }
+
+    void clear()
+    {
+        ++writes;
+        used = 0;
+        lines.clear();
+        minLevel = LOG_LEVEL_CRITICAL;
+    }
+
+    std::unique_ptr<char[]> data;
+    const size_t            capacity;
+    size_t                  used;
+    std::vector<LogLineEnd> lines;      //one entry per ring record, which may hold several lines
+    long                    minLevel;
+    uint64_t                writes;     //times the block was written out, the rings are released after each
+};
+
+std::vector<std::shared_ptr<LogSink>> CAsyncLog::m_vecSinks;
+std::mutex CAsyncLog::m_mutexSinks;
 bool CAsyncLog::m_bTruncateLongLog = false;
-FILE* CAsyncLog::m_hLogFile = nullptr;
-std::string CAsyncLog::m_strFileName = "default";
-std::string CAsyncLog::m_strFileNamePID = "";
 LOG_LEVEL CAsyncLog::m_nCurrentLevel = LOG_LEVEL_INFO;
-int64_t CAsyncLog::m_nFileRollSize = DEFAULT_ROLL_SIZE;
-int64_t CAsyncLog::m_nCurrentWrittenSize = 0;
-std::list<std::string> CAsyncLog::m_listLinesToWrite;
+const size_t CAsyncLog::kMaxPrefixLength;
+const size_t CAsyncLog::kMaxLocationLength;
+const size_t CAsyncLog::kFastMessageLength;
+const uint32_t CAsyncLog::kDeferredTag;
+const size_t CAsyncLog::kMinThreadBufferSize;
+const size_t CAsyncLog::kHexRowBytes;
+const size_t CAsyncLog::kMaxHexRowLength;
+const size_t CAsyncLog::kMaxBinaryNoteLength;
+int CAsyncLog::m_nFlushIntervalMs = kDefaultFlushIntervalMs;
+size_t CAsyncLog::m_nThreadBufferSize = kDefaultThreadBufferSize;
+size_t CAsyncLog::m_nMaxBufferSize = 0;
+size_t CAsyncLog::m_nBufferSize = 0;
+LOG_OVERFLOW_POLICY CAsyncLog::m_nOverflowPolicy = LOG_OVERFLOW_BLOCK;
+std::atomic<uint64_t> CAsyncLog::m_nDropped[LOG_LEVEL_CRITICAL + 1];
+std::vector<std::shared_ptr<LogRing>> CAsyncLog::m_vecRings;
+std::mutex CAsyncLog::m_mutexRings;
+std::atomic<uint64_t> CAsyncLog::m_nRingsVersion(0);
+std::string CAsyncLog::m_strCrashBufferDir;
+uint32_t CAsyncLog::m_nCrashBufferFiles = 0;
 std::unique_ptr<std::thread> CAsyncLog::m_spWriteThread;
 std::mutex CAsyncLog::m_mutexWrite;
 std::condition_variable CAsyncLog::m_cvWrite;
+std::atomic<bool> CAsyncLog::m_bWriterSleeping(false);
+std::mutex CAsyncLog::m_mutexSpace;
+std::condition_variable CAsyncLog::m_cvSpace;
+std::atomic<int> CAsyncLog::m_nSpaceWaiters(0);
 bool CAsyncLog::CAsyncLog::m_bExit = false;
-bool CAsyncLog::m_bRunning = false;
+std::atomic<bool> CAsyncLog::m_bRunning(false);
 
-bool CAsyncLog::init(const char* pszLogFileName/* = nullptr*/, bool bTruncateLongLine/* = false*/, int64_t nRollSize/* = 10 * 1024 * 1024*/)
+namespace
 {
-    m_bTruncateLongLog = bTruncateLongLine;
-    m_nFileRollSize = nRollSize;
-   
-    if (pszLogFileName == nullptr || pszLogFileName[0] == 0)
+
+// closes the ring of a thread when the thread exits, the writer drops it once drained
+struct LogRingOwner
+{
+    ~LogRingOwner()
     {
-        m_strFileName.clear();
+        if (ring)
+            ring->close();
     }
-    else
-        m_strFileName = pszLogFileName;
 
-    //ȡidٿͬһ̵Ĳͬ־ļ
-    char szPID[8];
+    std::shared_ptr<LogRing> ring;
+};
+
+thread_local LogRingOwner t_ringOwner;
+
+const char* const kCrashBufferSuffix = ".logring";
+//the LOG*_DEFER sites of the process, see LogFormatSite::saveTo()
+const char* const kCrashSitesSuffix = ".logsites";
+
+//the two hex digits of every byte value
+struct HexTable
+{
+    constexpr HexTable() : pairs()
+    {
+        for (int i = 0; i < 256; ++i)
+        {
+            pairs[2 * i] = "0123456789abcdef"[i >> 4];
+            pairs[2 * i + 1] = "0123456789abcdef"[i & 0xf];
+        }
+    }
+
+    char pairs[512];
+};
+
+constexpr HexTable kHexTable;
+
+#ifdef LOG_HEX_SSE2
+//32 hex digits of 16 bytes: split into nibbles, interleave them, then '0' + n, plus the gap to 'a' for n > 9
+inline void hexGroupSse2(const unsigned char* pszBytes, char* pszDest)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i gap = _mm_set1_epi8('a' - '0' - 10);
+
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pszBytes));
+    __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+    __m128i low = _mm_and_si128(bytes, mask);
+    __m128i first = _mm_unpacklo_epi8(high, low);
+    __m128i second = _mm_unpackhi_epi8(high, low);
+    first = _mm_add_epi8(_mm_add_epi8(first, zero), _mm_and_si128(_mm_cmpgt_epi8(first, nine), gap));
+    second = _mm_add_epi8(_mm_add_epi8(second, zero), _mm_and_si128(_mm_cmpgt_epi8(second, nine), gap));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pszDest), first);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(pszDest + 16), second);
+}
+#endif
+
+int64_t currentProcessID()
+{
+#ifdef WIN32
+    return static_cast<int64_t>(::GetCurrentProcessId());
+#else
+    return static_cast<int64_t>(::getpid());
+#endif
+}
+
+bool processAlive(int64_t nPid)
+{
+#ifdef WIN32
+    HANDLE hProcess = ::OpenProcess(SYNCHRONIZE, FALSE, static_cast<DWORD>(nPid));
+    if (hProcess == nullptr)
+        return false;
+    bool bAlive = ::WaitForSingleObject(hProcess, 0) == WAIT_TIMEOUT;
+    ::CloseHandle(hProcess);
+    return bAlive;
+#else
+    return ::kill(static_cast<pid_t>(nPid), 0) == 0 || errno == EPERM;
+#endif
+}
+
+//"*<pszSuffix>" in pszDir
+std::vector<std::string> listCrashBufferFiles(const char* pszDir, const char* pszSuffix)
+{
+    std::vector<std::string> vecPaths;
+    std::string strDir(pszDir != nullptr && pszDir[0] != 0 ? pszDir : ".");
 #ifdef WIN32
-    snprintf(szPID, sizeof(szPID), "%05d", (int)::GetCurrentProcessId());  
+    WIN32_FIND_DATAA data;
+    HANDLE hFind = ::FindFirstFileA((strDir + "\\*" + pszSuffix).c_str(), &data);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return vecPaths;
+    do
+    {
+        vecPaths.push_back(strDir + "\\" + data.cFileName);
+    } while (::FindNextFileA(hFind, &data));
+    ::FindClose(hFind);
 #else
-    snprintf(szPID, sizeof(szPID), "%05d", (int)::getpid());
+    DIR* pDir = ::opendir(strDir.c_str());
+    if (pDir == nullptr)
+        return vecPaths;
+    size_t nSuffixLength = strlen(pszSuffix);
+    while (struct dirent* pEntry = ::readdir(pDir))
+    {
+        size_t nNameLength = strlen(pEntry->d_name);
+        if (nNameLength > nSuffixLength && strcmp(pEntry->d_name + nNameLength - nSuffixLength, pszSuffix) == 0)
+            vecPaths.push_back(strDir + "/" + pEntry->d_name);
+    }
+    ::closedir(pDir);
 #endif
-    m_strFileNamePID = szPID;
+    return vecPaths;
+}
+
+//"[thread id]" of the calling thread, stringified once per thread
+const char* threadIDText(size_t* pLength)
+{
+    thread_local char t_szThreadID[32];
+    thread_local size_t t_nThreadIDLength = 0;
+    if (t_nThreadIDLength == 0)
+    {
+        std::ostringstream osThreadID;
+        osThreadID << std::this_thread::get_id();
+        int n = snprintf(t_szThreadID, sizeof(t_szThreadID), "[%s]", osThreadID.str().c_str());
+        t_nThreadIDLength = n > 0 && n < (int)sizeof(t_szThreadID) ? static_cast<size_t>(n) : 0;
+    }
+    *pLength = t_nThreadIDLength;
+    return t_szThreadID;
+}
+
+}
+
+bool CAsyncLog::init(const char* pszLogFileName/* = nullptr*/, bool bTruncateLongLine/* = false*/, int64_t nRollSize/* = 10 * 1024 * 1024*/)
+{
+    std::vector<std::shared_ptr<LogSink>> vecSinks;
+    vecSinks.push_back(std::make_shared<ConsoleLogSink>());
+    if (pszLogFileName != nullptr && pszLogFileName[0] != 0)
+        vecSinks.push_back(std::make_shared<FileLogSink>(pszLogFileName, nRollSize));
+
+    return init(vecSinks, bTruncateLongLine);
+}
+
+bool CAsyncLog::init(const std::vector<std::shared_ptr<LogSink>>& vecSinks, bool bTruncateLongLine/* = false*/)
+{
+    m_bTruncateLongLog = bTruncateLongLine;
+    {
+        std::lock_guard<std::mutex> lock_guard(m_mutexSinks);
+        m_vecSinks = vecSinks;
+    }
 
     //TODOļ
 
+    //lines a crashed run of the program left in its ring files come first
+    std::string strCrashBufferDir;
+    {
+        std::lock_guard<std::mutex> lock_guard(m_mutexRings);
+        strCrashBufferDir = m_strCrashBufferDir;
+    }
+    if (!strCrashBufferDir.empty())
+        recoverCrashBuffers(strCrashBufferDir.c_str());
+
+    {
+        std::lock_guard<std::mutex> lock_guard(m_mutexWrite);
+        m_bExit = false;
+    }
+    //producers that fill their ring wait for the writer from now on
+    m_bRunning = true;
+
     m_spWriteThread.reset(new std::thread(writeThreadProc));
 
     return true;
@@ -58,18 +279,19 @@ bool CAsyncLog::init(const char* pszLogFileName/* = nullptr*/, bool bTruncateLon
 
 void CAsyncLog::uninit()
 {
-    m_bExit = true;
+    {
+        std::lock_guard<std::mutex> lock_guard(m_mutexWrite);
+        m_bExit = true;
+        m_cvWrite.notify_one();
+    }
 
-    m_cvWrite.notify_one();
 
     if (m_spWriteThread->joinable())
         m_spWriteThread->join();
-    
-    if(m_hLogFile != nullptr)
-	{
-        fclose(m_hLogFile);
-        m_hLogFile = nullptr;
-	}
+
+    //closes the log file
+    std::lock_guard<std::mutex> lock_guard(m_mutexSinks);
+    m_vecSinks.clear();
 }
 
 void CAsyncLog::setLevel(LOG_LEVEL nLevel)
@@ -80,110 +302,177 @@ void CAsyncLog::setLevel(LOG_LEVEL nLevel)
     m_nCurrentLevel = nLevel;
 }
 
-bool CAsyncLog::isRunning()
+void CAsyncLog::setFlushInterval(int nMilliseconds)
 {
-    return m_bRunning;
+    if (nMilliseconds > 0)
+        m_nFlushIntervalMs = nMilliseconds;
 }
 
-bool CAsyncLog::output(long nLevel, const char* pszFmt, ...)
+void CAsyncLog::setThreadBufferSize(size_t nBytes)
 {
-    if (nLevel != LOG_LEVEL_CRITICAL)
-    {
-        if (nLevel < m_nCurrentLevel)
-            return false;
-    }
-    
-    std::string strLine;
-    makeLinePrefix(nLevel, strLine);
-
-    //log
-    std::string strLogMsg;
+    if (nBytes > 0)
+        m_nThreadBufferSize = nBytes;
+}
 
-    //ȼһ²ĳȣԱڷռ
-    va_list ap;
-    va_start(ap, pszFmt);
-    int nLogMsgLength = vsnprintf(nullptr, 0, pszFmt, ap);
-    va_end(ap);
+void CAsyncLog::setMaxBufferSize(size_t nBytes)
+{
+    std::lock_guard<std::mutex> lock_guard(m_mutexRings);
+    m_nMaxBufferSize = nBytes;
+}
 
-    //һ\0
-    if ((int)strLogMsg.capacity() < nLogMsgLength + 1)
-    {
-        strLogMsg.resize(nLogMsgLength + 1);
-    }
-    va_list aq;
-    va_start(aq, pszFmt);
-    vsnprintf((char*)strLogMsg.data(), strLogMsg.capacity(), pszFmt, aq);
-    va_end(aq);
+void CAsyncLog::setOverflowPolicy(LOG_OVERFLOW_POLICY nPolicy)
+{
+    if (nPolicy < LOG_OVERFLOW_BLOCK || nPolicy > LOG_OVERFLOW_DROP)
+        return;
 
-    //stringȷlengthԣָһlength
-    std::string strMsgFormal;
-    strMsgFormal.append(strLogMsg.c_str(), nLogMsgLength);
+    m_nOverflowPolicy = nPolicy;
+}
 
-    //־ضϣ־ֻȡǰMAX_LINE_LENGTHַ
-    if (m_bTruncateLongLog)
-        strMsgFormal = strMsgFormal.substr(0, MAX_LINE_LENGTH);
+uint64_t CAsyncLog::droppedCount()
+{
+    uint64_t nDropped = 0;
+    for (const auto& nCount : m_nDropped)
+        nDropped += nCount.load(std::memory_order_relaxed);
+    return nDropped;
+}
 
-    strLine += strMsgFormal;
+void CAsyncLog::setCrashBufferDir(const char* pszDir)
+{
+    std::lock_guard<std::mutex> lock_guard(m_mutexRings);
+    m_strCrashBufferDir = pszDir != nullptr ? pszDir : "";
+    //ring files only hold the site ids of deferred records, the sites go next to them
+    LogFormatSite::saveTo(m_strCrashBufferDir.empty() ? std::string() : m_strCrashBufferDir + "/" + std::to_string(currentProcessID()) + kCrashSitesSuffix);
+}
 
-    //̨Żÿһĩβһз
-    if (!m_strFileName.empty())
+size_t CAsyncLog::recoverCrashBuffers(const char* pszDir, std::string* pText/* = nullptr*/)
+{
+    //the rings of every dead process, a deque so that the records keep pointing into data
+    struct RecoveredRing
     {
-        strLine += "\n";
-    }
-	
-    if (nLevel != LOG_LEVEL_FATAL)
+        std::string                 path;
+        int64_t                     pid;
+        std::string                 label;
+        std::string                 data;
+        std::vector<LogRing::Record> records;
+    };
+    std::deque<RecoveredRing> rings;
+    for (const std::string& strPath : listCrashBufferFiles(pszDir, kCrashBufferSuffix))
     {
-        std::lock_guard<std::mutex> lock_guard(m_mutexWrite);
-        m_listLinesToWrite.push_back(strLine);
-        m_cvWrite.notify_one();
+        rings.emplace_back();
+        RecoveredRing& ring = rings.back();
+        ring.path = strPath;
+        //a file of a live process is still being written, ours included
+        if (!LogRing::readFile(strPath, &ring.pid, &ring.label, &ring.data, &ring.records)
+            || ring.pid == currentProcessID() || processAlive(ring.pid))
+            rings.pop_back();
     }
-    else
+
+    std::sort(rings.begin(), rings.end(), [](const RecoveredRing& a, const RecoveredRing& b) { return a.pid < b.pid; });
+    std::string strDir(pszDir != nullptr && pszDir[0] != 0 ? pszDir : ".");
+    size_t nLines = 0;
+    std::string strLine;
+    for (size_t nFirst = 0; nFirst < rings.size();)
     {
-        //ΪFATAL־crash򣬲ȡͬд־ķ
-        std::cout << strLine << std::endl;
-#ifdef _WIN32
-        OutputDebugStringA(strLine.c_str());
-        OutputDebugStringA("\n");
-#endif
-        
-        if (!m_strFileName.empty())
+        std::string strSitesPath = strDir + "/" + std::to_string(rings[nFirst].pid) + kCrashSitesSuffix;
+        std::vector<LogFormatSite::Saved> vecSites = LogFormatSite::readSaved(strSitesPath);
+
+        //all records of one process, oldest first
+        size_t nEnd = nFirst;
+        std::vector<std::pair<const LogRing::Record*, const RecoveredRing*>> vecRecords;
+        while (nEnd < rings.size() && rings[nEnd].pid == rings[nFirst].pid)
         {
-            if (m_hLogFile == nullptr)
-            {
-                //½ļ
-                char szNow[64];
-                time_t now = time(nullptr);
-                tm time;
-#ifdef _WIN32
-                localtime_s(&time, &now);
-#else
-                localtime_r(&now, &time);
-#endif
-                strftime(szNow, sizeof(szNow), "%Y%m%d%H%M%S", &time);
+            for (const LogRing::Record& record : rings[nEnd].records)
+                vecRecords.push_back(std::make_pair(&record, &rings[nEnd]));
+            ++nEnd;
+        }
+        std::stable_sort(vecRecords.begin(), vecRecords.end(), [](const std::pair<const LogRing::Record*, const RecoveredRing*>& a,
+                                                                  const std::pair<const LogRing::Record*, const RecoveredRing*>& b)
+        {
+            return a.first->timestamp < b.first->timestamp;
+        });
 
-                std::string strNewFileName(m_strFileName);
-                strNewFileName += ".";
-                strNewFileName += szNow;
-                strNewFileName += ".";
-                strNewFileName += m_strFileNamePID;
-                strNewFileName += ".log";
-                if (!createNewFile(strNewFileName.c_str()))
-                    return false;
-            }// end inner if 
+        if (!vecRecords.empty())
+        {
+            char szLine[kMaxPrefixLength + 160];
+            size_t nThreadIDLength;
+            const char* pszThreadID = threadIDText(&nThreadIDLength);
+            size_t nLength = makeLinePrefix(LOG_LEVEL_WARNING, Timestamp::now().microSecondsSinceEpoch(), pszThreadID, nThreadIDLength, szLine);
+            int n = snprintf(szLine + nLength, sizeof(szLine) - nLength, "%llu unwritten log lines of process %lld recovered:\n",
+                             static_cast<unsigned long long>(vecRecords.size()), static_cast<long long>(rings[nFirst].pid));
+            if (n > 0)
+                nLength += static_cast<size_t>(n) < sizeof(szLine) - nLength ? static_cast<size_t>(n) : sizeof(szLine) - nLength - 1;
+            if (pText != nullptr)
+                pText->append(szLine, nLength);
+            else
+                writeLines(szLine, nLength, LOG_LEVEL_WARNING);
+        }
 
-           writeToFile(strLine);
+        for (const auto& item : vecRecords)
+        {
+            const LogRing::Record& record = *item.first;
+            long nLevel = static_cast<long>(record.tag & ~kDeferredTag);
+            if ((record.tag & kDeferredTag) == 0)
+            {
+                strLine.assign(record.data, record.length);
+            }
+            else
+            {
+                //the site ids are only known to the sites file of the process
+                uint32_t nSiteID = 0;
+                if (record.length >= sizeof(nSiteID))
+                    memcpy(&nSiteID, record.data, sizeof(nSiteID));
+                const LogFormatSite::Saved* pSite = record.length >= sizeof(nSiteID) && nSiteID < vecSites.size()
+                    && !vecSites[nSiteID].format.empty() ? &vecSites[nSiteID] : nullptr;
+
+                strLine.resize(kMaxPrefixLength + kMaxLocationLength);
+                size_t nHeadLength = makeLinePrefix(nLevel, record.timestamp, item.second->label.c_str(), item.second->label.length(), &strLine[0]);
+                if (pSite != nullptr)
+                {
+                    nHeadLength += makeLocation(pSite->fileName.c_str(), pSite->lineNo, &strLine[nHeadLength]);
+                    strLine.resize(nHeadLength);
+                    LogFormatSite::formatMessage(pSite->format.c_str(), record.data + sizeof(nSiteID), record.length - sizeof(nSiteID), strLine);
+                    if (m_bTruncateLongLog && strLine.length() > nHeadLength + MAX_LINE_LENGTH)
+                        strLine.resize(nHeadLength + MAX_LINE_LENGTH);
+                    strLine += '\n';
+                }
+                else
+                {
+                    strLine.resize(nHeadLength);
+                    strLine += "<deferred line, its format is lost with the process>\n";
+                }
+            }
+            if (pText != nullptr)
+                pText->append(strLine);
+            else
+                writeLines(strLine.c_str(), strLine.length(), nLevel);
+            ++nLines;
+        }
 
-        }// end outer-if
+        for (size_t i = nFirst; i < nEnd; ++i)
+            ::remove(rings[i].path.c_str());
+        nFirst = nEnd;
+    }
 
-        //ócrash
-        crash();
+    //the sites files of dead processes, those that exited cleanly left no ring file
+    for (const std::string& strPath : listCrashBufferFiles(pszDir, kCrashSitesSuffix))
+    {
+        size_t nName = strPath.find_last_of("/\\") + 1;
+        int64_t nPid = strtoll(strPath.c_str() + nName, nullptr, 10);
+        if (nPid > 0 && nPid != currentProcessID() && !processAlive(nPid))
+            ::remove(strPath.c_str());
     }
-    
 
-    return true;
+    if (pText == nullptr)
+        flushSinks();
+    return nLines;
 }
 
-bool CAsyncLog::output(long nLevel, const char* pszFileName, int nLineNo, const char* pszFmt, ...)
+bool CAsyncLog::isRunning()
+{
+    return m_bRunning;
+}
+
+bool CAsyncLog::output(long nLevel, const char* pszFmt, ...)
 {
     if (nLevel != LOG_LEVEL_CRITICAL)
     {
@@ -191,353 +480,669 @@ bool CAsyncLog::output(long nLevel, const char* pszFileName, int nLineNo, const
             return false;
     }
 
-    std::string strLine;
-    makeLinePrefix(nLevel, strLine);
-
-    //ǩ
-    char szFileName[512] = { 0 };
-    snprintf(szFileName, sizeof(szFileName), "[%s:%d]", pszFileName, nLineNo);
-    strLine += szFileName;
+    va_list ap;
+    va_start(ap, pszFmt);
+    bool bResult = outputV(nLevel, nullptr, 0, pszFmt, ap);
+    va_end(ap);
+    return bResult;
+}
 
-    //־
-    std::string strLogMsg;
+bool CAsyncLog::output(long nLevel, const char* pszFileName, int nLineNo, const char* pszFmt, ...)
+{
+    if (nLevel != LOG_LEVEL_CRITICAL)
+    {
+        if (nLevel < m_nCurrentLevel)
+            return false;
+    }
 
-    //ȼһ²ĳȣԱڷռ
     va_list ap;
     va_start(ap, pszFmt);
-    int nLogMsgLength = vsnprintf(nullptr, 0, pszFmt, ap);
+    bool bResult = outputV(nLevel, pszFileName, nLineNo, pszFmt, ap);
     va_end(ap);
+    return bResult;
+}
 
-    //һ\0
-    if ((int)strLogMsg.capacity() < nLogMsgLength + 1)
+size_t CAsyncLog::makeLocation(const char* pszFileName, int nLineNo, char* pszDest)
+{
+    if (pszFileName == nullptr)
+        return 0;
+
+    //ǩ "[file:line]", without going through printf
+    size_t nFileNameLength = strlen(pszFileName);
+    if (nFileNameLength > kMaxLocationLength - 16)
+        nFileNameLength = kMaxLocationLength - 16;
+    size_t nLength = 0;
+    pszDest[nLength++] = '[';
+    memcpy(pszDest + nLength, pszFileName, nFileNameLength);
+    nLength += nFileNameLength;
+    pszDest[nLength++] = ':';
+
+    char szDigits[12];
+    size_t nDigits = 0;
+    unsigned int nLine = nLineNo > 0 ? static_cast<unsigned int>(nLineNo) : 0;
+    do
     {
-        strLogMsg.resize(nLogMsgLength + 1);
-    }
-    va_list aq;
-    va_start(aq, pszFmt);
-    vsnprintf((char*)strLogMsg.data(), strLogMsg.capacity(), pszFmt, aq);
-    va_end(aq);
+        szDigits[nDigits++] = static_cast<char>('0' + nLine % 10);
+        nLine /= 10;
+    } while (nLine != 0);
+    while (nDigits > 0)
+        pszDest[nLength++] = szDigits[--nDigits];
+
+    pszDest[nLength++] = ']';
+    return nLength;
+}
 
-    //stringȷlengthԣָһlength
-    std::string strMsgFormal;
-    strMsgFormal.append(strLogMsg.c_str(), nLogMsgLength);
+size_t CAsyncLog::formatLine(long nLevel, int64_t nMicroseconds, const char* pszFileName, int nLineNo,
+                             const char* pszFmt, va_list ap, char* pszDest, size_t nCapacity, size_t* pMsgLength)
+{
+    size_t nThreadIDLength;
+    const char* pszThreadID = threadIDText(&nThreadIDLength);
+    size_t nLength = makeLinePrefix(nLevel, nMicroseconds, pszThreadID, nThreadIDLength, pszDest);
+    nLength += makeLocation(pszFileName, nLineNo, pszDest + nLength);
+
+    //one vsnprintf, the newline takes the place of its terminating NUL
+    size_t nAvail = nCapacity - nLength;
+    int nMsgLength = vsnprintf(pszDest + nLength, nAvail, pszFmt, ap);
+    if (nMsgLength < 0)
+        nMsgLength = 0;
+    *pMsgLength = static_cast<size_t>(nMsgLength);
 
     //־ضϣ־ֻȡǰMAX_LINE_LENGTHַ
-    if (m_bTruncateLongLog)
-        strMsgFormal = strMsgFormal.substr(0, MAX_LINE_LENGTH);
+    size_t nWritten = *pMsgLength < nAvail ? *pMsgLength : nAvail - 1;
+    if (m_bTruncateLongLog && nWritten > MAX_LINE_LENGTH)
+        nWritten = MAX_LINE_LENGTH;
+    nLength += nWritten;
+    pszDest[nLength++] = '\n';
+    return nLength;
+}
 
-    strLine += strMsgFormal;
+bool CAsyncLog::outputV(long nLevel, const char* pszFileName, int nLineNo, const char* pszFmt, va_list ap)
+{
+    int64_t nNow = Timestamp::now().microSecondsSinceEpoch();
+    size_t nHeadLength = kMaxPrefixLength + kMaxLocationLength;
+    size_t nMsgLength = 0;
+    va_list aq;
+
+    if (nLevel != LOG_LEVEL_FATAL)
+    {
+        //format straight into the ring, most lines fit the first reservation
+        LogRing* pRing = threadRing();
+        size_t nMaxLength = pRing->maxRecordSize();
+        size_t nCapacity = nHeadLength + kFastMessageLength < nMaxLength ? nHeadLength + kFastMessageLength : nMaxLength;
+        char* pszRecord = beginRecord(pRing, nCapacity, nLevel);
+        if (pszRecord == nullptr)
+            return false;
 
-    //̨Żÿһĩβһз
-    if (!m_strFileName.empty())
-    { 
-        strLine += "\n";
+        va_copy(aq, ap);
+        size_t nLength = formatLine(nLevel, nNow, pszFileName, nLineNo, pszFmt, aq, pszRecord, nCapacity, &nMsgLength);
+        va_end(aq);
+
+        //an oversized message is formatted once more into a reservation that fits it
+        if (nMsgLength >= nCapacity - nHeadLength && !m_bTruncateLongLog && nCapacity < nMaxLength)
+        {
+            nCapacity = nHeadLength + nMsgLength + 1 < nMaxLength ? nHeadLength + nMsgLength + 1 : nMaxLength;
+            pszRecord = beginRecord(pRing, nCapacity, nLevel);
+            if (pszRecord == nullptr)
+                return false;
+
+            va_copy(aq, ap);
+            nLength = formatLine(nLevel, nNow, pszFileName, nLineNo, pszFmt, aq, pszRecord, nCapacity, &nMsgLength);
+            va_end(aq);
+        }
+
+        endRecord(pRing, nLength, static_cast<uint32_t>(nLevel), nNow);
+        return true;
     }
 
-    if (nLevel != LOG_LEVEL_FATAL)
+    //FATAL: a stack buffer, or the heap for an oversized message
+    char szLine[kMaxPrefixLength + kMaxLocationLength + kFastMessageLength];
+    va_copy(aq, ap);
+    size_t nLength = formatLine(nLevel, nNow, pszFileName, nLineNo, pszFmt, aq, szLine, sizeof(szLine), &nMsgLength);
+    va_end(aq);
+    std::string strLine;
+    if (nMsgLength >= kFastMessageLength && !m_bTruncateLongLog)
     {
-        std::lock_guard<std::mutex> lock_guard(m_mutexWrite);
-        m_listLinesToWrite.push_back(strLine);
-        m_cvWrite.notify_one();
+        strLine.resize(nHeadLength + nMsgLength + 1);
+        va_copy(aq, ap);
+        nLength = formatLine(nLevel, nNow, pszFileName, nLineNo, pszFmt, aq, &strLine[0], strLine.size(), &nMsgLength);
+        va_end(aq);
+        strLine.resize(nLength);
     }
     else
     {
-        //ΪFATAL־crash򣬲ȡͬд־ķ
-        std::cout << strLine << std::endl;
-#ifdef _WIN32
-        OutputDebugStringA(strLine.c_str());
-        OutputDebugStringA("\n");
-#endif
+        strLine.assign(szLine, nLength);
+    }
 
-        if (!m_strFileName.empty())
-        {
-            if (m_hLogFile == nullptr)
-            {
-                //½ļ
-                char szNow[64];
-                time_t now = time(nullptr);
-                tm time;
-#ifdef _WIN32
-                localtime_s(&time, &now);
+    //ΪFATAL־crash򣬲ȡͬд־ķ
+    bool bNoSinks;
+    {
+        std::lock_guard<std::mutex> lock_guard(m_mutexSinks);
+        bNoSinks = m_vecSinks.empty();
+    }
+    if (bNoSinks)
+    {
+#ifdef WIN32
+        ::_write(1, strLine.c_str(), static_cast<unsigned int>(strLine.length()));
 #else
-                localtime_r(&now, &time);
+        ssize_t nWritten = ::write(1, strLine.c_str(), strLine.length());
+        (void)nWritten;
 #endif
-                strftime(szNow, sizeof(szNow), "%Y%m%d%H%M%S", &time);
+    }
+    writeLines(strLine.c_str(), strLine.length(), nLevel);
+    flushSinks();
 
-                std::string strNewFileName(m_strFileName);
-                strNewFileName += ".";
-                strNewFileName += szNow;
-                strNewFileName += ".";
-                strNewFileName += m_strFileNamePID;
-                strNewFileName += ".log";
-                if (!createNewFile(strNewFileName.c_str()))
-                    return false;
-            }// end inner if 
+    //ócrash
+    crash();
 
-            writeToFile(strLine);     
-        }// end outer-if
+    return true;
+}
 
-        //ócrash
-        crash();
+bool CAsyncLog::outputBinary(const unsigned char* buffer, size_t size, size_t nMaxBytes/* = 0*/)
+{
+    //a dump is DEBUG, don't format one that would not be written
+    if (!levelEnabled(LOG_LEVEL_DEBUG))
+        return false;
+
+    LogRing* pRing = threadRing();
+    size_t nBytes = nMaxBytes > 0 && nMaxBytes < size ? nMaxBytes : size;
+    //the dump is one ring record, cut it to what fits
+    size_t nMaxRows = pRing->maxRecordSize() > kMaxBinaryNoteLength ? (pRing->maxRecordSize() - kMaxBinaryNoteLength) / kMaxHexRowLength : 0;
+    if (nBytes > nMaxRows * kHexRowBytes)
+        nBytes = nMaxRows * kHexRowBytes;
+
+    size_t nMaxLength = kMaxBinaryNoteLength + (nBytes + kHexRowBytes - 1) / kHexRowBytes * kMaxHexRowLength;
+    char* pszRecord = beginRecord(pRing, nMaxLength, LOG_LEVEL_DEBUG);
+    if (pszRecord == nullptr)
+        return false;
+
+    int n = snprintf(pszRecord, kMaxBinaryNoteLength / 2, "address[%ld] size[%zu] \n", (long)buffer, size);
+    size_t nLength = n > 0 ? static_cast<size_t>(n) : 0;
+    nLength += formatHexDump(buffer, nBytes, pszRecord + nLength);
+    if (nBytes < size)
+    {
+        n = snprintf(pszRecord + nLength, kMaxBinaryNoteLength / 2, "... %zu more bytes\n", size - nBytes);
+        nLength += n > 0 ? static_cast<size_t>(n) : 0;
     }
+    endRecord(pRing, nLength, LOG_LEVEL_DEBUG, Timestamp::now().microSecondsSinceEpoch());
 
     return true;
 }
 
-bool CAsyncLog::outputBinary(unsigned char* buffer, size_t size)
+size_t CAsyncLog::formatHexDump(const unsigned char* buffer, size_t size, char* pszDest)
 {
-    //std::string strBinary;
-    std::ostringstream os;
-
-    static const size_t PRINTSIZE = 512;
-    char szbuf[PRINTSIZE * 3 + 8];
-
-    size_t lsize = 0;
-    size_t lprintbufsize = 0;
-    int index = 0;
-    os << "address[" << (long)buffer << "] size[" << size << "] \n";
-    while (true)
+    //"000000  0011...  ...eeff\n" per 32 bytes: row number, then two groups of 16 bytes
+    char* p = pszDest;
+    for (size_t nRow = 0; nRow * kHexRowBytes < size; ++nRow)
     {
-        memset(szbuf, 0, sizeof(szbuf));
-        if (size > lsize)
+        char szRow[20];
+        size_t nDigits = 0;
+        size_t nValue = nRow;
+        do
+        {
+            szRow[nDigits++] = static_cast<char>('0' + nValue % 10);
+            nValue /= 10;
+        } while (nValue > 0 || nDigits < 6);
+        while (nDigits > 0)
+            *p++ = szRow[--nDigits];
+        *p++ = ' ';
+
+        const unsigned char* pRow = buffer + nRow * kHexRowBytes;
+        size_t nRowBytes = size - nRow * kHexRowBytes < kHexRowBytes ? size - nRow * kHexRowBytes : kHexRowBytes;
+        size_t i = 0;
+#ifdef LOG_HEX_SSE2
+        for (; i + 16 <= nRowBytes; i += 16)
         {
-            lprintbufsize = (size - lsize);
-            lprintbufsize = lprintbufsize > PRINTSIZE ? PRINTSIZE : lprintbufsize;
-            formLog(index, szbuf, sizeof(szbuf), buffer + lsize, lprintbufsize);
-            size_t len = strlen(szbuf);
-
-            //if (stream().buffer().avail() < static_cast<int>(len))
-            //{
-            //    stream() << szbuf + (len - stream().buffer().avail());
-            //    break;
-            //}
-            //else
-            //{
-            os << szbuf;
-            //}
-            lsize += lprintbufsize;
+            *p++ = ' ';
+            hexGroupSse2(pRow + i, p);
+            p += 32;
         }
-        else
+#endif
+        for (; i < nRowBytes; ++i)
         {
-            break;
+            if (i % 16 == 0)
+                *p++ = ' ';
+            memcpy(p, kHexTable.pairs + 2 * pRow[i], 2);
+            p += 2;
         }
+        *p++ = '\n';
     }
+    return static_cast<size_t>(p - pszDest);
+}
 
-    std::lock_guard<std::mutex> lock_guard(m_mutexWrite);
-    m_listLinesToWrite.push_back(os.str());
-    m_cvWrite.notify_one();
+size_t CAsyncLog::makeLinePrefix(long nLevel, int64_t nMicroseconds, const char* pszThreadID, size_t nThreadIDLength, char* pszDest)
+{
+    //
+    static const char* const kLevelNames[] = { "[TRACE]", "[DEBUG]", "[INFO]", "[WARN]", "[ERROR]", "[SYSE]", "[FATAL]", "[CRITICAL]" };
+    static const size_t kLevelNameLengths[] = { 7, 7, 6, 6, 7, 6, 7, 10 };
+    size_t nLevelIndex = nLevel >= LOG_LEVEL_TRACE && nLevel <= LOG_LEVEL_CRITICAL ? static_cast<size_t>(nLevel) : LOG_LEVEL_INFO;
+    size_t nLength = kLevelNameLengths[nLevelIndex];
+    memcpy(pszDest, kLevelNames[nLevelIndex], nLength);
+
+    //ʱ: the date and time are formatted once per second per thread, then only the milliseconds change
+    thread_local time_t t_nCachedSecond = -1;
+    thread_local char t_szCachedTime[32];
+    thread_local size_t t_nCachedTimeLength = 0;
+    time_t nSecond = static_cast<time_t>(nMicroseconds / Timestamp::kMicroSecondsPerSecond);
+    if (nSecond != t_nCachedSecond)
+    {
+        tm time;
+#ifdef _WIN32
+        localtime_s(&time, &nSecond);
+#else
+        localtime_r(&nSecond, &time);
+#endif
+        int n = snprintf(t_szCachedTime, sizeof(t_szCachedTime), "[[%04d-%02d-%02d %02d:%02d:%02d:",
+            time.tm_year + 1900, time.tm_mon + 1, time.tm_mday, time.tm_hour, time.tm_min, time.tm_sec);
+        t_nCachedTimeLength = n > 0 && n < (int)sizeof(t_szCachedTime) ? static_cast<size_t>(n) : 0;
+        t_nCachedSecond = nSecond;
+    }
+    memcpy(pszDest + nLength, t_szCachedTime, t_nCachedTimeLength);
+    nLength += t_nCachedTimeLength;
 
-    return true;
+    int nMillisecond = static_cast<int>(nMicroseconds % Timestamp::kMicroSecondsPerSecond / 1000);
+    pszDest[nLength++] = static_cast<char>('0' + nMillisecond / 100);
+    pszDest[nLength++] = static_cast<char>('0' + nMillisecond / 10 % 10);
+    pszDest[nLength++] = static_cast<char>('0' + nMillisecond % 10);
+    pszDest[nLength++] = ']';
+    pszDest[nLength++] = ']';
+
+    //ǰ߳Ϣ
+    memcpy(pszDest + nLength, pszThreadID, nThreadIDLength);
+    nLength += nThreadIDLength;
+
+    return nLength;
 }
 
-const char* CAsyncLog::ullto4Str(int n)
+void CAsyncLog::crash()
 {
-    static char buf[64 + 1];
-    memset(buf, 0, sizeof(buf));
-    sprintf(buf, "%06u", n);
-    return buf;
+    char* p = nullptr;
+    *p = 0;
 }
 
-char* CAsyncLog::formLog(int& index, char* szbuf, size_t size_buf, unsigned char* buffer, size_t size)
+LogRing* CAsyncLog::threadRing()
 {
-    size_t len = 0;
-    size_t lsize = 0;
-    size_t headlen = 0;
-    char szhead[64 + 1] = { 0 };
-    char szchar[17] = "0123456789abcdef";
-    //memset(szhead, 0, sizeof(szhead));
-    while (size > lsize && len + 10 < size_buf)
+    if (!t_ringOwner.ring)
     {
-        if (lsize % 32 == 0)
+        std::lock_guard<std::mutex> lock_guard(m_mutexRings);
+        //near the cap, halve the ring until it fits what is left
+        size_t nSize = m_nThreadBufferSize;
+        if (m_nMaxBufferSize > 0)
         {
-            if (0 != headlen)
-            {
-                szbuf[len++] = '\n';
-            }
+            size_t nLeft = m_nMaxBufferSize > m_nBufferSize ? m_nMaxBufferSize - m_nBufferSize : 0;
+            while (nSize > kMinThreadBufferSize && LogRing::roundCapacity(nSize) > nLeft)
+                nSize /= 2;
+            if (nSize < kMinThreadBufferSize)
+                nSize = kMinThreadBufferSize;
+        }
 
-            memset(szhead, 0, sizeof(szhead));
-            strncpy(szhead, ullto4Str(index++), sizeof(szhead) - 1);
-            headlen = strlen(szhead);
-            szhead[headlen++] = ' ';
+        std::shared_ptr<LogRing> spRing;
+        if (m_strCrashBufferDir.empty())
+        {
+            spRing = std::make_shared<LogRing>(nSize);
+        }
+        else
+        {
+            std::string strPath = m_strCrashBufferDir + "/" + std::to_string(currentProcessID()) + "." + std::to_string(m_nCrashBufferFiles++) + kCrashBufferSuffix;
+            spRing = std::make_shared<LogRing>(nSize, strPath);
+        }
+        //the writer names the thread with it in the lines it formats for LOG*_DEFER
+        size_t nThreadIDLength;
+        const char* pszThreadID = threadIDText(&nThreadIDLength);
+        spRing->setLabel(pszThreadID, nThreadIDLength);
+        m_nBufferSize += spRing->capacity();
+        m_vecRings.push_back(spRing);
+        m_nRingsVersion.fetch_add(1, std::memory_order_release);
+        t_ringOwner.ring = spRing;
+    }
+    return t_ringOwner.ring.get();
+}
 
-            strcat(szbuf, szhead);
-            len += headlen;
+char* CAsyncLog::beginRecord(LogRing* pRing, size_t nMaxLength, long nLevel)
+{
+    LOG_OVERFLOW_POLICY nPolicy = m_nOverflowPolicy;
+    size_t nLevelIndex = nLevel >= LOG_LEVEL_TRACE && nLevel <= LOG_LEVEL_CRITICAL ? static_cast<size_t>(nLevel) : LOG_LEVEL_INFO;
+    if (nPolicy == LOG_OVERFLOW_DROP_LOW_LEVELS && nLevel < LOG_LEVEL_WARNING)
+    {
+        //INFO may fill three quarters of the ring, TRACE and DEBUG half of it
+        size_t nLimit = nLevel == LOG_LEVEL_INFO ? pRing->capacity() / 4 * 3 : pRing->capacity() / 2;
+        if (pRing->usedBytes() + nMaxLength > nLimit)
+        {
+            m_nDropped[nLevelIndex].fetch_add(1, std::memory_order_relaxed);
+            wakeWriter(false);
+            return nullptr;
+        }
+    }
 
+    char* pszRecord = pRing->beginWrite(nMaxLength);
+    if (pszRecord == nullptr && nPolicy == LOG_OVERFLOW_BLOCK && m_bRunning.load(std::memory_order_acquire))
+    {
+        //the ring is full: sleep until releaseRings() gives space back. The fences pair
+        //with the one there, either the writer sees a waiter or the waiter sees the space
+        m_nSpaceWaiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::unique_lock<std::mutex> guard(m_mutexSpace);
+        while ((pszRecord = pRing->beginWrite(nMaxLength)) == nullptr && m_bRunning.load(std::memory_order_acquire))
+        {
+            wakeWriter(true);
+            m_cvSpace.wait_for(guard, std::chrono::milliseconds(kSpaceWaitMs));
         }
-        if (lsize % 16 == 0 && 0 != headlen)
-            szbuf[len++] = ' ';
-        szbuf[len++] = szchar[(buffer[lsize] >> 4) & 0xf];
-        szbuf[len++] = szchar[(buffer[lsize]) & 0xf];
-        lsize++;
+        guard.unlock();
+        m_nSpaceWaiters.fetch_sub(1, std::memory_order_relaxed);
     }
-    szbuf[len++] = '\n';
-    szbuf[len++] = '\0';
-    return szbuf;
+
+    //the ring is still full if nobody writes or the policy drops
+    if (pszRecord == nullptr)
+    {
+        m_nDropped[nLevelIndex].fetch_add(1, std::memory_order_relaxed);
+        wakeWriter(false);
+    }
+    return pszRecord;
 }
 
-void CAsyncLog::makeLinePrefix(long nLevel, std::string& strPrefix)
+void CAsyncLog::endRecord(LogRing* pRing, size_t nLength, uint32_t nTag, int64_t nMicroseconds)
 {
-    //
-    strPrefix = "[INFO]";
-    if (nLevel == LOG_LEVEL_TRACE)
-        strPrefix = "[TRACE]";
-    else if (nLevel == LOG_LEVEL_DEBUG)
-        strPrefix = "[DEBUG]";
-    else if (nLevel == LOG_LEVEL_WARNING)
-        strPrefix = "[WARN]";
-    else if (nLevel == LOG_LEVEL_ERROR)
-        strPrefix = "[ERROR]";
-    else if (nLevel == LOG_LEVEL_SYSERROR)
-        strPrefix = "[SYSE]";
-    else if (nLevel == LOG_LEVEL_FATAL)
-        strPrefix = "[FATAL]";
-    else if (nLevel == LOG_LEVEL_CRITICAL)
-        strPrefix = "[CRITICAL]";
-
-    //ʱ
-    char szTime[64] = { 0 };
-    getTime(szTime, sizeof(szTime));
-
-    strPrefix += "[";
-    strPrefix += szTime;
-    strPrefix += "]";
+    pRing->endWrite(nLength, nMicroseconds, nTag);
+    //the writer polls on its own, only a filling ring is worth a wakeup
+    if (pRing->usedBytes() >= pRing->capacity() / 4)
+        wakeWriter(false);
+}
 
-    //ǰ߳Ϣ
-    char szThreadID[32] = { 0 };
-    std::ostringstream osThreadID;
-    osThreadID << std::this_thread::get_id();
-    snprintf(szThreadID, sizeof(szThreadID), "[%s]", osThreadID.str().c_str());
-    strPrefix += szThreadID;   
+char* CAsyncLog::beginDeferredRecord(size_t nLength, long nLevel)
+{
+    LogRing* pRing = threadRing();
+    if (nLength > pRing->maxRecordSize())
+        return nullptr;
+    return beginRecord(pRing, nLength, nLevel);
 }
 
-void CAsyncLog::getTime(char* pszTime, int nTimeStrLength)
-{   
-    struct timeb tp;
-    ftime(&tp);
-    
-    time_t now = tp.time;
-    tm time;
-#ifdef _WIN32
-    localtime_s(&time, &now);
-#else
-    localtime_r(&now, &time);
-#endif
-    
-    snprintf(pszTime, nTimeStrLength, "[%04d-%02d-%02d %02d:%02d:%02d:%03d]", time.tm_year + 1900, time.tm_mon + 1, time.tm_mday, time.tm_hour, time.tm_min, time.tm_sec, tp.millitm);
-    //strftime(pszTime, nTimeStrLength, "[%Y-%m-%d %H:%M:%S:]", &time);
+void CAsyncLog::endDeferredRecord(size_t nLength, long nLevel)
+{
+    endRecord(threadRing(), nLength, static_cast<uint32_t>(nLevel) | kDeferredTag, Timestamp::now().microSecondsSinceEpoch());
 }
 
-bool CAsyncLog::createNewFile(const char* pszLogFileName)
+void CAsyncLog::wakeWriter(bool bForce)
 {
-    if (m_hLogFile != nullptr)
+    if (!bForce && !m_bWriterSleeping.load(std::memory_order_relaxed))
+        return;
+
+    std::lock_guard<std::mutex> lock_guard(m_mutexWrite);
+    if (m_bWriterSleeping.load(std::memory_order_relaxed))
     {
-        fclose(m_hLogFile);
+        m_bWriterSleeping.store(false, std::memory_order_relaxed);
+        m_cvWrite.notify_one();
     }
+}
 
-    //ʼ½ļ
-    m_hLogFile = fopen(pszLogFileName, "w+");
-    return m_hLogFile != nullptr;
+void CAsyncLog::pushLine(long nLevel, const char* pszLine, size_t nLength)
+{
+    LogRing* pRing = threadRing();
+    if (nLength + 1 > pRing->maxRecordSize())
+        nLength = pRing->maxRecordSize() - 1;
+
+    bool bNewLine = nLength == 0 || pszLine[nLength - 1] != '\n';
+    size_t nNeeded = nLength + (bNewLine ? 1 : 0);
+    char* pszRecord = beginRecord(pRing, nNeeded, nLevel);
+    if (pszRecord == nullptr)
+        return;
+
+    memcpy(pszRecord, pszLine, nLength);
+    if (bNewLine)
+        pszRecord[nLength] = '\n';
+    endRecord(pRing, nNeeded, static_cast<uint32_t>(nLevel), Timestamp::now().microSecondsSinceEpoch());
 }
 
-bool CAsyncLog::writeToFile(const std::string& data)
+size_t CAsyncLog::drainRings(const std::vector<std::shared_ptr<LogRing>>& vecRings, LogBlock& block)
 {
-    //Ϊ˷ֹļһд꣬һѭд
-    std::string strLocal(data);
-    size_t ret = 0;
-    while (true)
+    //k-way merge of the rings by timestamp, the front record of each is in vecFronts
+    std::vector<LogRing::Record> vecFronts(vecRings.size());
+    std::vector<bool> vecHasFront(vecRings.size());
+    for (size_t i = 0; i < vecRings.size(); ++i)
+        vecHasFront[i] = vecRings[i]->peek(&vecFronts[i]);
+
+    size_t nTotal = 0;
+    while (nTotal < kMaxBytesPerRound)
     {
-        ret = fwrite(strLocal.c_str(), 1, strLocal.length(), m_hLogFile);
-        if (ret <= 0)
-            return false;
-        else if (ret <= (int)strLocal.length())
+        size_t nOldest = vecRings.size();
+        for (size_t i = 0; i < vecRings.size(); ++i)
         {
-            strLocal.erase(0, ret);
+            if (vecHasFront[i] && (nOldest == vecRings.size() || vecFronts[i].timestamp < vecFronts[nOldest].timestamp))
+                nOldest = i;
         }
-
-        if (strLocal.empty())
+        if (nOldest == vecRings.size())
             break;
+
+        const LogRing::Record& record = vecFronts[nOldest];
+        uint64_t nWrites = block.writes;
+        if ((record.tag & kDeferredTag) != 0)
+            appendDeferred(*vecRings[nOldest], record.data, record.length, record.tag, record.timestamp, block);
+        else
+            appendToBlock(block, record.data, record.length, static_cast<long>(record.tag));
+        nTotal += record.length;
+
+        //what was popped before is written now, its space may be reused
+        if (block.writes != nWrites)
+            releaseRings(vecRings);
+        vecRings[nOldest]->pop();
+        vecHasFront[nOldest] = vecRings[nOldest]->peek(&vecFronts[nOldest]);
     }
-    
 
-    //::OutputDebugStringA(strDebugInfo.c_str());
+    if (block.used > 0)
+        writeBlock(block);
+    releaseRings(vecRings);
+    return nTotal;
+}
 
-    fflush(m_hLogFile);
+void CAsyncLog::releaseRings(const std::vector<std::shared_ptr<LogRing>>& vecRings)
+{
+    for (const auto& spRing : vecRings)
+        spRing->release();
 
-    return true;
+    //producers of a full ring sleep in beginRecord()
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_nSpaceWaiters.load(std::memory_order_relaxed) > 0)
+    {
+        std::lock_guard<std::mutex> lock_guard(m_mutexSpace);
+        m_cvSpace.notify_all();
+    }
 }
 
-void CAsyncLog::crash()
+void CAsyncLog::appendToBlock(LogBlock& block, const char* pszData, size_t nLength, long nLevel)
 {
-    char* p = nullptr;
-    *p = 0;
+    if (nLength > block.avail())
+        writeBlock(block);
+    if (nLength > block.avail())
+        writeLines(pszData, nLength, nLevel);
+    else
+        block.append(pszData, nLength, nLevel);
 }
 
-void CAsyncLog::writeThreadProc()
+void CAsyncLog::appendDeferred(const LogRing& ring, const char* pszRecord, size_t nLength, uint32_t nTag, int64_t nMicroseconds, LogBlock& block)
 {
-    m_bRunning = true;
+    uint32_t nSiteID;
+    if (nLength < sizeof(nSiteID))
+        return;
+    memcpy(&nSiteID, pszRecord, sizeof(nSiteID));
+    const LogFormatSite* pSite = LogFormatSite::find(nSiteID);
+    if (pSite == nullptr)
+        return;
 
-    while (true)
-    {        
-        if (!m_strFileName.empty())
+    //only the writer thread formats deferred records, the line keeps its capacity
+    static std::string s_strLine;
+    s_strLine.resize(kMaxPrefixLength + kMaxLocationLength);
+    size_t nHeadLength = makeLinePrefix(static_cast<long>(nTag & ~kDeferredTag), nMicroseconds, ring.label(), ring.labelLength(), &s_strLine[0]);
+    nHeadLength += makeLocation(pSite->fileName, pSite->lineNo, &s_strLine[nHeadLength]);
+    s_strLine.resize(nHeadLength);
+    pSite->formatMessage(pszRecord + sizeof(nSiteID), nLength - sizeof(nSiteID), s_strLine);
+
+    //־ضϣ־ֻȡǰMAX_LINE_LENGTHַ
+    if (m_bTruncateLongLog && s_strLine.length() > nHeadLength + MAX_LINE_LENGTH)
+        s_strLine.resize(nHeadLength + MAX_LINE_LENGTH);
+    s_strLine += '\n';
+    appendToBlock(block, s_strLine.c_str(), s_strLine.length(), static_cast<long>(nTag & ~kDeferredTag));
+}
+
+void CAsyncLog::removeClosedRings()
+{
+    std::lock_guard<std::mutex> lock_guard(m_mutexRings);
+    LogRing::Record record;
+    for (auto it = m_vecRings.begin(); it != m_vecRings.end();)
+    {
+        //closed first: its thread is gone, so empty now means empty for good
+        if ((*it)->closed() && !(*it)->peek(&record))
         {
-            if (m_hLogFile == nullptr || m_nCurrentWrittenSize >= m_nFileRollSize)
-            {
-                //m_nCurrentWrittenSizeС
-                m_nCurrentWrittenSize = 0;
+            m_nBufferSize -= (*it)->capacity();
+            it = m_vecRings.erase(it);
+            m_nRingsVersion.fetch_add(1, std::memory_order_release);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
 
-                //һλļСrollsize½ļ
-                char szNow[64];
-                time_t now = time(nullptr);
-                tm time;
-#ifdef _WIN32
-                localtime_s(&time, &now);
-#else
-                localtime_r(&now, &time);
-#endif
-                strftime(szNow, sizeof(szNow), "%Y%m%d%H%M%S", &time);
+void CAsyncLog::reportDropped(bool bForce)
+{
+    //only the writer thread reports
+    static uint64_t s_nReported[LOG_LEVEL_CRITICAL + 1];
+    static int64_t s_nLastReport = 0;
 
-                std::string strNewFileName(m_strFileName);
-                strNewFileName += ".";
-                strNewFileName += szNow;
-                strNewFileName += ".";
-                strNewFileName += m_strFileNamePID;
-                strNewFileName += ".log";
-                if (!createNewFile(strNewFileName.c_str()))
-                    return;
-            }// end inner if        
-        }// end outer-if
+    int64_t nNow = Timestamp::now().microSecondsSinceEpoch();
+    if (!bForce && nNow - s_nLastReport < kDropReportIntervalUs)
+        return;
 
+    static const char* const kLevelNames[] = { "trace", "debug", "info", "warning", "error", "syserror", "fatal", "critical" };
+    uint64_t nTotal = 0;
+    std::string strCounts;
+    for (size_t i = 0; i <= LOG_LEVEL_CRITICAL; ++i)
+    {
+        uint64_t nDropped = m_nDropped[i].load(std::memory_order_relaxed);
+        uint64_t nNew = nDropped - s_nReported[i];
+        s_nReported[i] = nDropped;
+        if (nNew == 0)
+            continue;
+
+        nTotal += nNew;
+        strCounts += strCounts.empty() ? " (" : ", ";
+        strCounts += kLevelNames[i];
+        strCounts += ' ';
+        strCounts += std::to_string(nNew);
+    }
+    if (nTotal == 0)
+        return;
+    s_nLastReport = nNow;
+
+    char szLine[kMaxPrefixLength + 160];
+    size_t nThreadIDLength;
+    const char* pszThreadID = threadIDText(&nThreadIDLength);
+    size_t nLength = makeLinePrefix(LOG_LEVEL_WARNING, nNow, pszThreadID, nThreadIDLength, szLine);
+    int n = snprintf(szLine + nLength, sizeof(szLine) - nLength, "%llu log lines dropped, buffer full%s)\n",
+                     static_cast<unsigned long long>(nTotal), strCounts.c_str());
+    if (n > 0)
+        nLength += static_cast<size_t>(n) < sizeof(szLine) - nLength ? static_cast<size_t>(n) : sizeof(szLine) - nLength - 1;
+    writeLines(szLine, nLength, LOG_LEVEL_WARNING);
+}
 
-        std::string strLine;
-        {
-            std::unique_lock<std::mutex> guard(m_mutexWrite);
-            while (m_listLinesToWrite.empty())
-            {
-                if (m_bExit)
-                    return;
+void CAsyncLog::writeBlock(LogBlock& block)
+{
+    if (block.used == 0)
+        return;
 
-                m_cvWrite.wait(guard);
-            }
+    LogBatch all{ block.data.get(), block.used, block.lines.data(), block.lines.size(), 0 };
+    std::lock_guard<std::mutex> lock_guard(m_mutexSinks);
+    for (const auto& spSink : m_vecSinks)
+    {
+        if (spSink->accepts(block.minLevel))
+        {
+            spSink->write(all);
+            continue;
+        }
 
-            strLine = m_listLinesToWrite.front();
-            m_listLinesToWrite.pop_front();
+        //runs of consecutive lines the sink accepts, each in one write
+        size_t i = 0;
+        while (i < all.lineCount)
+        {
+            while (i < all.lineCount && !spSink->accepts(all.lines[i].level))
+                ++i;
+            size_t nFirst = i;
+            while (i < all.lineCount && spSink->accepts(all.lines[i].level))
+                ++i;
+            if (i == nFirst)
+                break;
+
+            size_t nOrigin = nFirst == 0 ? 0 : all.lines[nFirst - 1].end;
+            LogBatch run{ all.data + nOrigin, all.lines[i - 1].end - nOrigin, all.lines + nFirst, i - nFirst, nOrigin };
+            spSink->write(run);
         }
+    }
+    block.clear();
+}
+
+void CAsyncLog::writeLines(const char* pszData, size_t nLength, long nLevel)
+{
+    LogLineEnd line{ nLength, nLevel };
+    LogBatch batch{ pszData, nLength, &line, 1, 0 };
+    std::lock_guard<std::mutex> lock_guard(m_mutexSinks);
+    for (const auto& spSink : m_vecSinks)
+    {
+        if (spSink->accepts(nLevel))
+            spSink->write(batch);
+    }
+}
 
-        
-        std::cout << strLine << std::endl;
+void CAsyncLog::flushSinks()
+{
+    std::lock_guard<std::mutex> lock_guard(m_mutexSinks);
+    for (const auto& spSink : m_vecSinks)
+        spSink->flush();
+}
 
-#ifdef _WIN32
-        OutputDebugStringA(strLine.c_str());
-        OutputDebugStringA("\n");
-#endif
+void CAsyncLog::writeThreadProc()
+{
+    m_bRunning = true;
 
-        if (!m_strFileName.empty())
+    std::vector<std::shared_ptr<LogRing>> vecRings;
+    uint64_t nRingsVersion = m_nRingsVersion.load(std::memory_order_acquire) - 1;
+    LogBlock block(kLogBlockSize);
+    int nWaitMs = 1;
+    while (true)
+    {
+        bool bExit;
         {
-            if (!writeToFile(strLine))
-                return;
+            std::lock_guard<std::mutex> lock_guard(m_mutexWrite);
+            bExit = m_bExit;
+        }
+
+        if (m_nRingsVersion.load(std::memory_order_acquire) != nRingsVersion)
+        {
+            std::lock_guard<std::mutex> lock_guard(m_mutexRings);
+            vecRings = m_vecRings;
+            nRingsVersion = m_nRingsVersion.load(std::memory_order_relaxed);
+        }
+
+        size_t nDrained = drainRings(vecRings, block);
+        reportDropped(bExit && nDrained == 0);
+        if (nDrained > 0)
+        {
+            flushSinks();
+            nWaitMs = 1;
+            continue;
+        }
+
+        //everything queued before the exit request is written
+        if (bExit)
+            break;
+
+        removeClosedRings();
 
-            m_nCurrentWrittenSize += strLine.length();
-        }     
+        //idle: wait a little longer each time, up to the flush interval
+        std::unique_lock<std::mutex> guard(m_mutexWrite);
+        if (m_bExit)
+            continue;
+        m_bWriterSleeping.store(true, std::memory_order_relaxed);
+        m_cvWrite.wait_for(guard, std::chrono::milliseconds(nWaitMs));
+        m_bWriterSleeping.store(false, std::memory_order_relaxed);
+        nWaitMs = nWaitMs * 2 < m_nFlushIntervalMs ? nWaitMs * 2 : m_nFlushIntervalMs;
     }// end outer-while-loop
 
     m_bRunning = false;
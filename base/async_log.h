@@ -2,13 +2,24 @@
 #define __ASYNC_LOG_H__
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <atomic>
 #include <string>
-#include <list>
+#include <vector>
 #include <thread>
 #include <memory>
 #include <mutex>
 #include <condition_variable>
 #include "common.h"
+#include "deferred_log.h"
+#include "log_limit.h"
+
+//checks the arguments of printf style functions at compile time
+#if defined(__GNUC__) || defined(__clang__)
+#define LOG_PRINTF_FORMAT(fmtIndex, firstArg) __attribute__((format(printf, fmtIndex, firstArg)))
+#else
+#define LOG_PRINTF_FORMAT(fmtIndex, firstArg)
+#endif
 
 BEGIN_NS(base)
 
@@ -24,21 +35,106 @@ enum LOG_LEVEL
     LOG_LEVEL_CRITICAL  //CRITICAL ־־ƣ
 };
 
+//־ʱĴ
+enum LOG_OVERFLOW_POLICY
+{
+    LOG_OVERFLOW_BLOCK,             //ȴд߳ڳռ
+    LOG_OVERFLOW_DROP_LOW_LEVELS,   //TRACE/DEBUG/INFO may fill only part of the buffer, keeping room for warnings and errors
+    LOG_OVERFLOW_DROP               //Ųµ־
+};
+
+struct LogBlock;
+class LogRing;
+class LogSink;
+
+//never called, lets the compiler check the arguments of LOG*_DEFER
+inline void logFormatCheck(const char* /*pszFmt*/, ...) LOG_PRINTF_FORMAT(1, 2);
+inline void logFormatCheck(const char* /*pszFmt*/, ...) {}
+
+///
+/// Asynchronous logger.
+///
+/// Every thread that logs appends its lines to a LogRing of its own, so
+/// producers share no lock. The writer thread merges the rings in
+/// timestamp order into a large preallocated block and hands each full
+/// block to the configured sinks (see log_sink.h), which write it with
+/// write(2) or their own transport; a sink only gets the lines at or above
+/// its own level. The writer polls the rings, backing off up to the flush
+/// interval while they stay empty; a producer only wakes it when its ring
+/// is a quarter full, or full under LOG_OVERFLOW_BLOCK.
+///
+/// LOG*_DEFER lines are not formatted by the producer at all: the ring
+/// record holds the id of the call site and the raw arguments, and the
+/// writer thread runs the printf style formatting when it drains the ring.
 class BASE_API CAsyncLog
 {
 public:
+    //־ָ̨ļʱҲļ
     static bool init(const char* pszLogFileName = nullptr, bool bTruncateLongLine = false, int64_t nRollSize = 10 * 1024 * 1024);
+    //output goes to these sinks only, e.g. a FileLogSink without a ConsoleLogSink turns the console echo off
+    static bool init(const std::vector<std::shared_ptr<LogSink>>& vecSinks, bool bTruncateLongLine = false);
 	static void uninit();
 
     static void setLevel(LOG_LEVEL nLevel);
+    //true if lines of nLevel are written at the current level, CRITICAL always is
+    static bool levelEnabled(long nLevel)
+    {
+        return nLevel == LOG_LEVEL_CRITICAL || nLevel >= m_nCurrentLevel;
+    }
+    //д߳ÿôдһ
+    static void setFlushInterval(int nMilliseconds);
+    //rings of threads that start logging afterwards get this many bytes
+    static void setThreadBufferSize(size_t nBytes);
+    //caps the buffer memory of all threads together, 0 means no cap; a thread gets a
+    //smaller ring when the cap is near, but never less than kMinThreadBufferSize.
+    //The cap is soft, memory is not bounded: past it every new thread still gets
+    //kMinThreadBufferSize (64KB), so it is only met with a bounded number of threads
+    static void setMaxBufferSize(size_t nBytes);
+    //what a thread does when its buffer is full, a drop is reported by a periodic warning line
+    static void setOverflowPolicy(LOG_OVERFLOW_POLICY nPolicy);
+    //lines dropped since the start of the process
+    static uint64_t droppedCount();
+    //threads that start logging afterwards keep their ring in a file "<dir>/<pid>.<n>.logring",
+    //what a crash leaves unwritten there is found by recoverCrashBuffers(); init() calls it.
+    //The LOG*_DEFER sites go to "<dir>/<pid>.logsites" so their lines can be formatted then;
+    //a deferred line whose site is missing there (e.g. a child forked after this call, whose
+    //pid is not the file's) comes back as a placeholder with its level and time only
+    static void setCrashBufferDir(const char* pszDir);
+    //the unwritten lines in the ring files of dead processes in pszDir, oldest first, go to
+    //the sinks, or to *pText if given; the files are deleted. Returns the number of lines
+    static size_t recoverCrashBuffers(const char* pszDir, std::string* pText = nullptr);
     static bool isRunning();
 	
 	//߳IDźںǩк
-	static bool output(long nLevel, const char* pszFmt, ...);
+	static bool output(long nLevel, const char* pszFmt, ...) LOG_PRINTF_FORMAT(2, 3);
 	//߳IDźںǩк	
-    static bool output(long nLevel, const char* pszFileName, int nLineNo, const char* pszFmt, ...);
+    static bool output(long nLevel, const char* pszFileName, int nLineNo, const char* pszFmt, ...) LOG_PRINTF_FORMAT(4, 5);
+
+    //hex dump of the bytes as one DEBUG record, at most nMaxBytes of them unless 0
+    static bool outputBinary(const unsigned char* buffer, size_t size, size_t nMaxBytes = 0);
+
+    //records the site id and the raw arguments, the writer thread formats the line later, see LOG*_DEFER
+    template <typename... Args>
+    static bool outputDeferred(const LogFormatSite& site, const Args&... args)
+    {
+        if (!levelEnabled(site.level))
+            return false;
+
+        size_t nLength = sizeof(uint32_t);
+        size_t nIndex = 0;
+        ((nLength += LogArgs::encodedSize(args, site.conversion(nIndex++))), ...);
+        char* pszRecord = beginDeferredRecord(nLength, site.level);
+        if (pszRecord == nullptr)
+            return false;
 
-    static bool outputBinary(unsigned char* buffer, size_t size);
+        memcpy(pszRecord, &site.id, sizeof(uint32_t));
+        char* p = pszRecord + sizeof(uint32_t);
+        nIndex = 0;
+        ((p = LogArgs::encode(p, args, site.conversion(nIndex++))), ...);
+        (void)p;
+        endDeferredRecord(nLength, site.level);
+        return true;
+    }
 
 private:
     CAsyncLog() = delete;
@@ -47,37 +143,88 @@ private:
     CAsyncLog(const CAsyncLog& rhs) = delete;
     CAsyncLog& operator=(const CAsyncLog& rhs) = delete;
 
-    static void makeLinePrefix(long nLevel, std::string& strPrefix);
-    static void getTime(char* pszTime, int nTimeStrLength);
-    static bool createNewFile(const char* pszLogFileName);
-    static bool writeToFile(const std::string& data);
+    //longest prefix makeLinePrefix() writes
+    static const size_t kMaxPrefixLength = 80;
+    //longest "[file:line]" makeLocation() writes
+    static const size_t kMaxLocationLength = 256;
+    //messages up to this long are formatted with a single vsnprintf
+    static const size_t kFastMessageLength = 1024;
+    static const size_t kMinThreadBufferSize = 64 * 1024;
+    //ring record tag bit of a deferred record, the level is in the bits below
+    static const uint32_t kDeferredTag = 0x100;
+    //writes "[LEVEL][[date time:ms]][thread id]" to pszDest, returns its length
+    static size_t makeLinePrefix(long nLevel, int64_t nMicroseconds, const char* pszThreadID, size_t nThreadIDLength, char* pszDest);
+    static size_t makeLocation(const char* pszFileName, int nLineNo, char* pszDest);
+    //writes the whole line ending in a newline, *pMsgLength is the untruncated message length
+    static size_t formatLine(long nLevel, int64_t nMicroseconds, const char* pszFileName, int nLineNo,
+                             const char* pszFmt, va_list ap, char* pszDest, size_t nCapacity, size_t* pMsgLength);
+    static bool outputV(long nLevel, const char* pszFileName, int nLineNo, const char* pszFmt, va_list ap);
+    static LogRing* threadRing();
+    //nullptr if the line is dropped, as the overflow policy says
+    static char* beginRecord(LogRing* pRing, size_t nMaxLength, long nLevel);
+    static void endRecord(LogRing* pRing, size_t nLength, uint32_t nTag, int64_t nMicroseconds);
+    static char* beginDeferredRecord(size_t nLength, long nLevel);
+    static void endDeferredRecord(size_t nLength, long nLevel);
+    static void wakeWriter(bool bForce);
+    static void pushLine(long nLevel, const char* pszLine, size_t nLength);
+    static size_t drainRings(const std::vector<std::shared_ptr<LogRing>>& vecRings, LogBlock& block);
+    //gives the space of the written records back to the producers
+    static void releaseRings(const std::vector<std::shared_ptr<LogRing>>& vecRings);
+    static void appendToBlock(LogBlock& block, const char* pszData, size_t nLength, long nLevel);
+    //formats a deferred record of pRing into the block
+    static void appendDeferred(const LogRing& ring, const char* pszRecord, size_t nLength, uint32_t nTag, int64_t nMicroseconds, LogBlock& block);
+    static void removeClosedRings();
+    //writes the "N lines dropped" warning at most once per interval, unless bForce
+    static void reportDropped(bool bForce);
+    //hands the block to every sink, only the lines each one accepts
+    static void writeBlock(LogBlock& block);
+    //a single run of lines of one level
+    static void writeLines(const char* pszData, size_t nLength, long nLevel);
+    static void flushSinks();
     //ó
     static void crash();
 
-    static const char* ullto4Str(int n);
-    static char* formLog(int& index, char* szbuf, size_t size_buf, unsigned char* buffer, size_t size);
+    //bytes per row of a hex dump, and the longest row formatHexDump() writes for them
+    static const size_t kHexRowBytes = 32;
+    static const size_t kMaxHexRowLength = 96;
+    //room for the lines above and below a hex dump
+    static const size_t kMaxBinaryNoteLength = 128;
+    //writes the rows of the dump to pszDest, returns their length
+    static size_t formatHexDump(const unsigned char* buffer, size_t size, char* pszDest);
 
     static void writeThreadProc();
 	
 private:
-	static bool		                        m_bToFile;			    //־дļд̨  
-	static FILE*                            m_hLogFile;
-    static std::string                      m_strFileName;          //־ļ
-    static std::string                      m_strFileNamePID;    //ļеĽid
+    static std::vector<std::shared_ptr<LogSink>> m_vecSinks;        //־Ŀĵ
+    static std::mutex                       m_mutexSinks;           //held while a sink writes
     static bool                             m_bTruncateLongLog;     //־Ƿض
     static LOG_LEVEL                        m_nCurrentLevel;        //ǰ־
-    static int64_t                          m_nFileRollSize;        //־ļֽ
-    static int64_t                          m_nCurrentWrittenSize;  //ѾдֽĿ
-    static std::list<std::string>           m_listLinesToWrite;     //д־
+    static int                              m_nFlushIntervalMs;
+    static size_t                           m_nThreadBufferSize;
+    static size_t                           m_nMaxBufferSize;       //0: no cap
+    static size_t                           m_nBufferSize;          //bytes of all rings, guarded by m_mutexRings
+    static LOG_OVERFLOW_POLICY              m_nOverflowPolicy;
+    static std::atomic<uint64_t>            m_nDropped[LOG_LEVEL_CRITICAL + 1];  //per level
+    static std::vector<std::shared_ptr<LogRing>> m_vecRings;        //one per producing thread
+    static std::mutex                       m_mutexRings;           //guards m_vecRings only
+    static std::atomic<uint64_t>            m_nRingsVersion;        //bumped when m_vecRings changes
+    static std::string                      m_strCrashBufferDir;    //empty: rings on the heap; guarded by m_mutexRings
+    static uint32_t                         m_nCrashBufferFiles;    //ring files created, guarded by m_mutexRings
     static std::unique_ptr<std::thread>     m_spWriteThread;
     static std::mutex                       m_mutexWrite;
     static std::condition_variable          m_cvWrite;
+    static std::atomic<bool>                m_bWriterSleeping;
+    static std::mutex                       m_mutexSpace;           //producers of a full ring wait on m_cvSpace
+    static std::condition_variable          m_cvSpace;              //signalled by releaseRings()
+    static std::atomic<int>                 m_nSpaceWaiters;
     static bool                             m_bExit;                //˳־
-    static bool                             m_bRunning;             //б־
+    static std::atomic<bool>                m_bRunning;             //б־
 };
 
 //ݰĶƸʽ
 #define LOG_DEBUG_BIN(buf, buflength) CAsyncLog::outputBinary(buf, buflength)
+//at most maxbytes of the buffer
+#define LOG_DEBUG_BIN_N(buf, buflength, maxbytes) CAsyncLog::outputBinary(buf, buflength, maxbytes)
 
 //TODO: Ӽ
 //ע⣺ӡ־ϢģʽַҪ_T()
@@ -91,6 +238,74 @@ private:
 #define LOGF(...)    CAsyncLog::output(LOG_LEVEL_FATAL, __FILE__, __LINE__, __VA_ARGS__)        //ΪFATAL־crash򣬲ȡͬд־ķ
 #define LOGC(...)    CAsyncLog::output(LOG_LEVEL_CRITICAL, __FILE__, __LINE__, __VA_ARGS__)     //ؼϢ־
 
+//LOG*_DEFER ֻʽд־߳нУ̵߳ĿС
+//the format must be a string literal and the arguments numbers, pointers or C strings (std::string needs c_str())
+#define LOG_DEFER(level, fmt, ...)                                                              \
+    do                                                                                          \
+    {                                                                                           \
+        static const base::LogFormatSite s_logFormatSite(level, __FILE__, __LINE__, fmt);       \
+        if (false)                                                                              \
+            base::logFormatCheck(fmt, ##__VA_ARGS__);                                           \
+        CAsyncLog::outputDeferred(s_logFormatSite, ##__VA_ARGS__);                              \
+    } while (0)
+
+#define LOGT_DEFER(fmt, ...)    LOG_DEFER(LOG_LEVEL_TRACE, fmt, ##__VA_ARGS__)
+#define LOGD_DEFER(fmt, ...)    LOG_DEFER(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#define LOGI_DEFER(fmt, ...)    LOG_DEFER(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define LOGW_DEFER(fmt, ...)    LOG_DEFER(LOG_LEVEL_WARNING, fmt, ##__VA_ARGS__)
+#define LOGE_DEFER(fmt, ...)    LOG_DEFER(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#define LOGSYSE_DEFER(fmt, ...) LOG_DEFER(LOG_LEVEL_SYSERROR, fmt, ##__VA_ARGS__)
+
+//־ÿõ㵥lines held back are not counted anywhere; a line below
+//the current level is not counted either and takes no interval or token
+//LOG*_EVERY_N: the 1st, (n+1)th, (2n+1)th... time the line is reached
+#define LOG_EVERY_N(level, n, ...)                                                              \
+    do                                                                                          \
+    {                                                                                           \
+        static base::LogEveryN s_logEveryN;                                                     \
+        if (CAsyncLog::levelEnabled(level) && s_logEveryN.pass(n))                              \
+            CAsyncLog::output(level, __FILE__, __LINE__, __VA_ARGS__);                          \
+    } while (0)
+
+//LOG*_EVERY_MS: at most one line per ms milliseconds
+#define LOG_EVERY_MS(level, ms, ...)                                                            \
+    do                                                                                          \
+    {                                                                                           \
+        static base::LogEveryMs s_logEveryMs;                                                   \
+        if (CAsyncLog::levelEnabled(level) && s_logEveryMs.pass(ms))                            \
+            CAsyncLog::output(level, __FILE__, __LINE__, __VA_ARGS__);                          \
+    } while (0)
+
+//LOG*_LIMITED: perSecond lines a second on average, bursts of up to burst lines
+#define LOG_LIMITED(level, perSecond, burst, ...)                                               \
+    do                                                                                          \
+    {                                                                                           \
+        static base::LogTokenBucket s_logTokenBucket;                                           \
+        if (CAsyncLog::levelEnabled(level) && s_logTokenBucket.pass(perSecond, burst))          \
+            CAsyncLog::output(level, __FILE__, __LINE__, __VA_ARGS__);                          \
+    } while (0)
+
+#define LOGT_EVERY_N(n, ...)                LOG_EVERY_N(LOG_LEVEL_TRACE, n, __VA_ARGS__)
+#define LOGD_EVERY_N(n, ...)                LOG_EVERY_N(LOG_LEVEL_DEBUG, n, __VA_ARGS__)
+#define LOGI_EVERY_N(n, ...)                LOG_EVERY_N(LOG_LEVEL_INFO, n, __VA_ARGS__)
+#define LOGW_EVERY_N(n, ...)                LOG_EVERY_N(LOG_LEVEL_WARNING, n, __VA_ARGS__)
+#define LOGE_EVERY_N(n, ...)                LOG_EVERY_N(LOG_LEVEL_ERROR, n, __VA_ARGS__)
+#define LOGSYSE_EVERY_N(n, ...)             LOG_EVERY_N(LOG_LEVEL_SYSERROR, n, __VA_ARGS__)
+
+#define LOGT_EVERY_MS(ms, ...)              LOG_EVERY_MS(LOG_LEVEL_TRACE, ms, __VA_ARGS__)
+#define LOGD_EVERY_MS(ms, ...)              LOG_EVERY_MS(LOG_LEVEL_DEBUG, ms, __VA_ARGS__)
+#define LOGI_EVERY_MS(ms, ...)              LOG_EVERY_MS(LOG_LEVEL_INFO, ms, __VA_ARGS__)
+#define LOGW_EVERY_MS(ms, ...)              LOG_EVERY_MS(LOG_LEVEL_WARNING, ms, __VA_ARGS__)
+#define LOGE_EVERY_MS(ms, ...)              LOG_EVERY_MS(LOG_LEVEL_ERROR, ms, __VA_ARGS__)
+#define LOGSYSE_EVERY_MS(ms, ...)           LOG_EVERY_MS(LOG_LEVEL_SYSERROR, ms, __VA_ARGS__)
+
+#define LOGT_LIMITED(perSecond, burst, ...)     LOG_LIMITED(LOG_LEVEL_TRACE, perSecond, burst, __VA_ARGS__)
+#define LOGD_LIMITED(perSecond, burst, ...)     LOG_LIMITED(LOG_LEVEL_DEBUG, perSecond, burst, __VA_ARGS__)
+#define LOGI_LIMITED(perSecond, burst, ...)     LOG_LIMITED(LOG_LEVEL_INFO, perSecond, burst, __VA_ARGS__)
+#define LOGW_LIMITED(perSecond, burst, ...)     LOG_LIMITED(LOG_LEVEL_WARNING, perSecond, burst, __VA_ARGS__)
+#define LOGE_LIMITED(perSecond, burst, ...)     LOG_LIMITED(LOG_LEVEL_ERROR, perSecond, burst, __VA_ARGS__)
+#define LOGSYSE_LIMITED(perSecond, burst, ...)  LOG_LIMITED(LOG_LEVEL_SYSERROR, perSecond, burst, __VA_ARGS__)
+
 END_NS(base)
 using namespace base;
 
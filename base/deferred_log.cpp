@@ -0,0 +1,397 @@
+#include "deferred_log.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <mutex>
+#include <vector>
+
+BEGIN_NS(base)
+
+namespace
+{
+
+std::mutex g_sitesMutex;
+std::vector<const LogFormatSite*> g_sites;
+std::string g_sitesPath;        // saveTo(), guarded by g_sitesMutex
+// readSaved() takes a larger id for a damaged file
+const unsigned int kMaxSavedSiteID = 1 << 20;
+
+// appends the site to g_sitesPath: "<id> <level> <line> <file length> <format length>\n<file><format>\n"
+void saveSite(FILE* fp, const LogFormatSite& site)
+{
+    size_t fileLength = strlen(site.fileName);
+    size_t formatLength = strlen(site.format);
+    fprintf(fp, "%u %ld %d %zu %zu\n", site.id, site.level, site.lineNo, fileLength, formatLength);
+    fwrite(site.fileName, 1, fileLength, fp);
+    fwrite(site.format, 1, formatLength, fp);
+    fputc('\n', fp);
+}
+
+// one printf conversion specification, without its length modifier
+struct ConversionSpec
+{
+    std::string flags;
+    bool        widthArg = false;       // "*"
+    std::string width;
+    bool        hasPrecision = false;
+    bool        precisionArg = false;   // ".*"
+    std::string precision;
+    size_t      lengthSize = 0;         // bytes the length modifier asks for, 0: none
+    char        conversion = 0;
+};
+
+// parses the specification after a '%', returns where it ends
+const char* parseSpec(const char* p, ConversionSpec* spec)
+{
+    while (*p != 0 && strchr("-+ #0'", *p) != nullptr)
+        spec->flags += *p++;
+
+    if (*p == '*')
+    {
+        spec->widthArg = true;
+        ++p;
+    }
+    else
+    {
+        while (*p >= '0' && *p <= '9')
+            spec->width += *p++;
+    }
+
+    if (*p == '.')
+    {
+        spec->hasPrecision = true;
+        ++p;
+        if (*p == '*')
+        {
+            spec->precisionArg = true;
+            ++p;
+        }
+        else
+        {
+            while (*p >= '0' && *p <= '9')
+                spec->precision += *p++;
+        }
+    }
+
+    // the writer knows the real type of every argument and rebuilds the modifier,
+    // only the size it asks an integer to be cut to is kept
+    switch (*p)
+    {
+    case 'h':
+        spec->lengthSize = p[1] == 'h' ? sizeof(char) : sizeof(short);
+        break;
+    case 'l':
+        spec->lengthSize = p[1] == 'l' ? sizeof(long long) : sizeof(long);
+        break;
+    case 'q':
+    case 'j':
+        spec->lengthSize = sizeof(intmax_t);
+        break;
+    case 'z':
+        spec->lengthSize = sizeof(size_t);
+        break;
+    case 't':
+        spec->lengthSize = sizeof(ptrdiff_t);
+        break;
+    default:
+        break;
+    }
+    while (*p != 0 && strchr("hljztLqI", *p) != nullptr)
+        ++p;
+
+    if (*p != 0)
+        spec->conversion = *p++;
+    return p;
+}
+
+// reads the next encoded argument, false when there is none left
+bool nextArg(const char*& p, const char* end, LogArgs::Type* type, size_t* size, uint64_t* value, const char** str)
+{
+    if (p >= end)
+        return false;
+
+    *type = static_cast<LogArgs::Type>(*p++);
+    *size = 0;
+    if (*type == LogArgs::kString)
+    {
+        uint32_t length;
+        if (p + sizeof(length) > end)
+            return false;
+        memcpy(&length, p, sizeof(length));
+        p += sizeof(length);
+        if (p + length + 1 > end)
+            return false;
+        *str = p;
+        p += length + 1;
+        return true;
+    }
+
+    if (p + 1 + sizeof(*value) > end)
+        return false;
+    *size = static_cast<uint8_t>(*p++);
+    memcpy(value, p, sizeof(*value));
+    p += sizeof(*value);
+    return true;
+}
+
+// the integer printf passes for an argument of @c size bytes and prints as
+// @c lengthSize bytes: promoted to int, then cut to the modifier's size
+uint64_t fitInteger(uint64_t value, size_t size, size_t lengthSize, bool isSigned)
+{
+    size_t bytes = lengthSize > 0 ? lengthSize : (size > sizeof(int) ? size : sizeof(int));
+    if (bytes >= sizeof(uint64_t))
+        return value;
+
+    int bits = static_cast<int>(bytes * 8);
+    uint64_t mask = (static_cast<uint64_t>(1) << bits) - 1;
+    value &= mask;
+    if (isSigned && (value >> (bits - 1)) != 0)
+        value |= ~mask;
+    return value;
+}
+
+void appendFormatted(std::string& message, const char* format, ...)
+{
+    char buf[256];
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if (static_cast<size_t>(n) < sizeof(buf))
+    {
+        message.append(buf, n);
+        return;
+    }
+
+    size_t offset = message.size();
+    message.resize(offset + n + 1);
+    va_start(ap, format);
+    vsnprintf(&message[offset], n + 1, format, ap);
+    va_end(ap);
+    message.resize(offset + n);
+}
+
+}
+
+LogFormatSite::LogFormatSite(long level, const char* fileName, int lineNo, const char* format)
+    : level(level),
+      fileName(fileName),
+      lineNo(lineNo),
+      format(format)
+{
+    for (const char* p = format; *p != 0;)
+    {
+        if (*p++ != '%')
+            continue;
+        if (*p == '%')
+        {
+            ++p;
+            continue;
+        }
+
+        ConversionSpec spec;
+        p = parseSpec(p, &spec);
+        if (spec.widthArg)
+            conversions += '*';
+        if (spec.precisionArg)
+            conversions += '*';
+        if (spec.conversion != 0)
+            conversions += spec.conversion;
+    }
+
+    std::lock_guard<std::mutex> lock(g_sitesMutex);
+    id = static_cast<uint32_t>(g_sites.size());
+    g_sites.push_back(this);
+    if (!g_sitesPath.empty())
+    {
+        //closed at once, a crash must not lose it in a stdio buffer
+        if (FILE* fp = fopen(g_sitesPath.c_str(), "ab"))
+        {
+            saveSite(fp, *this);
+            fclose(fp);
+        }
+    }
+}
+
+void LogFormatSite::saveTo(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(g_sitesMutex);
+    g_sitesPath = path;
+    if (path.empty())
+        return;
+
+    if (FILE* fp = fopen(path.c_str(), "wb"))
+    {
+        for (const LogFormatSite* site : g_sites)
+            saveSite(fp, *site);
+        fclose(fp);
+    }
+}
+
+std::vector<LogFormatSite::Saved> LogFormatSite::readSaved(const std::string& path)
+{
+    std::vector<Saved> sites;
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr)
+        return sites;
+    std::string data;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        data.append(buf, n);
+    fclose(fp);
+
+    size_t pos = 0;
+    while (pos < data.size())
+    {
+        size_t end = data.find('\n', pos);
+        if (end == std::string::npos)
+            break;
+        unsigned int id;
+        Saved site;
+        size_t fileLength, formatLength;
+        //a record cut short by the crash ends the file
+        if (sscanf(data.c_str() + pos, "%u %ld %d %zu %zu", &id, &site.level, &site.lineNo, &fileLength, &formatLength) != 5
+            || id > kMaxSavedSiteID || fileLength + formatLength + 1 > data.size() - end - 1)
+            break;
+        site.fileName = data.substr(end + 1, fileLength);
+        site.format = data.substr(end + 1 + fileLength, formatLength);
+        pos = end + 1 + fileLength + formatLength + 1;
+
+        if (sites.size() <= id)
+            sites.resize(id + 1, Saved{ 0, std::string(), 0, std::string() });
+        sites[id] = site;
+    }
+    return sites;
+}
+
+const LogFormatSite* LogFormatSite::find(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(g_sitesMutex);
+    return id < g_sites.size() ? g_sites[id] : nullptr;
+}
+
+void LogFormatSite::formatMessage(const char* format, const char* args, size_t length, std::string& message)
+{
+    const char* arg = args;
+    const char* end = args + length;
+    LogArgs::Type type;
+    size_t size = 0;
+    uint64_t value = 0;
+    const char* str = nullptr;
+
+    const char* p = format;
+    while (*p != 0)
+    {
+        const char* literal = p;
+        while (*p != 0 && *p != '%')
+            ++p;
+        message.append(literal, p - literal);
+        if (*p == 0)
+            break;
+
+        ++p;
+        if (*p == '%')
+        {
+            message += '%';
+            ++p;
+            continue;
+        }
+
+        ConversionSpec spec;
+        p = parseSpec(p, &spec);
+
+        // rebuild the specification with the width and precision arguments inlined
+        std::string fmt("%");
+        fmt += spec.flags;
+        if (spec.widthArg)
+        {
+            if (!nextArg(arg, end, &type, &size, &value, &str))
+                break;
+            fmt += std::to_string(static_cast<int>(value));
+        }
+        else
+        {
+            fmt += spec.width;
+        }
+        if (spec.hasPrecision)
+        {
+            fmt += '.';
+            if (spec.precisionArg)
+            {
+                if (!nextArg(arg, end, &type, &size, &value, &str))
+                    break;
+                fmt += std::to_string(static_cast<int>(value));
+            }
+            else
+            {
+                fmt += spec.precision;
+            }
+        }
+
+        if (spec.conversion == 0 || spec.conversion == 'n')
+            continue;
+        if (!nextArg(arg, end, &type, &size, &value, &str))
+        {
+            message += "<missing>";
+            continue;
+        }
+
+        double d;
+        memcpy(&d, &value, sizeof(d));
+        switch (spec.conversion)
+        {
+        case 'd':
+        case 'i':
+            fmt += "lld";
+            appendFormatted(message, fmt.c_str(), type == LogArgs::kDouble ? static_cast<long long>(d)
+                                                  : static_cast<long long>(fitInteger(value, size, spec.lengthSize, true)));
+            break;
+
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            fmt += "ll";
+            fmt += spec.conversion;
+            appendFormatted(message, fmt.c_str(), type == LogArgs::kDouble ? static_cast<unsigned long long>(d)
+                                                  : static_cast<unsigned long long>(fitInteger(value, size, spec.lengthSize, false)));
+            break;
+
+        case 'c':
+            fmt += 'c';
+            appendFormatted(message, fmt.c_str(), static_cast<int>(value));
+            break;
+
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            fmt += spec.conversion;
+            appendFormatted(message, fmt.c_str(), type == LogArgs::kDouble ? d : static_cast<double>(static_cast<int64_t>(value)));
+            break;
+
+        case 's':
+            fmt += 's';
+            appendFormatted(message, fmt.c_str(), type == LogArgs::kString ? str : "<not a string>");
+            break;
+
+        case 'p':
+            fmt += 'p';
+            appendFormatted(message, fmt.c_str(), reinterpret_cast<void*>(static_cast<uintptr_t>(value)));
+            break;
+
+        default:
+            message += "<bad conversion>";
+            break;
+        }
+    }
+}
+
+END_NS(base)
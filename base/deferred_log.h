@@ -0,0 +1,171 @@
+#ifndef __DEFERRED_LOG_H
+#define __DEFERRED_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "common.h"
+
+BEGIN_NS(base)
+
+///
+/// Call site of a LOG*_DEFER macro.
+///
+/// A site registers itself the first time it runs and gets an id. A
+/// deferred log record holds only that id and the raw argument values, the
+/// log writer thread looks the site up by id and runs the printf style
+/// formatting there, so the logging thread never formats anything.
+///
+/// The format string must outlive the process' logging, a string literal.
+///
+/// The ids only mean something inside one run of the program. For the
+/// records a crash leaves in the ring files, saveTo() keeps the sites in a
+/// file next to them, which readSaved() reads back.
+struct BASE_API LogFormatSite
+{
+    /// A site read back from a file written by saveTo().
+    struct Saved
+    {
+        long        level;
+        std::string fileName;
+        int         lineNo;
+        std::string format;     // empty if the id is not in the file
+    };
+
+    LogFormatSite(long level, const char* fileName, int lineNo, const char* format);
+
+    LogFormatSite(const LogFormatSite&) = delete;
+    LogFormatSite& operator=(const LogFormatSite&) = delete;
+
+    /// The site registered under @c id, nullptr if there is none. Thread safe.
+    static const LogFormatSite* find(uint32_t id);
+
+    /// Conversion character the argument at @c index is printed with, '*'
+    /// for a width or precision, 0 past the last one.
+    char conversion(size_t index) const
+    {
+        return index < conversions.size() ? conversions[index] : 0;
+    }
+
+    /// Appends the message formatted from encoded arguments to @c message.
+    void formatMessage(const char* args, size_t length, std::string& message) const
+    {
+        formatMessage(format, args, length, message);
+    }
+    /// The same with any format, e.g. one of a saved site.
+    static void formatMessage(const char* format, const char* args, size_t length, std::string& message);
+
+    /// Writes every site to the file @c path, and each site that registers
+    /// later as it does. An empty path stops it.
+    static void saveTo(const std::string& path);
+    /// The sites in a file written by saveTo(), indexed by id.
+    static std::vector<Saved> readSaved(const std::string& path);
+
+    const long          level;
+    const char* const   fileName;
+    const int           lineNo;
+    const char* const   format;
+    std::string         conversions;
+    uint32_t            id;
+};
+
+///
+/// Encoding of the arguments of a deferred log record.
+///
+/// Every argument is a type byte, the size of the argument's type and an 8
+/// byte value; the writer cuts an integer back to that size (or the one a
+/// length modifier asks for), so it prints as printf would. A string
+/// printed with %s is copied instead: type byte, 4 byte length, the bytes
+/// and a NUL. Other char pointers are kept as pointers, so "%p" still works.
+namespace LogArgs
+{
+
+enum Type : uint8_t
+{
+    kInt,
+    kUnsigned,
+    kDouble,
+    kString,
+    kPointer
+};
+
+inline const char* stringOf(const char* s)
+{
+    return s != nullptr ? s : "(null)";
+}
+
+template <typename T>
+inline size_t encodedSize(const T& arg, char conversion)
+{
+    typedef typename std::decay<T>::type U;
+    if constexpr (std::is_same<U, const char*>::value || std::is_same<U, char*>::value)
+    {
+        if (conversion == 's')
+            return 1 + sizeof(uint32_t) + strlen(stringOf(arg)) + 1;
+    }
+    return 2 + sizeof(uint64_t);
+}
+
+template <typename T>
+inline char* encode(char* p, const T& arg, char conversion)
+{
+    typedef typename std::decay<T>::type U;
+    uint64_t value = 0;
+    if constexpr (std::is_same<U, const char*>::value || std::is_same<U, char*>::value)
+    {
+        if (conversion == 's')
+        {
+            const char* s = stringOf(arg);
+            uint32_t length = static_cast<uint32_t>(strlen(s));
+            *p++ = kString;
+            memcpy(p, &length, sizeof(length));
+            p += sizeof(length);
+            memcpy(p, s, length + 1);
+            return p + length + 1;
+        }
+    }
+
+    if constexpr (std::is_pointer<U>::value || std::is_same<U, std::nullptr_t>::value)
+    {
+        *p++ = kPointer;
+        *p++ = static_cast<char>(sizeof(void*));
+        value = reinterpret_cast<uintptr_t>(static_cast<const volatile void*>(arg));
+    }
+    else if constexpr (std::is_floating_point<U>::value)
+    {
+        *p++ = kDouble;
+        *p++ = static_cast<char>(sizeof(double));
+        double d = static_cast<double>(arg);
+        memcpy(&value, &d, sizeof(value));
+    }
+    else if constexpr (std::is_enum<U>::value)
+    {
+        *p++ = kInt;
+        *p++ = static_cast<char>(sizeof(U));
+        value = static_cast<uint64_t>(static_cast<int64_t>(arg));
+    }
+    else if constexpr (std::is_integral<U>::value && std::is_signed<U>::value)
+    {
+        *p++ = kInt;
+        *p++ = static_cast<char>(sizeof(U));
+        value = static_cast<uint64_t>(static_cast<int64_t>(arg));
+    }
+    else
+    {
+        static_assert(std::is_integral<U>::value, "a deferred log argument must be a number, a pointer or a C string");
+        *p++ = kUnsigned;
+        *p++ = static_cast<char>(sizeof(U));
+        value = static_cast<uint64_t>(arg);
+    }
+    memcpy(p, &value, sizeof(value));
+    return p + sizeof(value);
+}
+
+}
+
+END_NS(base)
+
+#endif // !__DEFERRED_LOG_H
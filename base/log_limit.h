@@ -0,0 +1,87 @@
+#ifndef __LOG_LIMIT_H
+#define __LOG_LIMIT_H
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include "common.h"
+
+BEGIN_NS(base)
+
+//State of the sampled and rate limited log macros, LOG*_EVERY_N,
+//LOG*_EVERY_MS and LOG*_LIMITED. Every call site has one in a function
+//local static, shared by all threads that run it. Only relaxed atomics are
+//used: when threads race, a line more or less gets through, which is fine
+//for a log and keeps the check to a few instructions.
+
+inline int64_t logLimitNowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// The 1st, (n+1)th, (2n+1)th... call.
+class LogEveryN
+{
+public:
+    bool pass(uint64_t n)
+    {
+        return n <= 1 || count_.fetch_add(1, std::memory_order_relaxed) % n == 0;
+    }
+
+private:
+    std::atomic<uint64_t> count_{ 0 };
+};
+
+/// At most one call per @c milliseconds, the first one always.
+class LogEveryMs
+{
+public:
+    bool pass(int64_t milliseconds)
+    {
+        int64_t now = logLimitNowUs();
+        int64_t next = next_.load(std::memory_order_relaxed);
+        if (now < next)
+            return false;
+        //of the threads that see the interval over, only the one that moves it on logs
+        return next_.compare_exchange_strong(next, now + milliseconds * 1000, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<int64_t> next_{ 0 };
+};
+
+///
+/// Token bucket of @c burst tokens refilled at @c perSecond tokens a
+/// second, one token per call.
+///
+/// Kept as the time the bucket will be full again (GCRA), so a single
+/// atomic holds the whole state.
+class LogTokenBucket
+{
+public:
+    bool pass(int64_t perSecond, int64_t burst)
+    {
+        if (perSecond <= 0)
+            return false;
+        int64_t interval = perSecond < 1000000 ? 1000000 / perSecond : 1;
+        int64_t tolerance = (burst > 1 ? burst - 1 : 0) * interval;
+
+        int64_t now = logLimitNowUs();
+        int64_t full = full_.load(std::memory_order_relaxed);
+        while (true)
+        {
+            int64_t start = full > now ? full : now;
+            if (start - now > tolerance)
+                return false;
+            if (full_.compare_exchange_weak(full, start + interval, std::memory_order_relaxed))
+                return true;
+        }
+    }
+
+private:
+    std::atomic<int64_t> full_{ 0 };
+};
+
+END_NS(base)
+
+#endif // !__LOG_LIMIT_H
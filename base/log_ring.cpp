@@ -0,0 +1,286 @@
+#include "log_ring.h"
+
+#include <new>
+#include <stdio.h>
+#include <string.h>
+#include "platform.h"
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+BEGIN_NS(base)
+
+const size_t LogRing::kHeaderSize;
+const uint32_t LogRing::kPaddingTag;
+const size_t LogRing::kFileHeaderSize;
+
+static const char kFileMagic[8] = { 'L', 'O', 'G', 'R', 'I', 'N', 'G', '1' };
+
+size_t LogRing::roundCapacity(size_t capacity)
+{
+    size_t rounded = 4 * kHeaderSize;
+    while (rounded < capacity)
+        rounded <<= 1;
+    return rounded;
+}
+
+LogRing::LogRing(size_t capacity)
+    : capacity_(roundCapacity(capacity)),
+      closed_(false),
+      labelLength_(0),
+      fileHeader_(nullptr),
+#ifdef WIN32
+      fileHandle_(INVALID_HANDLE_VALUE),
+      mappingHandle_(nullptr),
+#else
+      fd_(-1),
+#endif
+      head_(0),
+      tailCache_(0),
+      writeStart_(0),
+      tail_(0),
+      headCache_(0),
+      readPos_(0),
+      readEnd_(0)
+{
+    mask_ = capacity_ - 1;
+    // operator new aligns to 16 bytes at least, enough for Header
+    buffer_ = static_cast<char*>(::operator new(capacity_));
+}
+
+LogRing::LogRing(size_t capacity, const std::string& path)
+    : LogRing(capacity)
+{
+    if (mapFile(path))
+    {
+        ::operator delete(buffer_);
+        buffer_ = reinterpret_cast<char*>(fileHeader_) + kFileHeaderSize;
+    }
+}
+
+LogRing::~LogRing()
+{
+    if (mapped())
+        unmapFile();
+    else
+        ::operator delete(buffer_);
+}
+
+bool LogRing::mapFile(const std::string& path)
+{
+    size_t size = kFileHeaderSize + capacity_;
+    void* view = nullptr;
+#ifdef WIN32
+    HANDLE file = ::CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                                nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    HANDLE mapping = ::CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+                                          static_cast<DWORD>(size), nullptr);
+    if (mapping != nullptr)
+        view = ::MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (view == nullptr)
+    {
+        if (mapping != nullptr)
+            ::CloseHandle(mapping);
+        ::CloseHandle(file);
+        ::DeleteFileA(path.c_str());
+        return false;
+    }
+    fileHandle_ = file;
+    mappingHandle_ = mapping;
+#else
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    if (::ftruncate(fd, static_cast<off_t>(size)) == 0)
+        view = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (view == nullptr || view == MAP_FAILED)
+    {
+        ::close(fd);
+        ::unlink(path.c_str());
+        return false;
+    }
+    fd_ = fd;
+#endif
+
+    // the kernel keeps the pages of a dead process, so they reach the file anyway
+    fileHeader_ = new (view) FileHeader;
+    memcpy(fileHeader_->magic, kFileMagic, sizeof(fileHeader_->magic));
+    fileHeader_->capacity = capacity_;
+#ifdef WIN32
+    fileHeader_->pid = static_cast<int64_t>(::GetCurrentProcessId());
+#else
+    fileHeader_->pid = static_cast<int64_t>(::getpid());
+#endif
+    memset(fileHeader_->label, 0, sizeof(fileHeader_->label));
+    fileHeader_->head.store(0, std::memory_order_relaxed);
+    fileHeader_->tail.store(0, std::memory_order_relaxed);
+    path_ = path;
+    return true;
+}
+
+void LogRing::unmapFile()
+{
+    // a ring with records left is kept for readFile()
+    bool empty = fileHeader_->tail.load(std::memory_order_relaxed) == fileHeader_->head.load(std::memory_order_relaxed);
+#ifdef WIN32
+    ::UnmapViewOfFile(fileHeader_);
+    ::CloseHandle(mappingHandle_);
+    ::CloseHandle(fileHandle_);
+    if (empty)
+        ::DeleteFileA(path_.c_str());
+#else
+    ::munmap(fileHeader_, kFileHeaderSize + capacity_);
+    ::close(fd_);
+    if (empty)
+        ::unlink(path_.c_str());
+#endif
+    fileHeader_ = nullptr;
+}
+
+void LogRing::setLabel(const char* label, size_t length)
+{
+    labelLength_ = length < sizeof(label_) ? length : sizeof(label_) - 1;
+    memcpy(label_, label, labelLength_);
+    label_[labelLength_] = 0;
+    if (fileHeader_ != nullptr)
+        memcpy(fileHeader_->label, label_, labelLength_ + 1);
+}
+
+char* LogRing::beginWrite(size_t maxLength)
+{
+    size_t needed = kHeaderSize + align(maxLength);
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    size_t offset = static_cast<size_t>(head & mask_);
+    // a record does not wrap, skip the end of the ring if it is too short
+    size_t padding = offset + needed > capacity_ ? capacity_ - offset : 0;
+    if (head + padding + needed - tailCache_ > capacity_)
+    {
+        tailCache_ = tail_.load(std::memory_order_acquire);
+        if (head + padding + needed - tailCache_ > capacity_)
+            return nullptr;
+    }
+
+    if (padding > 0)
+    {
+        Header* filler = headerAt(head);
+        filler->length = static_cast<uint32_t>(padding);
+        filler->tag = kPaddingTag;
+        filler->timestamp = 0;
+    }
+    writeStart_ = head + padding;
+    return reinterpret_cast<char*>(headerAt(writeStart_)) + kHeaderSize;
+}
+
+void LogRing::endWrite(size_t length, int64_t timestamp, uint32_t tag)
+{
+    Header* header = headerAt(writeStart_);
+    header->length = static_cast<uint32_t>(length);
+    header->tag = tag;
+    header->timestamp = timestamp;
+    uint64_t head = writeStart_ + kHeaderSize + align(length);
+    head_.store(head, std::memory_order_release);
+    if (fileHeader_ != nullptr)
+        fileHeader_->head.store(head, std::memory_order_relaxed);
+}
+
+bool LogRing::peek(Record* record)
+{
+    while (true)
+    {
+        if (readPos_ == headCache_)
+        {
+            headCache_ = head_.load(std::memory_order_acquire);
+            if (readPos_ == headCache_)
+                return false;
+        }
+
+        const Header* header = headerAt(readPos_);
+        if (header->tag == kPaddingTag)
+        {
+            readPos_ += header->length;
+            continue;
+        }
+
+        record->timestamp = header->timestamp;
+        record->tag = header->tag;
+        record->data = reinterpret_cast<const char*>(header) + kHeaderSize;
+        record->length = header->length;
+        readEnd_ = readPos_ + kHeaderSize + align(header->length);
+        return true;
+    }
+}
+
+void LogRing::pop()
+{
+    readPos_ = readEnd_;
+}
+
+void LogRing::release()
+{
+    tail_.store(readPos_, std::memory_order_release);
+    if (fileHeader_ != nullptr)
+        fileHeader_->tail.store(readPos_, std::memory_order_relaxed);
+}
+
+bool LogRing::readFile(const std::string& path, int64_t* pid, std::string* label,
+                       std::string* data, std::vector<Record>* records)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr)
+        return false;
+    data->clear();
+    char chunk[64 * 1024];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        data->append(chunk, n);
+    fclose(file);
+
+    // data is heap memory, aligned enough for the headers
+    if (data->size() < kFileHeaderSize)
+        return false;
+    const FileHeader* fileHeader = reinterpret_cast<const FileHeader*>(data->data());
+    uint64_t capacity = fileHeader->capacity;
+    if (memcmp(fileHeader->magic, kFileMagic, sizeof(fileHeader->magic)) != 0
+        || capacity < 4 * kHeaderSize || (capacity & (capacity - 1)) != 0
+        || data->size() != kFileHeaderSize + capacity)
+        return false;
+
+    *pid = fileHeader->pid;
+    *label = std::string(fileHeader->label, strnlen(fileHeader->label, sizeof(fileHeader->label)));
+
+    // stop at the first header that does not make sense, the rest is lost
+    const char* buffer = data->data() + kFileHeaderSize;
+    uint64_t head = fileHeader->head.load(std::memory_order_relaxed);
+    uint64_t position = fileHeader->tail.load(std::memory_order_relaxed);
+    records->clear();
+    while (position < head && head - position <= capacity)
+    {
+        size_t offset = static_cast<size_t>(position & (capacity - 1));
+        if (offset + kHeaderSize > capacity)
+            break;
+        const Header* header = reinterpret_cast<const Header*>(buffer + offset);
+        if (header->tag == kPaddingTag)
+        {
+            if (header->length == 0 || offset + header->length != capacity)
+                break;
+            position += header->length;
+            continue;
+        }
+        if (offset + kHeaderSize + header->length > capacity)
+            break;
+
+        Record record;
+        record.timestamp = header->timestamp;
+        record.tag = header->tag;
+        record.data = buffer + offset + kHeaderSize;
+        record.length = header->length;
+        records->push_back(record);
+        position += kHeaderSize + align(header->length);
+    }
+    return true;
+}
+
+END_NS(base)
@@ -0,0 +1,153 @@
+#ifndef __LOG_RING_H
+#define __LOG_RING_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "common.h"
+
+BEGIN_NS(base)
+
+///
+/// Single-producer single-consumer ring of log records.
+///
+/// Every thread that logs owns one and the log writer thread is its only
+/// consumer, so neither side takes a lock. A record is a 16 byte header
+/// followed by its payload and is never split at the end of the ring: the
+/// producer writes the payload in place between beginWrite() and
+/// endWrite(), the consumer reads it in place between peek() and pop().
+/// Popped records keep their space until release(), so the consumer can
+/// hold on to them until it has written them out.
+///
+/// A ring can live in a memory-mapped file instead of the heap. Its
+/// positions are kept in the first page of the file, so when the process
+/// dies the records it had not released yet can be read back with
+/// readFile(). The file is deleted with the ring if nothing is left in it.
+class BASE_API LogRing
+{
+public:
+    struct Record
+    {
+        int64_t     timestamp;  // microseconds since epoch
+        uint32_t    tag;        // given to endWrite()
+        const char* data;
+        size_t      length;
+    };
+
+    /// @c capacity is rounded up to a power of two.
+    explicit LogRing(size_t capacity);
+    /// Backed by the file @c path, or the heap if it can not be mapped.
+    LogRing(size_t capacity, const std::string& path);
+    ~LogRing();
+
+    LogRing(const LogRing&) = delete;
+    LogRing& operator=(const LogRing&) = delete;
+
+    /// The capacity a ring asked for @c capacity bytes gets.
+    static size_t roundCapacity(size_t capacity);
+
+    size_t capacity() const { return capacity_; }
+    /// Largest payload of a record.
+    size_t maxRecordSize() const { return capacity_ / 2 - kHeaderSize; }
+    /// Bytes taken by published records, only a hint for other threads.
+    size_t usedBytes() const
+    {
+        return static_cast<size_t>(head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_relaxed));
+    }
+
+    /// Producer: room for a payload of up to @c maxLength bytes, which must
+    /// not exceed maxRecordSize(). nullptr until the consumer frees enough.
+    char* beginWrite(size_t maxLength);
+    /// Producer: publishes the first @c length bytes written after beginWrite().
+    void endWrite(size_t length, int64_t timestamp, uint32_t tag);
+
+    /// Consumer: the oldest published record, false if there is none.
+    bool peek(Record* record);
+    /// Consumer: moves past the record returned by the last peek().
+    void pop();
+    /// Consumer: gives the space of all popped records back to the producer.
+    void release();
+
+    /// True if the ring lives in a file.
+    bool mapped() const { return fileHeader_ != nullptr; }
+
+    /// Reads the file of a ring whose process is gone. @c data receives the
+    /// file, @c records the records published but not released, oldest
+    /// first, pointing into @c data.
+    static bool readFile(const std::string& path, int64_t* pid, std::string* label,
+                         std::string* data, std::vector<Record>* records);
+
+    /// The producer thread has exited, nothing more will be published.
+    void close() { closed_.store(true, std::memory_order_release); }
+    bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+    /// Short text naming the producer thread, set before the ring is shared.
+    void setLabel(const char* label, size_t length);
+    const char* label() const { return label_; }
+    size_t labelLength() const { return labelLength_; }
+
+private:
+    struct Header
+    {
+        uint32_t    length;
+        uint32_t    tag;
+        int64_t     timestamp;
+    };
+
+    // first page of a ring file
+    struct FileHeader
+    {
+        char                    magic[8];
+        uint64_t                capacity;
+        int64_t                 pid;
+        char                    label[32];
+        std::atomic<uint64_t>   head;
+        std::atomic<uint64_t>   tail;   // released position
+    };
+
+    static const size_t kHeaderSize = 16;
+    static const size_t kFileHeaderSize = 4096;
+    // tag of the filler in front of a record that did not fit at the end
+    static const uint32_t kPaddingTag = 0xffffffff;
+
+    static size_t align(size_t length) { return (length + kHeaderSize - 1) & ~(kHeaderSize - 1); }
+    Header* headerAt(uint64_t position) const
+    {
+        return reinterpret_cast<Header*>(buffer_ + (position & mask_));
+    }
+
+    bool mapFile(const std::string& path);
+    void unmapFile();
+
+    char*                   buffer_;
+    size_t                  capacity_;
+    size_t                  mask_;
+    std::atomic<bool>       closed_;
+    char                    label_[32];
+    size_t                  labelLength_;
+    FileHeader*             fileHeader_;    // nullptr unless mapped
+    std::string             path_;
+#ifdef WIN32
+    void*                   fileHandle_;
+    void*                   mappingHandle_;
+#else
+    int                     fd_;
+#endif
+
+    // written by the producer
+    alignas(64) std::atomic<uint64_t> head_;
+    uint64_t                tailCache_;
+    uint64_t                writeStart_;
+
+    // written by the consumer
+    alignas(64) std::atomic<uint64_t> tail_;
+    uint64_t                headCache_;
+    uint64_t                readPos_;
+    uint64_t                readEnd_;
+};
+
+END_NS(base)
+
+#endif // !__LOG_RING_H
@@ -0,0 +1,592 @@
+#include "log_sink.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include "timestamp.h"
+
+#ifndef WIN32
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+extern char** environ;
+#endif
+
+BEGIN_NS(base)
+
+const size_t UdpLogSink::kMaxDatagram;
+const size_t UdpLogSink::kBatchLines;
+
+namespace
+{
+
+const int kStdout = 1;
+
+LogFileOptions sizeOptions(int64_t rollSize)
+{
+    LogFileOptions options;
+    options.rollSize = rollSize;
+    return options;
+}
+
+bool fileExists(const std::string& name)
+{
+#ifdef WIN32
+    return ::GetFileAttributesA(name.c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+    struct stat st;
+    return ::stat(name.c_str(), &st) == 0;
+#endif
+}
+
+// the sinks write with write(2): nothing is held in a stdio buffer that a crash would lose
+int openFile(const std::string& name)
+{
+#ifdef WIN32
+    return ::_open(name.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC, _S_IREAD | _S_IWRITE);
+#else
+    return ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+}
+
+void closeFile(int fd)
+{
+#ifdef WIN32
+    ::_close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+bool writeAll(int fd, const char* data, size_t length)
+{
+    //Ϊ˷ֹļһд꣬һѭд
+    while (length > 0)
+    {
+#ifdef WIN32
+        int ret = ::_write(fd, data, static_cast<unsigned int>(length > INT_MAX ? INT_MAX : length));
+#else
+        ssize_t ret = ::write(fd, data, length);
+        if (ret < 0 && errno == EINTR)
+            continue;
+#endif
+        if (ret <= 0)
+            return false;
+
+        data += ret;
+        length -= static_cast<size_t>(ret);
+    }
+
+    return true;
+}
+
+bool endsWith(const std::string& text, const char* suffix)
+{
+    size_t length = strlen(suffix);
+    return text.size() >= length && text.compare(text.size() - length, length, suffix) == 0;
+}
+
+// a log file found by removeOldFiles()
+struct OldFile
+{
+    std::string name;
+    int64_t     mtime;      // finer than a second, files roll faster than that
+    int64_t     size;
+    std::string stamp;      // "<time>.<pid>" of the name
+    int         sequence;   // n of "<time>.<pid>.<n>.log", 0 for the first file of a second
+
+    OldFile(const std::string& path, const std::string& fileName, size_t prefixLength, int64_t mtime, int64_t size)
+        : name(path), mtime(mtime), size(size), sequence(0)
+    {
+        //mtimes tie on file systems with coarse timestamps, files rolled in the
+        //same second are then told apart by the number makeFileName() gave them
+        std::string rest = fileName.substr(prefixLength, fileName.find(".log", prefixLength) - prefixLength);
+        size_t dot = rest.find('.');
+        size_t last = dot == std::string::npos ? std::string::npos : rest.find('.', dot + 1);
+        stamp = rest.substr(0, last);
+        if (last != std::string::npos)
+            sequence = atoi(rest.c_str() + last + 1);
+    }
+
+    // newest first
+    bool operator<(const OldFile& other) const
+    {
+        if (mtime != other.mtime)
+            return mtime > other.mtime;
+        if (stamp != other.stamp)
+            return stamp > other.stamp;
+        return sequence > other.sequence;
+    }
+};
+
+}
+
+FileLogSink::FileLogSink(const std::string& baseName, int64_t rollSize, LOG_LEVEL minLevel)
+    : FileLogSink(baseName, sizeOptions(rollSize), minLevel)
+{
+}
+
+FileLogSink::FileLogSink(const std::string& baseName, const LogFileOptions& options, LOG_LEVEL minLevel)
+    : LogSink(minLevel),
+      baseName_(baseName),
+      options_(options),
+      file_(-1),
+      writtenSize_(0),
+      rollTime_(0),
+      lastSequence_(0),
+      nextFile_(-1),
+      wantNextFile_(true),
+      exit_(false)
+{
+    //ȡidٿͬһ̵Ĳͬ־ļ
+    char pid[8];
+#ifdef WIN32
+    snprintf(pid, sizeof(pid), "%05d", (int)::GetCurrentProcessId());
+#else
+    snprintf(pid, sizeof(pid), "%05d", (int)::getpid());
+#endif
+    pid_ = pid;
+    //no ".log" suffix, so retention never takes it for a log file
+    nextFileName_ = baseName_ + "." + pid_ + ".next";
+
+    helper_ = std::thread(&FileLogSink::helperThreadProc, this);
+}
+
+FileLogSink::~FileLogSink()
+{
+    if (file_ >= 0)
+        closeFile(file_);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        exit_ = true;
+        cond_.notify_one();
+    }
+    helper_.join();
+}
+
+void FileLogSink::write(const LogBatch& batch)
+{
+    time_t now = time(nullptr);
+    if (file_ < 0
+        || (options_.rollSize > 0 && writtenSize_ >= options_.rollSize)
+        || (rollTime_ > 0 && now >= rollTime_))
+    {
+        //һλļСʱ䵽ˣļ
+        if (!rollFile(now))
+            return;
+    }
+
+    if (writeAll(file_, batch.data, batch.length))
+        writtenSize_ += batch.length;
+}
+
+std::string FileLogSink::makeFileName()
+{
+    char now[64];
+    time_t seconds = time(nullptr);
+    tm tmNow;
+#ifdef _WIN32
+    localtime_s(&tmNow, &seconds);
+#else
+    localtime_r(&seconds, &tmNow);
+#endif
+    strftime(now, sizeof(now), "%Y%m%d%H%M%S", &tmNow);
+
+    std::string prefix(baseName_);
+    prefix += ".";
+    prefix += now;
+    prefix += ".";
+    prefix += pid_;
+
+    //a file rolled within the same second must not overwrite the last one,
+    //numbers keep counting up even when retention deleted older files
+    int sequence = prefix == lastPrefix_ ? lastSequence_ + 1 : 0;
+    std::string fileName;
+    while (true)
+    {
+        fileName = prefix + (sequence == 0 ? "" : "." + std::to_string(sequence)) + ".log";
+        if (!fileExists(fileName) && !fileExists(fileName + ".gz"))
+            break;
+        ++sequence;
+    }
+    lastPrefix_ = prefix;
+    lastSequence_ = sequence;
+    return fileName;
+}
+
+int64_t FileLogSink::nextRollTime(time_t now) const
+{
+    if (options_.rollInterval <= 0)
+        return 0;
+
+    const int kSecondsPerDay = 24 * 60 * 60;
+    if (kSecondsPerDay % options_.rollInterval != 0)
+        return now + options_.rollInterval;
+
+    //the next local multiple of the interval, counted from midnight
+    tm tmNow;
+#ifdef _WIN32
+    localtime_s(&tmNow, &now);
+#else
+    localtime_r(&now, &tmNow);
+#endif
+    int secondOfDay = tmNow.tm_hour * 3600 + tmNow.tm_min * 60 + tmNow.tm_sec;
+    return now - secondOfDay % options_.rollInterval + options_.rollInterval;
+}
+
+bool FileLogSink::rollFile(time_t now)
+{
+    int next;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        next = nextFile_;
+        nextFile_ = -1;
+    }
+
+    std::string fileName = makeFileName();
+    if (next >= 0 && ::rename(nextFileName_.c_str(), fileName.c_str()) != 0)
+    {
+        closeFile(next);
+        ::remove(nextFileName_.c_str());
+        next = -1;
+    }
+    //the helper has not caught up, open it here
+    if (next < 0)
+        next = openFile(fileName);
+
+    {
+        //the helper reads fileName_ under the lock too
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (file_ >= 0)
+            closedFiles_.push_back(ClosedFile{ file_, fileName_ });
+        file_ = next;
+        fileName_ = fileName;
+        wantNextFile_ = true;
+        cond_.notify_one();
+    }
+
+    writtenSize_ = 0;
+    rollTime_ = nextRollTime(now);
+    return file_ >= 0;
+}
+
+void FileLogSink::helperThreadProc()
+{
+    //closing, compressing and deleting files must not compete with the service
+#ifdef WIN32
+    ::SetThreadPriority(::GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#else
+    ::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)), 19);
+#endif
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+        cond_.wait(lock, [this] { return exit_ || wantNextFile_ || !closedFiles_.empty(); });
+
+        if (wantNextFile_ && !exit_)
+        {
+            wantNextFile_ = false;
+            //the writer rolled while the last open was under way and opened a file of its own,
+            //so the one opened here is still unused: opening another would leak it
+            if (nextFile_ < 0)
+            {
+                lock.unlock();
+                int next = openFile(nextFileName_);
+                lock.lock();
+                nextFile_ = next;
+            }
+        }
+
+        bool closed = !closedFiles_.empty();
+        while (!closedFiles_.empty())
+        {
+            ClosedFile closedFile = closedFiles_.front();
+            closedFiles_.pop_front();
+            lock.unlock();
+            closeFile(closedFile.file);
+            if (options_.compress)
+                compressFile(closedFile.name);
+            lock.lock();
+        }
+
+        if (closed && (options_.maxFiles > 0 || options_.maxTotalBytes > 0))
+        {
+            lock.unlock();
+            removeOldFiles();
+            lock.lock();
+        }
+
+        if (exit_ && closedFiles_.empty())
+            break;
+    }
+
+    if (nextFile_ >= 0)
+    {
+        closeFile(nextFile_);
+        nextFile_ = -1;
+        ::remove(nextFileName_.c_str());
+    }
+}
+
+void FileLogSink::compressFile(const std::string& name)
+{
+#ifndef WIN32
+    //gzip inherits the low priority of this thread
+    char gzip[] = "gzip";
+    char force[] = "-f";
+    std::string path(name);
+    char* argv[] = { gzip, force, &path[0], nullptr };
+    pid_t pid;
+    if (::posix_spawnp(&pid, "gzip", nullptr, nullptr, argv, environ) != 0)
+        return;
+
+    int status;
+    while (::waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+#else
+    (void)name;
+#endif
+}
+
+void FileLogSink::removeOldFiles()
+{
+    //"<baseName>.*.log" and "<baseName>.*.log.gz" in the directory of baseName
+    std::string dir(".");
+    std::string prefix(baseName_);
+    size_t slash = baseName_.find_last_of("/\\");
+    if (slash != std::string::npos)
+    {
+        dir = baseName_.substr(0, slash == 0 ? 1 : slash);
+        prefix = baseName_.substr(slash + 1);
+    }
+    prefix += ".";
+
+    std::vector<OldFile> files;
+    std::string current;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        current = fileName_;
+    }
+#ifdef WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find = ::FindFirstFileA((dir + "\\" + prefix + "*").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE)
+        return;
+    do
+    {
+        std::string name(data.cFileName);
+        if (!endsWith(name, ".log") && !endsWith(name, ".log.gz"))
+            continue;
+        ULARGE_INTEGER size, mtime;
+        size.LowPart = data.nFileSizeLow;
+        size.HighPart = data.nFileSizeHigh;
+        mtime.LowPart = data.ftLastWriteTime.dwLowDateTime;
+        mtime.HighPart = data.ftLastWriteTime.dwHighDateTime;
+        files.push_back(OldFile(dir + "\\" + name, name, prefix.size(), static_cast<int64_t>(mtime.QuadPart), static_cast<int64_t>(size.QuadPart)));
+    } while (::FindNextFileA(find, &data));
+    ::FindClose(find);
+#else
+    DIR* d = ::opendir(dir.c_str());
+    if (d == nullptr)
+        return;
+    while (struct dirent* entry = ::readdir(d))
+    {
+        std::string name(entry->d_name);
+        if (name.compare(0, prefix.size(), prefix) != 0 || (!endsWith(name, ".log") && !endsWith(name, ".log.gz")))
+            continue;
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if (::stat(path.c_str(), &st) == 0)
+            files.push_back(OldFile(path, name, prefix.size(), static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec, static_cast<int64_t>(st.st_size)));
+    }
+    ::closedir(d);
+#endif
+
+    //newest first; the file being written always stays
+    std::sort(files.begin(), files.end());
+    int kept = 0;
+    int64_t keptBytes = 0;
+    for (const OldFile& file : files)
+    {
+        bool isCurrent = file.name == current || (slash == std::string::npos && "./" + current == file.name);
+        if (!isCurrent
+            && ((options_.maxFiles > 0 && kept + 1 > options_.maxFiles)
+                || (options_.maxTotalBytes > 0 && keptBytes + file.size > options_.maxTotalBytes)))
+        {
+            ::remove(file.name.c_str());
+            continue;
+        }
+        ++kept;
+        keptBytes += file.size;
+    }
+}
+
+ConsoleLogSink::ConsoleLogSink(LOG_LEVEL minLevel, size_t maxBytesPerSecond)
+    : LogSink(minLevel),
+      maxBytesPerSecond_(maxBytesPerSecond),
+      second_(0),
+      secondBytes_(0),
+      skippedLines_(0)
+{
+}
+
+void ConsoleLogSink::write(const LogBatch& batch)
+{
+    size_t length = batch.length;
+    if (maxBytesPerSecond_ > 0)
+    {
+        int64_t second = Timestamp::now().microSecondsSinceEpoch() / Timestamp::kMicroSecondsPerSecond;
+        if (second != second_)
+        {
+            if (skippedLines_ > 0)
+            {
+                char note[64];
+                int n = snprintf(note, sizeof(note), "[console log: %llu lines skipped]\n", static_cast<unsigned long long>(skippedLines_));
+                writeAll(kStdout, note, static_cast<size_t>(n));
+            }
+            second_ = second;
+            secondBytes_ = 0;
+            skippedLines_ = 0;
+        }
+
+        //whole lines up to the budget of this second
+        size_t lines = 0;
+        length = 0;
+        while (lines < batch.lineCount && secondBytes_ + length + batch.lineLength(lines) <= maxBytesPerSecond_)
+            length += batch.lineLength(lines++);
+        secondBytes_ += length;
+        skippedLines_ += batch.lineCount - lines;
+    }
+
+    writeAll(kStdout, batch.data, length);
+#ifdef _WIN32
+    OutputDebugStringA(std::string(batch.data, length).c_str());
+#endif
+}
+
+UdpLogSink::UdpLogSink(const char* ip, uint16_t port, const char* tag, LOG_LEVEL minLevel)
+    : LogSink(minLevel),
+      tag_(tag != nullptr ? tag : ""),
+      valid_(false)
+{
+    memset(&address_, 0, sizeof(address_));
+    address_.sin_family = AF_INET;
+    address_.sin_port = htons(port);
+    fd_ = ::socket(AF_INET, SOCK_DGRAM, 0);
+    valid_ = fd_ != static_cast<SOCKET>(-1) && ::inet_pton(AF_INET, ip, &address_.sin_addr) == 1;
+}
+
+UdpLogSink::~UdpLogSink()
+{
+    if (fd_ != static_cast<SOCKET>(-1))
+        closesocket(fd_);
+}
+
+int UdpLogSink::priority(long level)
+{
+    //facility user (1), severities of RFC 3164
+    static const int kSeverities[] = { 7, 7, 6, 4, 3, 3, 2, 5 };
+    int severity = level >= LOG_LEVEL_TRACE && level <= LOG_LEVEL_CRITICAL ? kSeverities[level] : 6;
+    return 1 * 8 + severity;
+}
+
+void UdpLogSink::write(const LogBatch& batch)
+{
+    if (!valid_)
+        return;
+
+    //"<PRI>tag: " and the line without its newline, cut at kMaxDatagram
+    char datagrams[kBatchLines][kMaxDatagram];
+    size_t lengths[kBatchLines];
+    for (size_t first = 0; first < batch.lineCount; first += kBatchLines)
+    {
+        size_t count = batch.lineCount - first < kBatchLines ? batch.lineCount - first : kBatchLines;
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t line = first + i;
+            int n = snprintf(datagrams[i], kMaxDatagram, "<%d>%s: ", priority(batch.lines[line].level), tag_.c_str());
+            size_t length = n > 0 && static_cast<size_t>(n) < kMaxDatagram ? static_cast<size_t>(n) : 0;
+            size_t lineLength = batch.lineLength(line) - 1;
+            if (lineLength > kMaxDatagram - length)
+                lineLength = kMaxDatagram - length;
+            memcpy(datagrams[i] + length, batch.lineBegin(line), lineLength);
+            lengths[i] = length + lineLength;
+        }
+
+#ifdef WIN32
+        for (size_t i = 0; i < count; ++i)
+            ::sendto(fd_, datagrams[i], static_cast<int>(lengths[i]), 0, reinterpret_cast<const sockaddr*>(&address_), sizeof(address_));
+#else
+        struct iovec iovecs[kBatchLines];
+        struct mmsghdr messages[kBatchLines];
+        memset(messages, 0, sizeof(messages));
+        for (size_t i = 0; i < count; ++i)
+        {
+            iovecs[i].iov_base = datagrams[i];
+            iovecs[i].iov_len = lengths[i];
+            messages[i].msg_hdr.msg_name = &address_;
+            messages[i].msg_hdr.msg_namelen = sizeof(address_);
+            messages[i].msg_hdr.msg_iov = &iovecs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+        //best effort like syslog itself, what the kernel refuses is lost
+        size_t sent = 0;
+        while (sent < count)
+        {
+            int n = ::sendmmsg(fd_, messages + sent, static_cast<unsigned int>(count - sent), 0);
+            if (n <= 0)
+                break;
+            sent += static_cast<size_t>(n);
+        }
+#endif
+    }
+}
+
+MemoryLogSink::MemoryLogSink(size_t capacity, LOG_LEVEL minLevel)
+    : LogSink(minLevel),
+      buffer_(capacity > 0 ? capacity : 1),
+      next_(0),
+      wrapped_(false)
+{
+}
+
+void MemoryLogSink::write(const LogBatch& batch)
+{
+    const char* data = batch.data;
+    size_t length = batch.length;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (length >= buffer_.size())
+    {
+        //only the tail of the batch survives
+        data += length - buffer_.size();
+        length = buffer_.size();
+    }
+
+    size_t first = buffer_.size() - next_ < length ? buffer_.size() - next_ : length;
+    memcpy(&buffer_[next_], data, first);
+    memcpy(&buffer_[0], data + first, length - first);
+    if (next_ + length >= buffer_.size())
+        wrapped_ = true;
+    next_ = (next_ + length) % buffer_.size();
+}
+
+std::string MemoryLogSink::contents() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!wrapped_)
+        return std::string(buffer_.data(), next_);
+
+    std::string text(buffer_.data() + next_, buffer_.size() - next_);
+    text.append(buffer_.data(), next_);
+    //the oldest line was partly overwritten
+    size_t newline = text.find('\n');
+    text.erase(0, newline == std::string::npos ? text.size() : newline + 1);
+    return text;
+}
+
+END_NS(base)
@@ -0,0 +1,208 @@
+#ifndef __LOG_SINK_H
+#define __LOG_SINK_H
+
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "async_log.h"
+#include "platform.h"
+
+BEGIN_NS(base)
+
+/// End of a line in a LogBatch and the level it was logged at.
+struct LogLineEnd
+{
+    size_t  end;    // offset just past the '\n', counted from LogBatch::origin
+    long    level;
+};
+
+///
+/// Whole log lines handed to a sink in one call.
+///
+/// The bytes are contiguous and every line ends with '\n'. Sinks that write
+/// bytes just take data and length, sinks that send line by line walk the
+/// line ends.
+struct BASE_API LogBatch
+{
+    const char*         data;
+    size_t              length;
+    const LogLineEnd*   lines;
+    size_t              lineCount;
+    size_t              origin;     // subtracted from lines[i].end to get an offset into data
+
+    const char* lineBegin(size_t i) const { return data + (i == 0 ? 0 : lines[i - 1].end - origin); }
+    size_t lineLength(size_t i) const { return data + lines[i].end - origin - lineBegin(i); }
+};
+
+///
+/// Destination of the log lines, see CAsyncLog::init().
+///
+/// The writer thread merges the lines of all threads into large blocks and
+/// hands each sink the lines at or above its level in as few write() calls
+/// as the filter allows. write() and flush() are only called with the sinks
+/// of CAsyncLog locked, so a sink needs no locking of its own for them.
+class BASE_API LogSink
+{
+public:
+    explicit LogSink(LOG_LEVEL minLevel = LOG_LEVEL_TRACE) : minLevel_(minLevel) {}
+    virtual ~LogSink() = default;
+
+    LogSink(const LogSink&) = delete;
+    LogSink& operator=(const LogSink&) = delete;
+
+    LOG_LEVEL minLevel() const { return minLevel_; }
+    bool accepts(long level) const { return level >= minLevel_ || level == LOG_LEVEL_CRITICAL; }
+
+    virtual void write(const LogBatch& batch) = 0;
+    /// Called when the writer has nothing more queued, and after a FATAL line.
+    virtual void flush() {}
+
+private:
+    const LOG_LEVEL minLevel_;
+};
+
+/// When FileLogSink starts a new file and what it keeps of the old ones.
+struct LogFileOptions
+{
+    int64_t rollSize = 10 * 1024 * 1024;    // bytes per file, 0: no limit
+    int     rollInterval = 0;               // seconds per file, 0: no limit; a divisor of a day starts files at local
+                                            // multiples of it, e.g. 3600 at every full hour
+    bool    compress = false;               // gzip files once they are closed (not on Windows)
+    int     maxFiles = 0;                   // delete the oldest files beyond this many, 0: keep all
+    int64_t maxTotalBytes = 0;              // delete the oldest files while all take more, 0: no limit
+};
+
+///
+/// Log files named "<baseName>.<YYYYmmddHHMMSS>.<pid>.log", a new one is
+/// started when the current one reaches the size or the age in its
+/// LogFileOptions. A file started in the same second as an older one gets
+/// a sequence number, "<baseName>.<YYYYmmddHHMMSS>.<pid>.<n>.log".
+///
+/// The writer thread does not pay for a roll: a helper thread of low
+/// priority opens the next file ahead of time, and closes, compresses and
+/// deletes old files afterwards. Retention only counts files with the same
+/// base name, whatever process wrote them.
+class BASE_API FileLogSink : public LogSink
+{
+public:
+    FileLogSink(const std::string& baseName, int64_t rollSize, LOG_LEVEL minLevel = LOG_LEVEL_TRACE);
+    FileLogSink(const std::string& baseName, const LogFileOptions& options, LOG_LEVEL minLevel = LOG_LEVEL_TRACE);
+    ~FileLogSink() override;
+
+    void write(const LogBatch& batch) override;
+
+    /// Name of the file written now, empty before the first line.
+    const std::string& fileName() const { return fileName_; }
+
+private:
+    // a file the writer is done with, for the helper to close and compress
+    struct ClosedFile
+    {
+        int         file;
+        std::string name;
+    };
+
+    std::string makeFileName();
+    int64_t nextRollTime(time_t now) const;
+    bool rollFile(time_t now);
+    void helperThreadProc();
+    void compressFile(const std::string& name);
+    void removeOldFiles();
+
+    const std::string       baseName_;
+    const LogFileOptions    options_;
+    std::string             pid_;
+    std::string             fileName_;      // changed under mutex_, the helper reads it
+    int                     file_;          // written with write(2), nothing to flush
+    int64_t                 writtenSize_;
+    int64_t                 rollTime_;      // when the current file is due to be replaced, 0: never
+    std::string             lastPrefix_;    // name of the last file without sequence and ".log"
+    int                     lastSequence_;
+
+    std::mutex              mutex_;         // guards the members below
+    std::condition_variable cond_;
+    int                     nextFile_;      // opened ahead under nextFileName_
+    std::string             nextFileName_;
+    bool                    wantNextFile_;
+    std::deque<ClosedFile>  closedFiles_;
+    bool                    exit_;
+    std::thread             helper_;
+};
+
+///
+/// Echo of the log on stdout (and the debugger on Windows).
+///
+/// With @c maxBytesPerSecond set, lines over the budget of the current
+/// second are skipped, and a note of how many were skipped is printed when
+/// the next second starts.
+class BASE_API ConsoleLogSink : public LogSink
+{
+public:
+    explicit ConsoleLogSink(LOG_LEVEL minLevel = LOG_LEVEL_TRACE, size_t maxBytesPerSecond = 0);
+
+    void write(const LogBatch& batch) override;
+
+private:
+    const size_t    maxBytesPerSecond_;
+    int64_t         second_;
+    size_t          secondBytes_;
+    uint64_t        skippedLines_;
+};
+
+///
+/// Sends every line as a BSD syslog (RFC 3164) style datagram,
+/// "<PRI>tag: line", to an IPv4 address, e.g. a local rsyslogd on port 514.
+///
+/// Lines longer than kMaxDatagram are cut. On Linux a batch goes out with
+/// sendmmsg(2), kBatchLines datagrams per system call.
+class BASE_API UdpLogSink : public LogSink
+{
+public:
+    static const size_t kMaxDatagram = 1024;
+    static const size_t kBatchLines = 64;
+
+    UdpLogSink(const char* ip, uint16_t port, const char* tag, LOG_LEVEL minLevel = LOG_LEVEL_WARNING);
+    ~UdpLogSink() override;
+
+    /// false if the socket could not be created or @c ip did not parse.
+    bool valid() const { return valid_; }
+
+    void write(const LogBatch& batch) override;
+
+private:
+    // "<PRI>" of the facility user and the severity that matches the level
+    static int priority(long level);
+
+    std::string         tag_;
+    SOCKET              fd_;
+    bool                valid_;
+    struct sockaddr_in  address_;
+};
+
+///
+/// Keeps the last @c capacity bytes of the log in memory, e.g. to put into
+/// a crash report. contents() may be called from any thread.
+class BASE_API MemoryLogSink : public LogSink
+{
+public:
+    explicit MemoryLogSink(size_t capacity, LOG_LEVEL minLevel = LOG_LEVEL_TRACE);
+
+    void write(const LogBatch& batch) override;
+
+    /// The newest lines that fit, oldest first, starting at a whole line.
+    std::string contents() const;
+
+private:
+    mutable std::mutex  mutex_;
+    std::vector<char>   buffer_;
+    size_t              next_;      // where the next byte goes
+    bool                wrapped_;
+};
+
+END_NS(base)
+
+#endif // !__LOG_SINK_H
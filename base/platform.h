@@ -100,6 +100,8 @@ typedef int SOCKET;
 #include <sys/stat.h>
 #include <sys/uio.h>
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
 #include <sys/syscall.h>
 
 //for ubuntu readv not found
@@ -62,7 +62,8 @@ void Acceptor::handleRead()
     }
     else
     {
-        LOGSYSE("in Acceptor::handleRead");
+        //out of fds, every poll reports the pending connection again
+        LOGSYSE_EVERY_MS(1000, "in Acceptor::handleRead");
 
 #ifndef WIN32
         /*
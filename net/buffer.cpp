@@ -15,6 +15,11 @@ int32_t Buffer::readFd(int fd, int* savedErrno)
 {
   // saved an ioctl()/FIONREAD call to tell how much to read
 	char extrabuf[65536];
+	return readFd(fd, savedErrno, extrabuf, sizeof extrabuf);
+}
+
+int32_t Buffer::readFd(int fd, int* savedErrno, char* extrabuf, size_t extrabufLen)
+{
 	const size_t writable = writableBytes();
 #ifndef WIN32
 	struct iovec vec[2];
@@ -22,13 +27,13 @@ int32_t Buffer::readFd(int fd, int* savedErrno)
 	vec[0].iov_base = begin() + writerIndex_;
 	vec[0].iov_len = writable;
 	vec[1].iov_base = extrabuf;
-	vec[1].iov_len = sizeof extrabuf;
+	vec[1].iov_len = extrabufLen;
 	// when there is enough space in this buffer, don't read into extrabuf.
-	// when extrabuf is used, we read 128k-1 bytes at most.
-	const int iovcnt = (writable < sizeof extrabuf) ? 2 : 1;
+	// when extrabuf is used, we read writable + extrabufLen bytes at most.
+	const int iovcnt = (writable < extrabufLen) ? 2 : 1;
 	const ssize_t n = SocketsOps::readv(fd, vec, iovcnt);
 #else
-	const int32_t n = SocketsOps::read(fd, extrabuf, sizeof(extrabuf));
+	const int32_t n = SocketsOps::read(fd, extrabuf, static_cast<int32_t>(extrabufLen));
 #endif
 	if (n <= 0)
 	{
@@ -56,6 +61,7 @@ int32_t Buffer::readFd(int fd, int* savedErrno)
 		//Linuxƽ̨ʣµֽڲȥ
 		writerIndex_ = buffer_.size();
 		append(extrabuf, n - writable);
+		bytesCopied_ += n - writable;
 #endif
 	}
 	return n;
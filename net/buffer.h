@@ -3,10 +3,12 @@
 
 
 #include <algorithm>
+#include <memory>
 #include <vector>
 
 #include <assert.h>
 #include <string>
+#include <string_view>
 #include <cstring>
 
 #include "common.h"
@@ -14,6 +16,27 @@
 
 BEGIN_NS(net)
 
+/// An allocator that default-initializes elements, so growing a
+/// std::vector<char> with resize() does not zero-fill the new bytes
+/// that are about to be overwritten by read(2) anyway.
+template <typename T>
+class DefaultInitAllocator : public std::allocator<T>
+{
+ public:
+  template <typename U>
+  struct rebind { typedef DefaultInitAllocator<U> other; };
+
+  using std::allocator<T>::allocator;
+
+  template <typename U>
+  void construct(U* p)
+  { ::new (static_cast<void*>(p)) U; }
+
+  template <typename U, typename... Args>
+  void construct(U* p, Args&&... args)
+  { ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+};
+
 /// A buffer class modeled after org.jboss.netty.buffer.ChannelBuffer
 ///
 /// @code
@@ -33,7 +56,9 @@ class Buffer
   explicit Buffer(size_t initialSize = kInitialSize)
     : buffer_(kCheapPrepend + initialSize),
       readerIndex_(kCheapPrepend),
-      writerIndex_(kCheapPrepend)
+      writerIndex_(kCheapPrepend),
+      bytesMoved_(0),
+      bytesCopied_(0)
   {
     assert(readableBytes() == 0);
     assert(writableBytes() == initialSize);
@@ -154,11 +179,72 @@ class Buffer
     return result;
   }
 
+  /// Copies the readable bytes, kept for compatibility, see toStringView().
   std::string toStringPiece() const
   {
     return std::string(peek(), static_cast<int>(readableBytes()));
   }
 
+  // The views below do not own their bytes. They stay valid until the
+  // buffer is written to (append, readFd, ...) or destructs, so use them
+  // right away, e.g. within the message callback that got the buffer.
+
+  std::string_view toStringView() const
+  { return std::string_view(peek(), readableBytes()); }
+
+  std::string_view peekView(size_t len) const
+  {
+    assert(len <= readableBytes());
+    return std::string_view(peek(), len);
+  }
+
+  /// Retrieves @c len bytes and returns a view of them.
+  std::string_view retrieveAsView(size_t len)
+  {
+    std::string_view result = peekView(len);
+    retrieve(len);
+    return result;
+  }
+
+  std::string_view retrieveAllAsView()
+  {
+    return retrieveAsView(readableBytes());
+  }
+
+  /// Retrieves one line terminated by "\n" or "\r\n", @c line is set
+  /// to it without the terminator.
+  /// @return false if no complete line is buffered, nothing is retrieved
+  bool retrieveLineView(std::string_view* line)
+  {
+    const char* eol = findEOL();
+    if (eol == nullptr)
+      return false;
+
+    const char* end = eol;
+    if (end > peek() && *(end - 1) == '\r')
+      --end;
+    *line = std::string_view(peek(), end - peek());
+    retrieveUntil(eol + 1);
+    return true;
+  }
+
+  /// Retrieves one frame prefixed with its length as a network endian
+  /// int32_t, @c payload is set to the bytes after the prefix.
+  /// @return false if no complete frame is buffered, nothing is retrieved
+  bool retrieveFrameView(std::string_view* payload)
+  {
+    if (readableBytes() < sizeof(int32_t))
+      return false;
+
+    uint32_t len = static_cast<uint32_t>(peekInt32());
+    if (readableBytes() - sizeof(int32_t) < len)
+      return false;
+
+    *payload = std::string_view(peek() + sizeof(int32_t), len);
+    retrieve(sizeof(int32_t) + len);
+    return true;
+  }
+
   void append(const std::string& str)
   {
     append(str.data(), str.size());
@@ -347,9 +433,8 @@ class Buffer
   void shrink(size_t reserve)
   {
     // FIXME: use vector::shrink_to_fit() in C++ 11 if possible.
-    Buffer other;
-    other.ensureWritableBytes(readableBytes()+reserve);
-    other.append(toStringPiece());
+    Buffer other(readableBytes()+reserve);
+    other.append(peek(), readableBytes());
     swap(other);
   }
 
@@ -358,12 +443,30 @@ class Buffer
     return buffer_.capacity();
   }
 
+  /// Bytes moved to the front of the buffer to reuse prependable space.
+  size_t bytesMoved() const
+  { return bytesMoved_; }
+
+  /// Bytes copied into new storage on growth, or out of the overflow
+  /// buffer of readFd().
+  size_t bytesCopied() const
+  { return bytesCopied_; }
+
   /// Read data directly into buffer.
   ///
   /// It may implement with readv(2)
   /// @return result of read(2), @c errno is saved
   int32_t readFd(int fd, int* savedErrno);
 
+  /// Read data directly into the writable space, and whatever does not fit
+  /// into @c extrabuf, which is then appended.
+  ///
+  /// Callers size writable space with ensureWritableBytes() beforehand, so
+  /// that @c extrabuf (usually shared by every connection of a loop) is the
+  /// exception rather than the rule.
+  /// @return result of read(2), @c errno is saved
+  int32_t readFd(int fd, int* savedErrno, char* extrabuf, size_t extrabufLen);
+
  private:
 
   char* begin()
@@ -376,8 +479,18 @@ class Buffer
   {
     if (writableBytes() + prependableBytes() < len + kCheapPrepend)
     {
-      // FIXME: move readable data
-      buffer_.resize(writerIndex_+len);
+      // grow into new storage, copying the readable bytes only; at least
+      // double the size so that repeated appends stay amortized O(1)
+      size_t readable = readableBytes();
+      size_t size = std::max(kCheapPrepend + readable + len, buffer_.size() * 2);
+      std::vector<char, DefaultInitAllocator<char> > grown(size);
+      std::copy(begin()+readerIndex_,
+                begin()+writerIndex_,
+                grown.begin()+kCheapPrepend);
+      buffer_.swap(grown);
+      readerIndex_ = kCheapPrepend;
+      writerIndex_ = readerIndex_ + readable;
+      bytesCopied_ += readable;
     }
     else
     {
@@ -389,14 +502,17 @@ class Buffer
                 begin()+kCheapPrepend);
       readerIndex_ = kCheapPrepend;
       writerIndex_ = readerIndex_ + readable;
+      bytesMoved_ += readable;
       assert(readable == readableBytes());
     }
   }
 
  private:
-  std::vector<char> buffer_;
+  std::vector<char, DefaultInitAllocator<char> > buffer_;
   size_t readerIndex_;
   size_t writerIndex_;
+  size_t bytesMoved_;
+  size_t bytesCopied_;
 
   static const char kCRLF[];
 };
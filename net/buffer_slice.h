@@ -0,0 +1,125 @@
+#ifndef __NET_BUFFER_SLICE_H
+#define __NET_BUFFER_SLICE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <assert.h>
+#include <string.h>
+
+#include "common.h"
+#include "buffer.h"
+
+BEGIN_NS(net)
+
+///
+/// An immutable, reference-counted view of a byte payload.
+///
+/// Copying a BufferSlice only bumps an atomic reference count, so one payload
+/// can be queued on many connections at once and still exist once in memory.
+/// The bytes are released when the last slice referring to them goes away,
+/// i.e. when every connection has finished (or abandoned) writing them.
+///
+/// @code
+/// BufferSlice payload = BufferSlice::copyOf(data, len);
+/// for (auto& conn : subscribers)
+///   conn->send(payload);
+/// @endcode
+class BufferSlice
+{
+ public:
+  BufferSlice()
+    : offset_(0),
+      length_(0)
+  { }
+
+  // implicit copy-ctor, move-ctor, dtor and assignment are fine
+
+  /// Copies @c len bytes once into a new shared payload.
+  static BufferSlice copyOf(const void* data, size_t len)
+  {
+    std::shared_ptr<char> storage(new char[len > 0 ? len : 1], std::default_delete<char[]>());
+    if (len > 0)
+      ::memcpy(storage.get(), data, len);
+    return BufferSlice(std::shared_ptr<const char>(storage), 0, len);
+  }
+
+  static BufferSlice copyOf(const std::string& str)
+  {
+    return copyOf(str.data(), str.size());
+  }
+
+  /// Takes over the storage of @c str, nothing is copied.
+  static BufferSlice adopt(std::string&& str)
+  {
+    std::shared_ptr<std::string> holder = std::make_shared<std::string>(std::move(str));
+    return BufferSlice(std::shared_ptr<const char>(holder, holder->data()), 0, holder->size());
+  }
+
+  static BufferSlice adopt(std::vector<char>&& vec)
+  {
+    std::shared_ptr<std::vector<char> > holder = std::make_shared<std::vector<char> >(std::move(vec));
+    return BufferSlice(std::shared_ptr<const char>(holder, holder->data()), 0, holder->size());
+  }
+
+  /// Takes over the storage of @c buf, its readable bytes become the
+  /// slice and @c buf is left empty.
+  static BufferSlice adopt(Buffer&& buf)
+  {
+    std::shared_ptr<Buffer> holder = std::make_shared<Buffer>(0);
+    holder->swap(buf);
+    return BufferSlice(std::shared_ptr<const char>(holder, holder->peek()), 0, holder->readableBytes());
+  }
+
+  const char* data() const
+  { return data_.get() + offset_; }
+
+  size_t size() const
+  { return length_; }
+
+  bool empty() const
+  { return length_ == 0; }
+
+  /// Returns a slice sharing the same payload, starting @c offset bytes in.
+  BufferSlice slice(size_t offset) const
+  {
+    assert(offset <= length_);
+    return BufferSlice(data_, offset_ + offset, length_ - offset);
+  }
+
+  BufferSlice slice(size_t offset, size_t len) const
+  {
+    assert(offset <= length_);
+    assert(len <= length_ - offset);
+    return BufferSlice(data_, offset_ + offset, len);
+  }
+
+  /// Drops @c len bytes from the front, the payload itself is untouched.
+  void advance(size_t len)
+  {
+    assert(len <= length_);
+    offset_ += len;
+    length_ -= len;
+  }
+
+  /// Number of slices (and queued writes) sharing this payload.
+  long useCount() const
+  { return data_.use_count(); }
+
+ private:
+  BufferSlice(const std::shared_ptr<const char>& data, size_t offset, size_t len)
+    : data_(data),
+      offset_(offset),
+      length_(len)
+  { }
+
+ private:
+  std::shared_ptr<const char> data_;
+  size_t offset_;
+  size_t length_;
+};
+
+END_NS(net)
+
+#endif  // __NET_BUFFER_SLICE_H
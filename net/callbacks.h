@@ -5,6 +5,7 @@
 
 #include <functional>
 #include <memory>
+#include <string_view>
 
 using std::placeholders::_1;
 using std::placeholders::_2;
@@ -22,13 +23,21 @@ typedef std::function<void()> TimerCallback;
 typedef std::function<void (const TcpConnectionPtr&)> ConnectionCallback;
 typedef std::function<void (const TcpConnectionPtr&)> CloseCallback;
 typedef std::function<void (const TcpConnectionPtr&)> WriteCompleteCallback;
+typedef std::function<void (const TcpConnectionPtr&)> WritableCallback;
 typedef std::function<void (const TcpConnectionPtr&, size_t)> HighWaterMarkCallback;
+// the connection became a slow consumer (true) or caught up again (false)
+typedef std::function<void (const TcpConnectionPtr&, bool)> SlowConsumerCallback;
 
 // the data has been read to (buf, len)
 typedef std::function<void (const TcpConnectionPtr&,
                             Buffer*,
                             Timestamp)> MessageCallback;
 
+// one complete frame, the view is valid until the callback returns
+typedef std::function<void (const TcpConnectionPtr&,
+                            std::string_view,
+                            Timestamp)> FrameCallback;
+
 void defaultConnectionCallback(const TcpConnectionPtr& conn);
 void defaultMessageCallback(const TcpConnectionPtr& conn,
                             Buffer* buffer,
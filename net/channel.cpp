@@ -93,14 +93,14 @@ void Channel::handleEventWithGuard(Timestamp receiveTime)
     {
         if (logHup_)
         {
-            LOGW("Channel::handle_event() XPOLLHUP");
+            LOGW_LIMITED(10, 20, "Channel::handle_event() XPOLLHUP");
         }
         if (closeCallback_) closeCallback_();
     }
 
     if (revents_ & XPOLLNVAL)
     {
-        LOGW("Channel::handle_event() XPOLLNVAL");
+        LOGW_LIMITED(10, 20, "Channel::handle_event() XPOLLNVAL");
     }
 
     if (revents_ & (XPOLLERR | XPOLLNVAL))
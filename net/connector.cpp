@@ -5,6 +5,8 @@
 #include "event_loop.h"
 #include "socketsOps.h"
 
+#include <string.h>
+
 BEGIN_NS(net)
 
 const int Connector::kMaxRetryDelayMs;
@@ -168,7 +170,7 @@ void Connector::handleWrite()
         int err = SocketsOps::getSocketError(sockfd);
         if (err)
         {
-            LOGW("Connector::handleWrite - SO_ERROR = %d %s", err, strerror(err));
+            LOGW_LIMITED(10, 20, "Connector::handleWrite - SO_ERROR = %d %s", err, strerror(err));
             retry(sockfd);
         }
         else if (SocketsOps::isSelfConnect(sockfd))
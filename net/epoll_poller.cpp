@@ -67,7 +67,7 @@ Timestamp EPollPoller::poll(int timeoutMs, ChannelList* activeChannels)
         if (savedErrno != EINTR)
         {
             errno = savedErrno;
-            LOGSYSE("EPollPoller::poll()");
+            LOGSYSE_EVERY_MS(1000, "EPollPoller::poll()");
         }
     }
     return now;
@@ -140,7 +140,7 @@ bool EPollPoller::updateChannel(Channel* channel)
         //assert(index == kAdded);
         if (channels_.find(fd) == channels_.end() || channels_[fd] != channel || index != kAdded)
         {
-            LOGE("current channel is not matched current fd, fd = %d, channel = 0x%x", fd, channel);
+            LOGE("current channel is not matched current fd, fd = %d, channel = %p", fd, channel);
             return false;
         }
 
@@ -3,6 +3,7 @@
 
 #include "channel.h"
 #include "socketsOps.h"
+#include "timer_queue.h"
 #ifdef WIN32
 #include "select_poller.h"
 #else
@@ -17,6 +18,7 @@
 BEGIN_NS(net)
 
 const int kPollTimeMs = 100;
+const size_t kReceiveScratchSize = 64 * 1024;
 
 thread_local  EventLoop* t_loopInThisThread = 0;
 
@@ -30,9 +32,11 @@ EventLoop::EventLoop()
     , quit_(false)
     , eventHandling_(false)
     , callingPendingFunctors_(false)
+    , callingIterationEndFunctors_(false)
     , iteration_(0)
     , threadId_(std::this_thread::get_id())
-    //, timerQueue_(new TimerQueue(this))
+    , timerQueue_(new TimerQueue(this))
+    , receiveScratch_(new char[kReceiveScratchSize])
     , currentActiveChannel_(nullptr)
 {
     createWakeupfd();
@@ -64,7 +68,7 @@ EventLoop::EventLoop()
 EventLoop::~EventLoop()
 {
     assertInLoopThread();
-    LOGD("EventLoop 0x%x destructs.", this);
+    LOGD("EventLoop %p destructs.", this);
 
     wakeupChannel_->disableAll();
     wakeupChannel_->remove();
@@ -85,14 +89,12 @@ void EventLoop::loop()
     assertInLoopThread();
     looping_ = true;
     quit_ = false;  // FIXME: what if someone calls quit() before loop() ?
-    LOGD("EventLoop 0x%x  start looping", this);
+    LOGD("EventLoop %p  start looping", this);
 
     while (!quit_)
     {
-        //timerQueue_->doTimer();
-
         activeChannels_.clear();
-        pollReturnTime_ = poller_->poll(kPollTimeMs, &activeChannels_);
+        pollReturnTime_ = poller_->poll(timerQueue_->pollTimeoutMs(kPollTimeMs), &activeChannels_);
         //if (Logger::logLevel() <= Logger::TRACE)
         //{
         printActiveChannels();
@@ -107,7 +109,10 @@ void EventLoop::loop()
         }
         currentActiveChannel_ = nullptr;
         eventHandling_ = false;
+        // after poll, so what the timers queue runs in this iteration and not a poll timeout later
+        timerQueue_->doTimer();
         doPendingFunctors();
+        doIterationEndFunctors();
 
         /*if (frameFunctor_)
         {
@@ -115,14 +120,14 @@ void EventLoop::loop()
         }*/
     }
 
-    LOGD("EventLoop 0x%0x stop looping", this);
+    LOGD("EventLoop %p stop looping", this);
     looping_ = false;
 
 
     std::ostringstream oss;
     oss << std::this_thread::get_id();
     std::string stid = oss.str();
-    LOGI("Exiting loop, EventLoop object: 0x%x , threadID: %s", this, stid.c_str());
+    LOGI("Exiting loop, EventLoop object: %p , threadID: %s", this, stid.c_str());
 }
 
 void EventLoop::quit()
@@ -156,7 +161,7 @@ void EventLoop::queueInLoop(Functor cb)
         pendingFunctors_.push_back(cb);
     }
 
-    if (!isInLoopThread() || callingPendingFunctors_)
+    if (!isInLoopThread() || callingPendingFunctors_ || callingIterationEndFunctors_)
     {
         wakeup();
     }
@@ -168,10 +173,15 @@ size_t EventLoop::queueSize() const
     return pendingFunctors_.size();
 }
 
+void EventLoop::queueAtIterationEnd(Functor cb)
+{
+    assertInLoopThread();
+    iterationEndFunctors_.push_back(std::move(cb));
+}
+
 TimerId EventLoop::runAt(Timestamp time, TimerCallback cb)
 {
-    //return timerQueue_->addTimer(std::move(cb), time, 0.0);
-    return TimerId{};
+    return timerQueue_->addTimer(std::move(cb), time, 0);
 }
 
 TimerId EventLoop::runAfter(int64_t delay, TimerCallback cb)
@@ -183,13 +193,12 @@ TimerId EventLoop::runAfter(int64_t delay, TimerCallback cb)
 TimerId EventLoop::runEvery(int64_t interval, TimerCallback cb)
 {
     Timestamp time(addTime(Timestamp::now(), interval));
-    //return timerQueue_->addTimer(std::move(cb), time, interval);
-    return TimerId{};
+    return timerQueue_->addTimer(std::move(cb), time, interval);
 }
 
 void EventLoop::cancel(TimerId timerId)
 {
-    //return timerQueue_->cancel(timerId);
+    return timerQueue_->cancel(timerId);
 }
 
 void EventLoop::updateChannel(Channel* channel)
@@ -211,6 +220,11 @@ void EventLoop::removeChannel(Channel* channel)
     poller_->removeChannel(channel);
 }
 
+size_t EventLoop::receiveScratchSize() const
+{
+    return kReceiveScratchSize;
+}
+
 bool EventLoop::hasChannel(Channel* channel)
 {
     assert(channel->ownerLoop() == this);
@@ -239,7 +253,7 @@ bool EventLoop::createWakeupfd()
     if (getsockname(wakeupFdListen_, (sockaddr*)&serveraddr, &serveraddrlen) < 0)
     {
         //óҵ
-        LOGF("Unable to bind address info, EventLoop: 0x%x", this);
+        LOGF("Unable to bind address info, EventLoop: %p", this);
         return false;
     }
 
@@ -249,7 +263,7 @@ bool EventLoop::createWakeupfd()
     if (::connect(wakeupFdSend_, (struct sockaddr*)&serveraddr, sizeof(serveraddr)) < 0)
     {
         //óҵ
-        LOGF("Unable to connect to wakeup peer, EventLoop: 0x%x", this);
+        LOGF("Unable to connect to wakeup peer, EventLoop: %p", this);
         return false;
     }
 
@@ -259,7 +273,7 @@ bool EventLoop::createWakeupfd()
     if (wakeupFdRecv_ < 0)
     {
         //óҵ
-        LOGF("Unable to accept wakeup peer, EventLoop: 0x%x", this);
+        LOGF("Unable to accept wakeup peer, EventLoop: %p", this);
         return false;
     }
 
@@ -272,7 +286,7 @@ bool EventLoop::createWakeupfd()
     if (wakeupFd_ < 0)
     {
         //óҵ
-        LOGF("Unable to create wakeup eventfd, EventLoop: 0x%x", this);
+        LOGF("Unable to create wakeup eventfd, EventLoop: %p", this);
         return false;
     }
 
@@ -356,6 +370,22 @@ void EventLoop::doPendingFunctors()
     callingPendingFunctors_ = false;
 }
 
+void EventLoop::doIterationEndFunctors()
+{
+    callingIterationEndFunctors_ = true;
+    // callbacks may queue more, they still run in this iteration
+    while (!iterationEndFunctors_.empty())
+    {
+        std::vector<Functor> functors;
+        functors.swap(iterationEndFunctors_);
+        for (size_t i = 0; i < functors.size(); ++i)
+        {
+            functors[i]();
+        }
+    }
+    callingIterationEndFunctors_ = false;
+}
+
 void EventLoop::printActiveChannels() const
 {
     for (const Channel* channel : activeChannels_)
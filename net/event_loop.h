@@ -66,6 +66,11 @@ public:
 
     size_t queueSize() const;
 
+    /// Queues callback to run once at the end of the current iteration,
+    /// after the pending functors, before polling again.
+    /// Must be called in the loop thread.
+    void queueAtIterationEnd(Functor cb);
+
     // timers
 
     ///
@@ -74,12 +79,16 @@ public:
     ///
     TimerId runAt(Timestamp time, TimerCallback cb);
     ///
-    /// Runs callback after @c delay seconds.
+    /// Runs callback after @c delay microseconds.
     /// Safe to call from other threads.
+    /// Note: @c delay used to be documented in seconds. A caller written
+    /// that way, e.g. runAfter(5, cb), now fires after 5 microseconds;
+    /// multiply by Timestamp::kMicroSecondsPerSecond.
     ///
     TimerId runAfter(int64_t delay, TimerCallback cb);
     ///
-    /// Runs callback every @c interval seconds.
+    /// Runs callback every @c interval microseconds, seconds before, see
+    /// runAfter().
     /// Safe to call from other threads.
     ///
     TimerId runEvery(int64_t interval, TimerCallback cb);
@@ -95,6 +104,11 @@ public:
     void removeChannel(Channel* channel);
     bool hasChannel(Channel* channel);
 
+    /// Overflow buffer shared by every read in this loop, see Buffer::readFd().
+    /// Valid in the loop thread only.
+    char* receiveScratch() { return receiveScratch_.get(); }
+    size_t receiveScratchSize() const;
+
     const std::thread::id getThreadID() const
     {
         return threadId_;
@@ -133,6 +147,7 @@ private:
     void abortNotInLoopThread();
     void handleRead();  // waked up
     void doPendingFunctors();
+    void doIterationEndFunctors();
 
     void printActiveChannels() const; // DEBUG
 
@@ -143,11 +158,12 @@ private:
     std::atomic<bool> quit_;
     bool eventHandling_; /* atomic */
     bool callingPendingFunctors_; /* atomic */
+    bool callingIterationEndFunctors_;
     int64_t iteration_;
     const std::thread::id  threadId_;
     Timestamp pollReturnTime_;
     std::unique_ptr<Poller> poller_;
-    //std::unique_ptr<TimerQueue> timerQueue_;
+    std::unique_ptr<TimerQueue> timerQueue_;
 
 #ifdef WIN32
     SOCKET                              wakeupFdSend_;
@@ -161,6 +177,7 @@ private:
     // we don't expose Channel to client.
     std::unique_ptr<Channel> wakeupChannel_;
     std::any context_;
+    std::unique_ptr<char[]> receiveScratch_;
 
     // scratch variables
     ChannelList activeChannels_;
@@ -168,6 +185,8 @@ private:
 
     mutable std::mutex     mutex_;
     std::vector<Functor> pendingFunctors_;
+    // loop thread only, no locking
+    std::vector<Functor> iterationEndFunctors_;
 };
 
 END_NS(net)
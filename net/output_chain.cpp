@@ -0,0 +1,428 @@
+#include "output_chain.h"
+
+#include "platform.h"
+#include "async_log.h"
+#include "socketsOps.h"
+
+#include <errno.h>
+#include <string.h>
+
+BEGIN_NS(net)
+
+const int OutputChain::kMaxIovecs;
+
+FileRegion::~FileRegion()
+{
+#ifdef WIN32
+    ::_close(fd_);
+#else
+    ::close(fd_);
+#endif
+}
+
+OutputChain::OutputChain()
+    : readableBytes_(0),
+      fileBytes_(0),
+      appendedBytes_(0),
+      removedBytes_(0),
+      zeroCopyThreshold_(0),
+      zeroCopySeq_(0),
+      zeroCopyCopied_(0),
+      zeroCopyCopiedRun_(0),
+      zeroCopyBackoff_(0)
+{
+}
+
+OutputChain::~OutputChain()
+{
+}
+
+size_t OutputChain::chunkCount() const
+{
+    size_t count = 0;
+    for (const Lane& lane : lanes_)
+        count += lane.chunks.size();
+    return count;
+}
+
+void OutputChain::append(const void* data, size_t len, Priority priority)
+{
+    if (len == 0)
+        return;
+
+    Lane& lane = lanes_[priority];
+    // droppable messages are not coalesced, so each can be dropped alone
+    if (lane.chunks.empty() || !lane.chunks.back().buffer || priority == kPriorityDroppable)
+    {
+        Chunk chunk;
+        chunk.buffer = takeBuffer();
+        lane.chunks.push_back(std::move(chunk));
+    }
+    lane.chunks.back().buffer->append(data, len);
+    endMessage(lane, len);
+}
+
+void OutputChain::append(const BufferSlice& slice, Priority priority)
+{
+    if (slice.empty())
+        return;
+
+    Lane& lane = lanes_[priority];
+    Chunk chunk;
+    chunk.slice = slice;
+    chunk.zeroCopy = zeroCopyThreshold_ > 0 && slice.size() >= zeroCopyThreshold_;
+    lane.chunks.push_back(std::move(chunk));
+    endMessage(lane, slice.size());
+}
+
+void OutputChain::append(const FileRegionPtr& region, Priority priority)
+{
+    if (region->length() == 0)
+        return;
+
+    Lane& lane = lanes_[priority];
+    Chunk chunk;
+    chunk.file = region;
+    lane.chunks.push_back(std::move(chunk));
+    fileBytes_ += region->length();
+    endMessage(lane, region->length());
+}
+
+void OutputChain::markWritten(size_t len, Priority priority)
+{
+    if (len == 0)
+        return;
+
+    Lane& lane = lanes_[priority];
+    assert(lane.chunks.empty());
+    // the message starts before what the lane holds, see Lane::midMessage()
+    lane.appended += len;
+    lane.retrieved += len;
+}
+
+void OutputChain::endMessage(Lane& lane, size_t len)
+{
+    lane.appended += len;
+    lane.messageEnds.push_back(lane.appended);
+    readableBytes_ += len;
+    appendedBytes_ += len;
+}
+
+int OutputChain::nextLane() const
+{
+    // a message written partly is finished first
+    for (int i = 0; i < kPriorityCount; ++i)
+    {
+        if (lanes_[i].midMessage() && !lanes_[i].chunks.empty())
+            return i;
+    }
+    for (int i = 0; i < kPriorityCount; ++i)
+    {
+        if (!lanes_[i].chunks.empty())
+            return i;
+    }
+    return -1;
+}
+
+size_t OutputChain::writeLimit(int index) const
+{
+    const Lane& lane = lanes_[index];
+    for (int i = 0; i < index; ++i)
+    {
+        // a higher lane is waiting, stop at the end of the current message
+        if (!lanes_[i].chunks.empty())
+            return static_cast<size_t>(lane.messageEnds.front() - lane.retrieved);
+    }
+    return lane.readableBytes();
+}
+
+void OutputChain::retrieve(size_t len)
+{
+    assert(len <= readableBytes_);
+    while (len > 0)
+    {
+        int index = nextLane();
+        size_t n = std::min(len, writeLimit(index));
+        retrieve(lanes_[index], n);
+        len -= n;
+    }
+}
+
+void OutputChain::retrieveAll()
+{
+    for (Lane& lane : lanes_)
+        retrieve(lane, lane.readableBytes());
+}
+
+void OutputChain::retrieve(Lane& lane, size_t len)
+{
+    assert(len <= lane.readableBytes());
+    readableBytes_ -= len;
+    removedBytes_ += len;
+    lane.retrieved += len;
+    while (!lane.messageEnds.empty() && lane.messageEnds.front() <= lane.retrieved)
+    {
+        lane.messageStart = lane.messageEnds.front();
+        lane.messageEnds.pop_front();
+    }
+
+    while (len > 0)
+    {
+        Chunk& head = lane.chunks.front();
+        size_t headBytes = head.size();
+        if (len < headBytes)
+        {
+            if (head.buffer)
+            {
+                head.buffer->retrieve(len);
+            }
+            else if (head.file)
+            {
+                head.file->advance(len);
+                fileBytes_ -= len;
+            }
+            else
+            {
+                head.slice.advance(len);
+            }
+            break;
+        }
+
+        len -= headBytes;
+        if (head.file)
+        {
+            fileBytes_ -= headBytes;
+        }
+        else if (head.buffer && !spare_)
+        {
+            head.buffer->retrieveAll();
+            spare_ = std::move(head.buffer);
+        }
+        lane.chunks.pop_front();
+    }
+}
+
+size_t OutputChain::dropMessages(size_t len, size_t* messages)
+{
+    Lane& lane = lanes_[kPriorityDroppable];
+    // one chunk per message here, the rest of a message written partly stays
+    size_t first = lane.midMessage() ? 1 : 0;
+    size_t dropped = 0;
+    size_t count = 0;
+    while (dropped < len && lane.chunks.size() > first)
+    {
+        auto chunk = lane.chunks.begin() + first;
+        size_t size = chunk->size();
+        if (chunk->file)
+        {
+            fileBytes_ -= size;
+        }
+        else if (chunk->buffer && !spare_)
+        {
+            chunk->buffer->retrieveAll();
+            spare_ = std::move(chunk->buffer);
+        }
+        lane.chunks.erase(chunk);
+
+        // later messages move up by the dropped size
+        auto end = lane.messageEnds.erase(lane.messageEnds.begin() + first);
+        for (; end != lane.messageEnds.end(); ++end)
+            *end -= size;
+        lane.appended -= size;
+        readableBytes_ -= size;
+        removedBytes_ += size;
+        dropped += size;
+        ++count;
+    }
+
+    if (messages != nullptr)
+        *messages = count;
+    return dropped;
+}
+
+int32_t OutputChain::writeFd(int fd, int* savedErrno, size_t maxBytes)
+{
+    int index = nextLane();
+    if (index < 0)
+        return 0;
+
+    Lane& lane = lanes_[index];
+    size_t limit = std::min(writeLimit(index), maxBytes);
+    const Chunk& head = lane.chunks.front();
+    int32_t n = head.file ? writeFile(fd, head.file.get(), limit) : writeMemory(lane, fd, sendsZeroCopy(head), limit);
+    if (n < 0)
+    {
+#ifdef WIN32
+        *savedErrno = ::WSAGetLastError();
+#else
+        *savedErrno = errno;
+#endif
+    }
+    else
+    {
+        // a paused zero-copy slice went out copied, one write closer to trying again
+        if (!head.file && head.zeroCopy && zeroCopyThreshold_ > 0 && zeroCopyBackoff_ > 0)
+            --zeroCopyBackoff_;
+        retrieve(lane, static_cast<size_t>(n));
+    }
+    return n;
+}
+
+int32_t OutputChain::writeMemory(Lane& lane, int fd, bool zeroCopy, size_t limit)
+{
+#ifndef WIN32
+    // gather the run of memory chunks that are sent the same way
+    struct iovec vec[kMaxIovecs];
+    int iovcnt = 0;
+    for (auto it = lane.chunks.begin(); it != lane.chunks.end() && iovcnt < kMaxIovecs && limit > 0; ++it)
+    {
+        if (it->file || sendsZeroCopy(*it) != zeroCopy)
+            break;
+        vec[iovcnt].iov_base = const_cast<char*>(it->data());
+        vec[iovcnt].iov_len = std::min(it->size(), limit);
+        limit -= vec[iovcnt].iov_len;
+        ++iovcnt;
+    }
+
+#ifdef MSG_ZEROCOPY
+    if (zeroCopy)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = vec;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = SocketsOps::sendmsg(fd, &msg, MSG_ZEROCOPY);
+        if (n >= 0)
+        {
+            // every successful MSG_ZEROCOPY call takes the next sequence number
+            holdZeroCopy(lane, static_cast<size_t>(n));
+            return static_cast<int32_t>(n);
+        }
+        // out of optmem for page pinning, copy this time
+        if (errno != ENOBUFS)
+            return -1;
+    }
+#endif
+    return static_cast<int32_t>(SocketsOps::writev(fd, vec, iovcnt));
+#else
+    //Windows has no writev, send the head chunk only
+    const Chunk& head = lane.chunks.front();
+    size_t count = std::min(head.size(), limit);
+    return SocketsOps::write(fd, head.data(), static_cast<int32_t>(count));
+#endif
+}
+
+int32_t OutputChain::writeFile(int fd, FileRegion* region, size_t limit)
+{
+#ifndef WIN32
+    // keep the result representable in int32_t
+    size_t count = std::min(std::min(region->length(), limit), static_cast<size_t>(1024 * 1024 * 1024));
+    int64_t offset = region->offset();
+    ssize_t n = SocketsOps::sendfile(fd, region->fd(), &offset, count);
+#else
+    //Windows: read the region through a stack buffer and send it
+    char buf[65536];
+    size_t count = std::min(std::min(region->length(), limit), sizeof buf);
+    int32_t n = -1;
+    if (::_lseeki64(region->fd(), region->offset(), SEEK_SET) >= 0)
+    {
+        int nread = ::_read(region->fd(), buf, static_cast<unsigned int>(count));
+        n = nread > 0 ? SocketsOps::write(fd, buf, nread) : nread;
+    }
+#endif
+    if (n == 0)
+    {
+        // the file is shorter than the queued region, nothing more will come
+        LOGE("OutputChain::writeFile - fd=%d ends before offset %lld, %zu bytes missing",
+            region->fd(), (long long)region->offset(), region->length());
+        errno = EIO;
+        return -1;
+    }
+    return static_cast<int32_t>(n);
+}
+
+void OutputChain::holdZeroCopy(Lane& lane, size_t len)
+{
+    ZeroCopyBatch batch;
+    batch.seq = zeroCopySeq_++;
+    for (auto it = lane.chunks.begin(); it != lane.chunks.end() && len > 0; ++it)
+    {
+        size_t n = std::min(len, it->size());
+        batch.slices.push_back(it->slice.slice(0, n));
+        len -= n;
+    }
+    zeroCopyBatches_.push_back(std::move(batch));
+}
+
+int32_t OutputChain::handleZeroCopyCompletions(int fd)
+{
+    int32_t count = 0;
+#if !defined(WIN32) && defined(MSG_ZEROCOPY)
+    while (true)
+    {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if (SocketsOps::recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
+            break;  // EAGAIN, the error queue is drained
+
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            const struct sock_extended_err* serr = reinterpret_cast<const struct sock_extended_err*>(CMSG_DATA(cm));
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // [ee_info, ee_data] is the range of completed send calls
+            completeZeroCopy(serr->ee_info, serr->ee_data, (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+            ++count;
+        }
+    }
+#endif
+    return count;
+}
+
+void OutputChain::completeZeroCopy(uint32_t lo, uint32_t hi, bool copied)
+{
+    for (auto it = zeroCopyBatches_.begin(); it != zeroCopyBatches_.end();)
+    {
+        // unsigned arithmetic keeps this right across sequence wraparound
+        if (it->seq - lo <= hi - lo)
+            it = zeroCopyBatches_.erase(it);
+        else
+            ++it;
+    }
+
+    if (!copied)
+    {
+        zeroCopyCopiedRun_ = 0;
+        return;
+    }
+
+    // the kernel copied anyway. Once in a while that is a fallback on one
+    // skb, every time (e.g. loopback or no scatter-gather NIC) pinning pages
+    // only costs more than a plain write, so pause for a while
+    ++zeroCopyCopied_;
+    zeroCopyCopiedRun_ += hi - lo + 1;
+    if (zeroCopyCopiedRun_ >= kZeroCopyCopiedRun && zeroCopyBackoff_ == 0 && zeroCopyThreshold_ > 0)
+    {
+        LOGI("OutputChain::completeZeroCopy - kernel copied %u sends in a row, normal writes for the next %u",
+            zeroCopyCopiedRun_, kZeroCopyProbeInterval);
+        zeroCopyBackoff_ = kZeroCopyProbeInterval;
+    }
+}
+
+std::unique_ptr<Buffer> OutputChain::takeBuffer()
+{
+    if (spare_)
+        return std::move(spare_);
+
+    return std::unique_ptr<Buffer>(new Buffer());
+}
+
+END_NS(net)
@@ -0,0 +1,237 @@
+#ifndef __NET_OUTPUT_CHAIN_H
+#define __NET_OUTPUT_CHAIN_H
+
+#include <deque>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "buffer_slice.h"
+
+BEGIN_NS(net)
+
+///
+/// A region of a file waiting to be transmitted with sendfile(2).
+///
+/// It owns the file descriptor and closes it when destructs.
+class FileRegion
+{
+public:
+    FileRegion(int fd, int64_t offset, size_t length)
+        : fd_(fd),
+          offset_(offset),
+          length_(length)
+    {
+    }
+
+    ~FileRegion();
+
+    FileRegion(const FileRegion&) = delete;
+    FileRegion& operator=(const FileRegion&) = delete;
+
+    int fd() const { return fd_; }
+    int64_t offset() const { return offset_; }
+    size_t length() const { return length_; }
+
+    void advance(size_t len)
+    {
+        assert(len <= length_);
+        offset_ += len;
+        length_ -= len;
+    }
+
+private:
+    const int   fd_;
+    int64_t     offset_;
+    size_t      length_;
+};
+
+typedef std::shared_ptr<FileRegion> FileRegionPtr;
+
+///
+/// Ordered queue of bytes waiting to be written to a socket.
+///
+/// Plain messages are copied into Buffer chunks (consecutive ones coalesce
+/// into the same chunk), BufferSlice payloads are queued by reference and
+/// file regions are queued as (fd, offset, length). Memory chunks are
+/// flushed with writev(2) and file regions with sendfile(2), in the order
+/// they were appended.
+///
+/// Every append is one message and goes to a priority lane. The writer
+/// takes the highest priority lane that has data, but never switches lanes
+/// inside a message: once a message has been written partly, the rest of
+/// it goes first. So a heartbeat queued behind megabytes of bulk data waits
+/// at most for the end of the bulk message being written.
+///
+/// Messages in the droppable lane are written last and can be discarded
+/// with dropMessages() when the peer does not keep up, e.g. price updates
+/// that a later update supersedes. Each of them is kept in its own chunk.
+///
+/// With a zero-copy threshold set, slices at least that large are sent with
+/// MSG_ZEROCOPY instead. The kernel then reads the payload pages directly,
+/// so the written slices are kept referenced until their completion is
+/// read from the socket error queue by handleZeroCopyCompletions().
+/// When kZeroCopyCopiedRun sends in a row are reported copied by the kernel
+/// (e.g. loopback or a NIC without scatter-gather), zero-copy pauses for
+/// kZeroCopyProbeInterval writes and is then tried again. A copied send now
+/// and then does not turn it off.
+///
+/// Not thread safe, owned and used by one TcpConnection in its loop.
+class OutputChain
+{
+public:
+    enum Priority
+    {
+        kPriorityHigh,      // control messages, heartbeats, cancels
+        kPriorityNormal,    // everything else
+        kPriorityDroppable, // may be discarded for a slow peer, see dropMessages()
+        kPriorityCount
+    };
+
+    /// Sends the kernel copied in a row that pause zero-copy.
+    static const uint32_t kZeroCopyCopiedRun = 32;
+    /// Writes made with a plain copy while zero-copy is paused.
+    static const uint32_t kZeroCopyProbeInterval = 1024;
+
+    OutputChain();
+    ~OutputChain();
+
+    OutputChain(const OutputChain&) = delete;
+    OutputChain& operator=(const OutputChain&) = delete;
+
+    /// Bytes waiting to be written, including queued file regions.
+    size_t readableBytes() const { return readableBytes_; }
+    /// Bytes held in memory, file regions excluded.
+    size_t bufferedBytes() const { return readableBytes_ - fileBytes_; }
+    /// Bytes waiting in one lane, including queued file regions.
+    size_t readableBytes(Priority priority) const { return lanes_[priority].readableBytes(); }
+    bool empty() const { return readableBytes_ == 0; }
+    size_t chunkCount() const;
+    /// Bytes ever appended and ever retrieved or dropped, their difference
+    /// is readableBytes(). Used to tell how long queued bytes have waited.
+    uint64_t appendedBytes() const { return appendedBytes_; }
+    uint64_t removedBytes() const { return removedBytes_; }
+
+    /// Slices of at least @c threshold bytes go out with MSG_ZEROCOPY,
+    /// 0 turns it off. SO_ZEROCOPY must be enabled on the socket first.
+    void setZeroCopyThreshold(size_t threshold) { zeroCopyThreshold_ = threshold; }
+    size_t zeroCopyThreshold() const { return zeroCopyThreshold_; }
+    /// Zero-copy sends the kernel has not reported complete yet.
+    size_t zeroCopyPending() const { return zeroCopyBatches_.size(); }
+    /// Completions in which the kernel fell back to copying.
+    int64_t zeroCopyCopied() const { return zeroCopyCopied_; }
+    /// Zero-copy is paused after a run of copied sends.
+    bool zeroCopyPaused() const { return zeroCopyBackoff_ > 0; }
+
+    /// Copies @c len bytes to the tail of the lane.
+    void append(const void* data, size_t len, Priority priority = kPriorityNormal);
+    /// Queues @c slice by reference, the payload is not copied.
+    void append(const BufferSlice& slice, Priority priority = kPriorityNormal);
+    /// Queues a file region, the file is read by the kernel when written.
+    void append(const FileRegionPtr& region, Priority priority = kPriorityNormal);
+
+    /// Records that the first @c len bytes of the message appended next
+    /// to the lane were written to the socket already, so its rest is not
+    /// preempted by other lanes. The lane must be empty.
+    void markWritten(size_t len, Priority priority = kPriorityNormal);
+
+    /// Drops @c len bytes, in the order writeFd() would write them.
+    void retrieve(size_t len);
+    void retrieveAll();
+
+    /// Discards whole messages of the droppable lane, oldest first, until
+    /// at least @c len bytes are gone or the lane is empty. A message
+    /// written partly is kept, the peer has to receive its rest.
+    /// @return bytes dropped, the number of messages goes to @c messages
+    size_t dropMessages(size_t len, size_t* messages);
+
+    /// Writes as many queued bytes of one lane as possible to @c fd and
+    /// retrieves them.
+    ///
+    /// Consecutive memory chunks go out in one writev(2), a file region at
+    /// the head goes out with sendfile(2). A lower lane finishing a message
+    /// is written only up to the end of that message if a higher lane
+    /// has data waiting. At most @c maxBytes are written.
+    /// @return result of write(2), @c errno is saved
+    int32_t writeFd(int fd, int* savedErrno, size_t maxBytes = SIZE_MAX);
+
+    /// Reads MSG_ZEROCOPY completions from the error queue of @c fd and
+    /// releases the slices they cover. If the kernel reports it had to copy,
+    /// zero-copy is turned off and later slices are written normally.
+    /// @return number of completions read
+    int32_t handleZeroCopyCompletions(int fd);
+
+private:
+    struct Chunk
+    {
+        std::unique_ptr<Buffer> buffer;  // copied bytes
+        BufferSlice             slice;   // shared bytes
+        FileRegionPtr           file;    // file bytes
+        bool                    zeroCopy = false;
+
+        const char* data() const { return buffer ? buffer->peek() : slice.data(); }
+        size_t size() const
+        {
+            if (buffer)
+                return buffer->readableBytes();
+            return file ? file->length() : slice.size();
+        }
+    };
+
+    // offsets below count the bytes ever appended to the lane
+    struct Lane
+    {
+        std::deque<Chunk>       chunks;
+        std::deque<uint64_t>    messageEnds;    // end offset of each queued message
+        uint64_t                appended = 0;
+        uint64_t                retrieved = 0;
+        uint64_t                messageStart = 0;   // start offset of the front message
+
+        size_t readableBytes() const { return static_cast<size_t>(appended - retrieved); }
+        bool midMessage() const { return retrieved != messageStart; }
+    };
+
+    // slices written with MSG_ZEROCOPY, kept alive until the kernel
+    // reports completion of send call number seq
+    struct ZeroCopyBatch
+    {
+        uint32_t                 seq;
+        std::vector<BufferSlice> slices;
+    };
+
+    bool sendsZeroCopy(const Chunk& chunk) const
+    { return chunk.zeroCopy && zeroCopyThreshold_ > 0 && zeroCopyBackoff_ == 0; }
+    int nextLane() const;
+    size_t writeLimit(int index) const;
+    void endMessage(Lane& lane, size_t len);
+    void retrieve(Lane& lane, size_t len);
+    int32_t writeMemory(Lane& lane, int fd, bool zeroCopy, size_t limit);
+    void holdZeroCopy(Lane& lane, size_t len);
+    void completeZeroCopy(uint32_t lo, uint32_t hi, bool copied);
+    int32_t writeFile(int fd, FileRegion* region, size_t limit);
+    std::unique_ptr<Buffer> takeBuffer();
+
+    // at most this many chunks are gathered into one writev(2)
+    static const int kMaxIovecs = 64;
+
+    Lane                    lanes_[kPriorityCount];
+    size_t                  readableBytes_;
+    size_t                  fileBytes_;
+    uint64_t                appendedBytes_;
+    uint64_t                removedBytes_;
+    size_t                  zeroCopyThreshold_;
+    uint32_t                zeroCopySeq_;
+    int64_t                 zeroCopyCopied_;
+    uint32_t                zeroCopyCopiedRun_;     // sends copied in a row
+    uint32_t                zeroCopyBackoff_;       // plain writes left before trying zero-copy again
+    std::deque<ZeroCopyBatch> zeroCopyBatches_;
+    // a drained Buffer chunk kept around, so the common single-chunk
+    // case does not allocate every time the chain empties
+    std::unique_ptr<Buffer> spare_;
+};
+
+END_NS(net)
+
+#endif  // __NET_OUTPUT_CHAIN_H
@@ -35,7 +35,7 @@ Timestamp PollPoller::poll(int timeoutMs, ChannelList* activeChannels)
         if (savedErrno != EINTR)
         {
             errno = savedErrno;
-            LOGSYSE("PollPoller::poll()");
+            LOGSYSE_EVERY_MS(1000, "PollPoller::poll()");
         }
     }
     return now;
@@ -0,0 +1,81 @@
+#include "receive_sizer.h"
+
+#include <algorithm>
+#include <vector>
+
+BEGIN_NS(net)
+
+const size_t AdaptiveReceiveSizer::kMinimum;
+const size_t AdaptiveReceiveSizer::kInitial;
+const size_t AdaptiveReceiveSizer::kMaximum;
+
+namespace
+{
+
+const int kIndexIncrement = 4;
+const int kIndexDecrement = 1;
+
+// 16, 32, ... 496 in steps of 16, then doubling from 512 up to 1G
+const std::vector<size_t>& sizeTable()
+{
+    static const std::vector<size_t> table = []
+    {
+        std::vector<size_t> sizes;
+        for (size_t i = 16; i < 512; i += 16)
+            sizes.push_back(i);
+        for (size_t i = 512; i > 0 && i <= 1024 * 1024 * 1024; i <<= 1)
+            sizes.push_back(i);
+        return sizes;
+    }();
+    return table;
+}
+
+// index of the smallest table entry not less than size
+int sizeIndex(size_t size)
+{
+    const std::vector<size_t>& table = sizeTable();
+    auto it = std::lower_bound(table.begin(), table.end(), size);
+    if (it == table.end())
+        --it;
+    return static_cast<int>(it - table.begin());
+}
+
+}
+
+AdaptiveReceiveSizer::AdaptiveReceiveSizer(size_t minimum, size_t initial, size_t maximum)
+    : minIndex_(sizeIndex(minimum)),
+      maxIndex_(sizeIndex(maximum)),
+      index_(sizeIndex(initial)),
+      decreaseNow_(false)
+{
+    index_ = std::max(minIndex_, std::min(index_, maxIndex_));
+}
+
+size_t AdaptiveReceiveSizer::guess() const
+{
+    return sizeTable()[index_];
+}
+
+void AdaptiveReceiveSizer::record(size_t bytesRead)
+{
+    const std::vector<size_t>& table = sizeTable();
+    if (bytesRead <= table[std::max(0, index_ - kIndexDecrement)])
+    {
+        if (decreaseNow_)
+        {
+            index_ = std::max(index_ - kIndexDecrement, minIndex_);
+            decreaseNow_ = false;
+        }
+        else
+        {
+            decreaseNow_ = true;
+        }
+    }
+    else if (bytesRead >= table[index_])
+    {
+        index_ = std::min(index_ + kIndexIncrement, maxIndex_);
+        decreaseNow_ = false;
+    }
+}
+
+END_NS(net)
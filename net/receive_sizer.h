@@ -0,0 +1,45 @@
+#ifndef __NET_RECEIVE_SIZER_H
+#define __NET_RECEIVE_SIZER_H
+
+#include <stddef.h>
+
+#include "common.h"
+
+BEGIN_NS(net)
+
+///
+/// Guesses how many bytes the next read on a connection will return,
+/// from the sizes of recent reads, like netty's AdaptiveRecvByteBufAllocator.
+///
+/// The guess jumps up as soon as a read fills it, and only steps down after
+/// two reads in a row would have fit the next smaller size. TcpConnection
+/// reserves that much writable space in its input buffer before each read,
+/// so the shared overflow buffer of the loop (and the copy out of it) is
+/// rarely needed, without an ioctl(FIONREAD) per read.
+class AdaptiveReceiveSizer
+{
+public:
+    static const size_t kMinimum = 64;
+    static const size_t kInitial = 2048;
+    static const size_t kMaximum = 65536;
+
+    explicit AdaptiveReceiveSizer(size_t minimum = kMinimum,
+                                  size_t initial = kInitial,
+                                  size_t maximum = kMaximum);
+
+    /// Bytes the next read is expected to return.
+    size_t guess() const;
+
+    /// Feeds back how many bytes the last read returned.
+    void record(size_t bytesRead);
+
+private:
+    int     minIndex_;
+    int     maxIndex_;
+    int     index_;
+    bool    decreaseNow_;
+};
+
+END_NS(net)
+
+#endif  // __NET_RECEIVE_SIZER_H
@@ -83,7 +83,7 @@ Timestamp SelectPoller::poll(int timeoutMs, ChannelList* activeChannels)
         savedErrno = errno;
 #endif
                      
-        LOGSYSE("SelectPoller::poll() error, errno: %d", savedErrno);
+        LOGSYSE_EVERY_MS(1000, "SelectPoller::poll() error, errno: %d", savedErrno);
     }
 
     return now;
@@ -172,7 +172,7 @@ bool SelectPoller::updateChannel(Channel* channel)
         //assert(index == kAdded);
         if (channels_.find(fd) == channels_.end() || channels_[fd] != channel || index != kAdded)
         {
-            LOGE("current channel is not matched current fd, fd = %d, channel = 0x%x", fd, channel);
+            LOGE("current channel is not matched current fd, fd = %d, channel = %p", fd, channel);
             return false;
         }
 
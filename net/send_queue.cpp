@@ -0,0 +1,46 @@
+#include "send_queue.h"
+
+BEGIN_NS(net)
+
+SendQueue::SendQueue()
+    : head_(nullptr)
+{
+}
+
+SendQueue::~SendQueue()
+{
+    Node* node = head_.exchange(nullptr, std::memory_order_acquire);
+    while (node != nullptr)
+    {
+        Node* next = node->next;
+        delete node;
+        node = next;
+    }
+}
+
+bool SendQueue::push(Node* node)
+{
+    node->next = head_.load(std::memory_order_relaxed);
+    while (!head_.compare_exchange_weak(node->next, node,
+        std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+    return node->next == nullptr;
+}
+
+SendQueue::Node* SendQueue::popAll()
+{
+    // newest first as pushed, reverse into send order
+    Node* node = head_.exchange(nullptr, std::memory_order_acquire);
+    Node* ordered = nullptr;
+    while (node != nullptr)
+    {
+        Node* next = node->next;
+        node->next = ordered;
+        ordered = node;
+        node = next;
+    }
+    return ordered;
+}
+
+END_NS(net)
@@ -0,0 +1,54 @@
+#ifndef __NET_SEND_QUEUE_H
+#define __NET_SEND_QUEUE_H
+
+#include <atomic>
+#include <string>
+
+#include "common.h"
+#include "buffer_slice.h"
+#include "output_chain.h"
+
+BEGIN_NS(net)
+
+///
+/// Lock-free multi-producer single-consumer queue of outgoing messages.
+///
+/// Any thread may push, the loop thread of the owning TcpConnection takes
+/// everything queued at once. A push is one compare-and-swap on the head;
+/// the consumer swaps the head with null and reverses the list to get the
+/// messages back in push order.
+class SendQueue
+{
+public:
+    /// One queued message, exactly one of the members carries the bytes.
+    struct Node
+    {
+        Node*           next = nullptr;
+        std::string     message;
+        BufferSlice     slice;
+        FileRegionPtr   file;
+        OutputChain::Priority priority = OutputChain::kPriorityNormal;
+    };
+
+    SendQueue();
+    ~SendQueue();
+
+    SendQueue(const SendQueue&) = delete;
+    SendQueue& operator=(const SendQueue&) = delete;
+
+    /// Takes ownership of @c node. Thread safe.
+    /// @return true if the queue was empty, the caller then has to get the
+    ///         queue drained; pushes until that happens join the same batch.
+    bool push(Node* node);
+
+    /// Takes all queued nodes, oldest first, linked by Node::next.
+    /// The caller owns and deletes them. Consumer thread only.
+    Node* popAll();
+
+private:
+    std::atomic<Node*> head_;
+};
+
+END_NS(net)
+
+#endif  // __NET_SEND_QUEUE_H
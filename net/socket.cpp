@@ -8,6 +8,7 @@
 
 #include "socket.h"
 #include "socketsOps.h"
+#include <algorithm>
 #include <cstring>
 
 BEGIN_NS(net)
@@ -108,4 +109,24 @@ void Socket::setKeepAlive(bool on)
 #endif
 }
 
+bool Socket::setZeroCopy(bool on)
+{
+#if defined(WIN32) || !defined(SO_ZEROCOPY)
+    return false;
+#else
+    int optval = on ? 1 : 0;
+    return ::setsockopt(sockfd_, SOL_SOCKET, SO_ZEROCOPY, &optval, static_cast<socklen_t>(sizeof optval)) == 0;
+#endif
+}
+
+bool Socket::setNotSentLowat(size_t bytes)
+{
+#if defined(WIN32) || !defined(TCP_NOTSENT_LOWAT)
+    return false;
+#else
+    int optval = static_cast<int>(std::min(bytes, static_cast<size_t>(INT32_MAX)));
+    return ::setsockopt(sockfd_, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &optval, static_cast<socklen_t>(sizeof optval)) == 0;
+#endif
+}
+
 END_NS(net)
\ No newline at end of file
@@ -61,6 +61,19 @@ class Socket
   ///
   void setKeepAlive(bool on);
 
+  ///
+  /// Enable/disable SO_ZEROCOPY, needed before sending with MSG_ZEROCOPY.
+  /// Returns false if the kernel does not support it.
+  ///
+  bool setZeroCopy(bool on);
+
+  ///
+  /// Sets TCP_NOTSENT_LOWAT, the socket then polls writable only while
+  /// fewer than @c bytes sent bytes wait in the kernel unsent.
+  /// Returns false if the kernel does not support it.
+  ///
+  bool setNotSentLowat(size_t bytes);
+
  private:
   const int sockfd_;
 };
@@ -120,12 +120,12 @@ SOCKET SocketsOps::accept(SOCKET sockfd, struct sockaddr_in* addr)
     {
 #ifdef WIN32
         int savedErrno = ::WSAGetLastError();
-        LOGSYSE("Socket::accept");
+        LOGSYSE_LIMITED(10, 20, "Socket::accept");
         if (savedErrno != WSAEWOULDBLOCK)
             LOGF("unexpected error of ::accept %d", savedErrno);
 #else
         int savedErrno = errno;
-        LOGSYSE("Socket::accept");
+        LOGSYSE_LIMITED(10, 20, "Socket::accept");
         switch (savedErrno)
         {
         case EAGAIN:
@@ -218,6 +218,31 @@ int32_t SocketsOps::write(SOCKET sockfd, const void* buf, int32_t count)
 
 }
 
+#ifndef WIN32
+ssize_t SocketsOps::writev(SOCKET sockfd, const struct iovec* iov, int iovcnt)
+{
+    return ::writev(sockfd, iov, iovcnt);
+}
+
+ssize_t SocketsOps::sendfile(SOCKET sockfd, int fileFd, int64_t* offset, size_t count)
+{
+    off_t off = static_cast<off_t>(*offset);
+    ssize_t n = ::sendfile(sockfd, fileFd, &off, count);
+    *offset = off;
+    return n;
+}
+
+ssize_t SocketsOps::sendmsg(SOCKET sockfd, const struct msghdr* msg, int flags)
+{
+    return ::sendmsg(sockfd, msg, flags);
+}
+
+ssize_t SocketsOps::recvmsg(SOCKET sockfd, struct msghdr* msg, int flags)
+{
+    return ::recvmsg(sockfd, msg, flags);
+}
+#endif
+
 void SocketsOps::close(SOCKET sockfd)
 {
 #ifdef WIN32   
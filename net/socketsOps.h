@@ -35,6 +35,12 @@ public:
 	static ssize_t readv(SOCKET sockfd, const struct iovec* iov, int iovcnt);
 #endif
 	static int32_t write(SOCKET sockfd, const void* buf, int32_t count);
+#ifndef WIN32
+	static ssize_t writev(SOCKET sockfd, const struct iovec* iov, int iovcnt);
+	static ssize_t sendfile(SOCKET sockfd, int fileFd, int64_t* offset, size_t count);
+	static ssize_t sendmsg(SOCKET sockfd, const struct msghdr* msg, int flags);
+	static ssize_t recvmsg(SOCKET sockfd, struct msghdr* msg, int flags);
+#endif
 
 	static void close(SOCKET sockfd);
 
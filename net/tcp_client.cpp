@@ -35,18 +35,20 @@ TcpClient::TcpClient(EventLoop* loop,
     name_(nameArg),
     connectionCallback_(defaultConnectionCallback),
     messageCallback_(defaultMessageCallback),
+    backPressureHigh_(0),
+    backPressureLow_(0),
     retry_(false),
     connect_(true),
     nextConnId_(1)
 {
     connector_->setNewConnectionCallback(
         std::bind(&TcpClient::newConnection, this, std::placeholders::_1));
-    LOGD("TcpClient::TcpClient[%s] - connector 0x%x", name_.c_str(), connector_.get());
+    LOGD("TcpClient::TcpClient[%s] - connector %p", name_.c_str(), connector_.get());
 }
 
 TcpClient::~TcpClient()
 {
-    LOGD("TcpClient::~TcpClient[%s] - connector 0x%x", name_.c_str(), connector_.get());
+    LOGD("TcpClient::~TcpClient[%s] - connector %p", name_.c_str(), connector_.get());
     TcpConnectionPtr conn;
     bool unique = false;
     {
@@ -123,6 +125,7 @@ void TcpClient::newConnection(int sockfd)
     conn->setConnectionCallback(connectionCallback_);
     conn->setMessageCallback(messageCallback_);
     conn->setWriteCompleteCallback(writeCompleteCallback_);
+    conn->setBackPressure(backPressureHigh_, backPressureLow_);
     conn->setCloseCallback(std::bind(&TcpClient::removeConnection, this, std::placeholders::_1)); // FIXME: unsafe
     
     {
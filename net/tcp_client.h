@@ -59,6 +59,14 @@ public:
         writeCompleteCallback_ = cb;
     }
 
+    /// Back-pressure thresholds of the connection,
+    /// see TcpConnection::setBackPressure(). 0 turns it off (the default).
+    /// Not thread safe.
+    void setBackPressure(size_t highWaterMark, size_t lowWaterMark)
+    {
+        backPressureHigh_ = highWaterMark; backPressureLow_ = lowWaterMark;
+    }
+
     void sendMessage(const std::string& msg);
 
 private:
@@ -74,6 +82,8 @@ private:
     ConnectionCallback      connectionCallback_;
     MessageCallback         messageCallback_;
     WriteCompleteCallback   writeCompleteCallback_;
+    size_t                  backPressureHigh_;
+    size_t                  backPressureLow_;
     bool                    retry_;   // atomic
     bool                    connect_; // atomic
     // always in loop thread
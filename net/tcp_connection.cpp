@@ -7,12 +7,23 @@
 #include "socket.h"
 #include "socketsOps.h"
 
+#include <atomic>
 
 BEGIN_NS(net)
 
+// an empty input buffer larger than this is shrunk towards the read size guess
+static const size_t kInputShrinkCapacity = 256 * 1024;
+// output age samples kept per connection, older ones are merged
+static const size_t kMaxOutputSamples = 64;
+
+static std::atomic<int64_t> g_slowEvents(0);
+static std::atomic<int64_t> g_droppedMessages(0);
+static std::atomic<int64_t> g_droppedBytes(0);
+static std::atomic<int64_t> g_evictions(0);
+
 void defaultConnectionCallback(const TcpConnectionPtr& conn)
 {
-    LOGD("%s -> is %s",
+    LOGD("%s -> %s is %s",
         conn->localAddress().toIpPort().c_str(),
         conn->peerAddress().toIpPort().c_str(),
         (conn->connected() ? "UP" : "DOWN"));
@@ -24,8 +35,8 @@ void defaultMessageCallback(const TcpConnectionPtr&,
                                         Timestamp)
 {
     //buf->retrieveAll();
-    std::string msg = buf->toStringPiece();
-    printf("receive message: %s\n", msg.c_str());
+    std::string_view msg = buf->toStringView();
+    printf("receive message: %.*s\n", static_cast<int>(msg.size()), msg.data());
 }
 
 TcpConnection::TcpConnection(EventLoop* loop,
@@ -41,20 +52,45 @@ TcpConnection::TcpConnection(EventLoop* loop,
     channel_(new Channel(loop, sockfd)),
     localAddr_(localAddr),
     peerAddr_(peerAddr),
-    highWaterMark_(64 * 1024 * 1024)
+    highWaterMark_(64 * 1024 * 1024),
+    backPressureHigh_(0),
+    backPressureLow_(0),
+    readPausedByBackPressure_(false),
+    readPausedByPeer_(0),
+    readPauses_(0),
+    readResumes_(0),
+    readThrottled_(false),
+    writeThrottled_(false),
+    readThrottles_(0),
+    writeThrottles_(0),
+    writableArmed_(false),
+    autoCork_(false),
+    corkFlushQueued_(false),
+    corkThreshold_(kDefaultCorkThreshold),
+    coalesceWindow_(0),
+    coalesceBytes_(0),
+    coalescePending_(false),
+    coalescedReads_(0),
+    coalescedDeliveries_(0),
+    slowConsumerCheckQueued_(false),
+    slowConsumer_(false),
+    outputAge_(0),
+    slowEvents_(0),
+    droppedMessages_(0),
+    droppedBytes_(0)
 {
     channel_->setReadCallback(std::bind(&TcpConnection::handleRead, this, std::placeholders::_1));
     channel_->setWriteCallback(std::bind(&TcpConnection::handleWrite, this));
     channel_->setCloseCallback(std::bind(&TcpConnection::handleClose, this));
     channel_->setErrorCallback(std::bind(&TcpConnection::handleError, this));
-    LOGD("TcpConnection::ctor[%s] at 0x%x fd=%d", name_.c_str(), this, sockfd);
+    LOGD("TcpConnection::ctor[%s] at %p fd=%d", name_.c_str(), this, sockfd);
     socket_->setKeepAlive(true);
 }
 
 TcpConnection::~TcpConnection()
 {
   
-    LOGD("TcpConnection::dtor[%s] at 0x%x fd=%d state=%s",
+    LOGD("TcpConnection::dtor[%s] at %p fd=%d state=%s",
         name_.c_str(), this, channel_->fd(), stateToString());
     assert(state_ == kDisconnected);
 }
@@ -82,11 +118,9 @@ void TcpConnection::send(const void* data, int len)
         }
         else
         {
-            std::string message(static_cast<const char*>(data), len);
-            loop_->runInLoop(
-                std::bind(static_cast<void (TcpConnection::*)(const std::string&)>(&TcpConnection::sendInLoop),
-                    this,     // FIXME
-                    message));
+            SendQueue::Node* node = new SendQueue::Node;
+            node->message.assign(static_cast<const char*>(data), len);
+            queueSend(node);
         }
     }
 }
@@ -101,16 +135,13 @@ void TcpConnection::send(const std::string& message)
         }
         else
         {
-            loop_->runInLoop(
-                std::bind(static_cast<void (TcpConnection::*)(const std::string&)>(&TcpConnection::sendInLoop),
-                    this,     // FIXME
-                    message));
-            //std::forward<string>(message)));
+            SendQueue::Node* node = new SendQueue::Node;
+            node->message = message;
+            queueSend(node);
         }
     }
 }
 
-// FIXME efficiency!!!
 void TcpConnection::send(Buffer* buf)
 {
     if (state_ == kConnected)
@@ -122,75 +153,774 @@ void TcpConnection::send(Buffer* buf)
         }
         else
         {
-            loop_->runInLoop(
-                std::bind(static_cast<void (TcpConnection::*)(const std::string&)>(&TcpConnection::sendInLoop),
-                    this,     // FIXME
-                    buf->retrieveAllAsString()));
-            //std::forward<string>(message)));
+            send(std::move(*buf));
         }
     }
 }
 
+void TcpConnection::send(std::string&& message)
+{
+    if (message.size() < kMinAdoptSize)
+        send(message.data(), static_cast<int>(message.size()));
+    else
+        send(BufferSlice::adopt(std::move(message)));
+}
+
+void TcpConnection::send(std::vector<char>&& message)
+{
+    if (message.size() < kMinAdoptSize)
+        send(message.data(), static_cast<int>(message.size()));
+    else
+        send(BufferSlice::adopt(std::move(message)));
+}
+
+void TcpConnection::send(Buffer&& buf)
+{
+    if (buf.readableBytes() < kMinAdoptSize)
+    {
+        send(buf.peek(), static_cast<int>(buf.readableBytes()));
+        buf.retrieveAll();
+    }
+    else
+    {
+        send(BufferSlice::adopt(std::move(buf)));
+    }
+}
+
 void TcpConnection::sendInLoop(const std::string& message)
 {
     sendInLoop(message.data(), message.size());
 }
 
-void TcpConnection::sendInLoop(const void* data, size_t len)
+void TcpConnection::send(const void* data, int len, OutputChain::Priority priority)
+{
+    if (state_ == kConnected)
+    {
+        if (loop_->isInLoopThread())
+        {
+            sendInLoop(data, len, priority);
+        }
+        else
+        {
+            SendQueue::Node* node = new SendQueue::Node;
+            node->message.assign(static_cast<const char*>(data), len);
+            node->priority = priority;
+            queueSend(node);
+        }
+    }
+}
+
+void TcpConnection::send(const std::string& message, OutputChain::Priority priority)
+{
+    send(message.data(), static_cast<int>(message.size()), priority);
+}
+
+void TcpConnection::send(const BufferSlice& slice, OutputChain::Priority priority)
+{
+    if (state_ == kConnected)
+    {
+        if (loop_->isInLoopThread())
+        {
+            sendSliceInLoop(slice, priority);
+        }
+        else
+        {
+            SendQueue::Node* node = new SendQueue::Node;
+            node->slice = slice;
+            node->priority = priority;
+            queueSend(node);
+        }
+    }
+}
+
+void TcpConnection::sendInLoop(const void* data, size_t len, OutputChain::Priority priority)
+{
+    loop_->assertInLoopThread();
+    if (autoCork_ && state_ != kDisconnected)
+    {
+        checkHighWaterMark(len);
+        outputChain_.append(data, len, priority);
+        scheduleCorkFlush();
+        return;
+    }
+
+    size_t nwrote = 0;
+    if (!writeDirectly(data, len, &nwrote))
+        return;
+
+    if (nwrote < len)
+    {
+        size_t remaining = len - nwrote;
+        queueOutput(remaining);
+        // the rest of a message started on the wire is not preempted
+        outputChain_.markWritten(nwrote, priority);
+        outputChain_.append(static_cast<const char*>(data) + nwrote, remaining, priority);
+    }
+}
+
+void TcpConnection::send(const BufferSlice& slice)
+{
+    if (state_ == kConnected)
+    {
+        if (loop_->isInLoopThread())
+        {
+            sendSliceInLoop(slice);
+        }
+        else
+        {
+            SendQueue::Node* node = new SendQueue::Node;
+            node->slice = slice;
+            queueSend(node);
+        }
+    }
+}
+
+void TcpConnection::sendSliceInLoop(const BufferSlice& slice, OutputChain::Priority priority)
+{
+    loop_->assertInLoopThread();
+    if (autoCork_ && state_ != kDisconnected)
+    {
+        checkHighWaterMark(slice.size());
+        outputChain_.append(slice, priority);
+        scheduleCorkFlush();
+        return;
+    }
+
+    size_t nwrote = 0;
+    size_t zeroCopyThreshold = outputChain_.zeroCopyThreshold();
+    if (zeroCopyThreshold > 0 && slice.size() >= zeroCopyThreshold)
+    {
+        // leave large slices to handleWrite(), which sends them with MSG_ZEROCOPY
+        if (state_ == kDisconnected)
+        {
+            LOGW_EVERY_N(100, "disconnected, give up writing");
+            return;
+        }
+    }
+    else if (!writeDirectly(slice.data(), slice.size(), &nwrote))
+    {
+        return;
+    }
+
+    if (nwrote < slice.size())
+    {
+        queueOutput(slice.size() - nwrote);
+        // keep a reference to the unsent tail, the payload is not copied
+        outputChain_.markWritten(nwrote, priority);
+        outputChain_.append(slice.slice(nwrote), priority);
+    }
+}
+
+bool TcpConnection::sendFile(int fd, int64_t offset, size_t length)
+{
+    if (state_ != kConnected)
+        return false;
+
+#ifdef WIN32
+    int fileFd = ::_dup(fd);
+#else
+    int fileFd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+#endif
+    if (fileFd < 0)
+    {
+        LOGSYSE("TcpConnection::sendFile - dup fd=%d", fd);
+        return false;
+    }
+
+    FileRegionPtr region(new FileRegion(fileFd, offset, length));
+    if (loop_->isInLoopThread())
+    {
+        sendFileInLoop(region);
+    }
+    else
+    {
+        // through the send queue, so it keeps its place among queued messages
+        SendQueue::Node* node = new SendQueue::Node;
+        node->file = region;
+        queueSend(node);
+    }
+    return true;
+}
+
+void TcpConnection::sendFileInLoop(const FileRegionPtr& region)
 {
     loop_->assertInLoopThread();
-    int32_t nwrote = 0;
-    size_t remaining = len;
-    bool faultError = false;
     if (state_ == kDisconnected)
     {
-        LOGW("disconnected, give up writing");
+        LOGW_EVERY_N(100, "disconnected, give up sending file");
         return;
     }
+    if (region->length() == 0)
+        return;
+
+    // the region goes behind whatever is queued, handleWrite() sends it
+    // with sendfile(2) as soon as the socket is writable
+    queueOutput(0);
+    outputChain_.append(region);
+}
+
+void TcpConnection::queueSend(SendQueue::Node* node)
+{
+    // only the push that finds the queue empty asks the loop to drain it,
+    // later pushes join that batch
+    if (sendQueue_.push(node))
+    {
+        loop_->queueInLoop(std::bind(&TcpConnection::drainSendQueue, shared_from_this()));
+    }
+}
+
+void TcpConnection::drainSendQueue()
+{
+    loop_->assertInLoopThread();
+    SendQueue::Node* node = sendQueue_.popAll();
+    if (node != nullptr && state_ == kDisconnected)
+    {
+        LOGW_EVERY_N(100, "disconnected, give up writing");
+    }
+
+    while (node != nullptr)
+    {
+        std::unique_ptr<SendQueue::Node> owned(node);
+        node = node->next;
+        if (state_ == kDisconnected)
+            continue;
+
+        if (owned->file)
+        {
+            outputChain_.append(owned->file);
+        }
+        else if (!owned->slice.empty())
+        {
+            checkHighWaterMark(owned->slice.size());
+            outputChain_.append(owned->slice, owned->priority);
+        }
+        else
+        {
+            checkHighWaterMark(owned->message.size());
+            // the node owns the copy made by send(), hand it over as is
+            if (owned->message.size() >= kMinAdoptSize)
+                outputChain_.append(BufferSlice::adopt(std::move(owned->message)), owned->priority);
+            else
+                outputChain_.append(owned->message.data(), owned->message.size(), owned->priority);
+        }
+    }
+
+    // the whole batch goes out together
+    if (autoCork_)
+        scheduleCorkFlush();
+    else
+        writeQueued();
+}
+
+bool TcpConnection::writeDirectly(const void* data, size_t len, size_t* nwrote)
+{
+    *nwrote = 0;
+    if (state_ == kDisconnected)
+    {
+        LOGW_EVERY_N(100, "disconnected, give up writing");
+        return false;
+    }
+    disarmWritable();
     // if no thing in output queue, try writing directly
-    if (!channel_->isWriting() && outputBuffer_.readableBytes() == 0)
+    if (!channel_->isWriting() && !writeThrottled_ && outputChain_.empty())
     {
-        nwrote = SocketsOps::write(channel_->fd(), data, len);
-        if (nwrote >= 0)
+        int32_t n = SocketsOps::write(channel_->fd(), data, static_cast<int32_t>(std::min(len, writeQuota())));
+        if (n >= 0)
         {
-            remaining = len - nwrote;
-            if (remaining == 0 && writeCompleteCallback_)
+            *nwrote = static_cast<size_t>(n);
+            chargeWrite(*nwrote);
+            if (*nwrote == len && writeCompleteCallback_)
             {
                 loop_->queueInLoop(std::bind(writeCompleteCallback_, shared_from_this()));
             }
+            if (*nwrote == len)
+            {
+                armWritable();
+            }
         }
-        else // nwrote < 0
+        else // n < 0
         {
-            nwrote = 0;
             if (errno != EWOULDBLOCK)
             {
-                LOGSYSE("TcpConnection::sendInLoop");
+                LOGSYSE_LIMITED(10, 20, "TcpConnection::sendInLoop");
                 if (errno == EPIPE || errno == ECONNRESET) // FIXME: any others?
                 {
-                    faultError = true;
+                    return false;
                 }
             }
         }
     }
 
-    //assert(remaining <= len);
-    if (remaining > len)
+    return true;
+}
+
+void TcpConnection::queueOutput(size_t len)
+{
+    checkHighWaterMark(len);
+    // from now on writing is for the queued bytes
+    writableArmed_ = false;
+    if (!channel_->isWriting() && !writeThrottled_)
+    {
+        channel_->enableWriting();
+    }
+}
+
+bool TcpConnection::armWritable()
+{
+    if (!writableCallback_ || state_ != kConnected || writeThrottled_ || !outputChain_.empty())
+        return false;
+
+    writableArmed_ = true;
+    if (!channel_->isWriting())
+        channel_->enableWriting();
+    return true;
+}
+
+void TcpConnection::disarmWritable()
+{
+    if (!writableArmed_)
         return;
 
-    if (!faultError && remaining > 0)
+    writableArmed_ = false;
+    if (outputChain_.empty() && channel_->isWriting())
+        channel_->disableWriting();
+}
+
+void TcpConnection::checkHighWaterMark(size_t len)
+{
+    size_t oldLen = outputChain_.bufferedBytes();
+    if (oldLen + len >= highWaterMark_
+        && oldLen < highWaterMark_
+        && highWaterMarkCallback_)
     {
-        size_t oldLen = outputBuffer_.readableBytes();
-        if (oldLen + remaining >= highWaterMark_
-            && oldLen < highWaterMark_
-            && highWaterMarkCallback_)
+        loop_->queueInLoop(std::bind(highWaterMarkCallback_, shared_from_this(), oldLen + len));
+    }
+    if (backPressureHigh_ > 0
+        && oldLen + len > backPressureHigh_
+        && !readPausedByBackPressure_)
+    {
+        pauseReadingForBackPressure();
+    }
+    if (watchesSlowConsumer() && !slowConsumerCheckQueued_)
+    {
+        scheduleSlowConsumerCheck();
+    }
+}
+
+void TcpConnection::checkLowWaterMark()
+{
+    if (readPausedByBackPressure_ && outputChain_.bufferedBytes() <= backPressureLow_)
+    {
+        resumeReadingForBackPressure();
+    }
+}
+
+void TcpConnection::pauseReadingForBackPressure()
+{
+    TcpConnectionPtr target = backPressurePeer_.lock();
+    if (!target)
+        target = shared_from_this();
+
+    LOGD("TcpConnection::pauseReadingForBackPressure [%s] - %zu bytes queued, stop reading [%s]",
+        name_.c_str(), outputChain_.bufferedBytes(), target->name().c_str());
+    readPausedByBackPressure_ = true;
+    backPressurePaused_ = target;
+    ++readPauses_;
+    // the peer may live in another loop
+    target->loop_->runInLoop(std::bind(&TcpConnection::holdReadingInLoop, target));
+}
+
+void TcpConnection::resumeReadingForBackPressure()
+{
+    readPausedByBackPressure_ = false;
+    ++readResumes_;
+    TcpConnectionPtr target = backPressurePaused_.lock();
+    backPressurePaused_.reset();
+    if (target)
+    {
+        LOGD("TcpConnection::resumeReadingForBackPressure [%s] - start reading [%s]",
+            name_.c_str(), target->name().c_str());
+        target->loop_->runInLoop(std::bind(&TcpConnection::releaseReadingInLoop, target));
+    }
+}
+
+void TcpConnection::holdReadingInLoop()
+{
+    loop_->assertInLoopThread();
+    ++readPausedByPeer_;
+    updateReading();
+}
+
+void TcpConnection::releaseReadingInLoop()
+{
+    loop_->assertInLoopThread();
+    if (readPausedByPeer_ > 0)
+        --readPausedByPeer_;
+    updateReading();
+}
+
+void TcpConnection::updateReading()
+{
+    // the application, a read rate limit and back-pressure each hold reading off on their own
+    bool wanted = reading_ && !readThrottled_ && readPausedByPeer_ == 0 && state_ != kDisconnected;
+    if (wanted && !channel_->isReading())
+        channel_->enableReading();
+    else if (!wanted && channel_->isReading())
+        channel_->disableReading();
+}
+
+void TcpConnection::setBackPressurePeer(const TcpConnectionPtr& peer)
+{
+    loop_->assertInLoopThread();
+    backPressurePeer_ = peer;
+}
+
+int64_t TcpConnection::chargeLimits(const std::vector<TokenBucketPtr>& limits, size_t bytes)
+{
+    int64_t delay = 0;
+    for (const TokenBucketPtr& bucket : limits)
+    {
+        bucket->consume(bytes);
+        delay = std::max(delay, bucket->delay());
+    }
+    return delay;
+}
+
+void TcpConnection::chargeRead(size_t bytes)
+{
+    if (readLimits_.empty())
+        return;
+
+    int64_t delay = chargeLimits(readLimits_, bytes);
+    if (delay == 0 || readThrottled_)
+        return;
+
+    readThrottled_ = true;
+    ++readThrottles_;
+    updateReading();
+
+    scheduleUnthrottle(delay, &TcpConnection::unthrottleReading);
+}
+
+void TcpConnection::scheduleUnthrottle(int64_t delay, void (TcpConnection::*handler)())
+{
+    // the timer must not keep a closed connection alive
+    std::weak_ptr<TcpConnection> weakThis(shared_from_this());
+    loop_->runAfter(delay, [weakThis, handler]()
+    {
+        TcpConnectionPtr conn = weakThis.lock();
+        if (conn)
+            ((*conn).*handler)();
+    });
+}
+
+void TcpConnection::clearReadLimits()
+{
+    loop_->assertInLoopThread();
+    readLimits_.clear();
+    unthrottleReading();
+}
+
+void TcpConnection::unthrottleReading()
+{
+    // also the timer of a throttle that clearReadLimits() lifted early
+    if (state_ == kDisconnected || !readThrottled_)
+        return;
+
+    // a shared bucket may have been drained again by other connections
+    int64_t delay = chargeLimits(readLimits_, 0);
+    if (delay > 0)
+    {
+        scheduleUnthrottle(delay, &TcpConnection::unthrottleReading);
+        return;
+    }
+
+    readThrottled_ = false;
+    updateReading();
+}
+
+void TcpConnection::chargeWrite(size_t bytes)
+{
+    if (writeLimits_.empty())
+        return;
+
+    int64_t delay = chargeLimits(writeLimits_, bytes);
+    if (delay == 0 || writeThrottled_)
+        return;
+
+    writeThrottled_ = true;
+    writableArmed_ = false;
+    ++writeThrottles_;
+    if (channel_->isWriting())
+        channel_->disableWriting();
+
+    scheduleUnthrottle(delay, &TcpConnection::unthrottleWriting);
+}
+
+void TcpConnection::clearWriteLimits()
+{
+    loop_->assertInLoopThread();
+    writeLimits_.clear();
+    unthrottleWriting();
+}
+
+size_t TcpConnection::writeQuota() const
+{
+    // one write takes at most a burst, so the debt a write limit runs
+    // into stays under one burst instead of the whole output queued
+    size_t quota = SIZE_MAX;
+    for (const TokenBucketPtr& bucket : writeLimits_)
+        quota = std::min(quota, static_cast<size_t>(std::max<int64_t>(bucket->burst(), 1)));
+    return quota;
+}
+
+void TcpConnection::unthrottleWriting()
+{
+    if (state_ == kDisconnected || !writeThrottled_)
+        return;
+
+    int64_t delay = chargeLimits(writeLimits_, 0);
+    if (delay > 0)
+    {
+        scheduleUnthrottle(delay, &TcpConnection::unthrottleWriting);
+        return;
+    }
+
+    writeThrottled_ = false;
+    if (!outputChain_.empty())
+    {
+        channel_->enableWriting();
+    }
+    else if (state_ == kDisconnecting)
+    {
+        shutdownInLoop();
+    }
+    else
+    {
+        armWritable();
+    }
+}
+
+TcpConnectionStats TcpConnection::stats() const
+{
+    TcpConnectionStats s;
+    s.outputBytes = outputChain_.bufferedBytes();
+    s.highWaterMark = backPressureHigh_;
+    s.lowWaterMark = backPressureLow_;
+    s.readPaused = readPausedByBackPressure_;
+    s.readPauses = readPauses_;
+    s.readResumes = readResumes_;
+    s.readThrottles = readThrottles_;
+    s.writeThrottles = writeThrottles_;
+    s.coalescedReads = coalescedReads_;
+    s.coalescedDeliveries = coalescedDeliveries_;
+    s.slowConsumer = slowConsumer_;
+    s.outputAge = outputAge_;
+    s.slowEvents = slowEvents_;
+    s.droppedMessages = droppedMessages_;
+    s.droppedBytes = droppedBytes_;
+    s.zeroCopyPending = outputChain_.zeroCopyPending();
+    s.zeroCopyCopied = outputChain_.zeroCopyCopied();
+    s.zeroCopyPaused = outputChain_.zeroCopyPaused();
+    return s;
+}
+
+SlowConsumerCounters TcpConnection::slowConsumerCounters()
+{
+    SlowConsumerCounters c;
+    c.slowEvents = g_slowEvents.load(std::memory_order_relaxed);
+    c.droppedMessages = g_droppedMessages.load(std::memory_order_relaxed);
+    c.droppedBytes = g_droppedBytes.load(std::memory_order_relaxed);
+    c.evictions = g_evictions.load(std::memory_order_relaxed);
+    return c;
+}
+
+void TcpConnection::setSlowConsumerPolicy(const SlowConsumerPolicy& policy, const SlowConsumerCallback& cb)
+{
+    assert(policy.checkInterval > 0);
+    slowConsumerPolicy_ = policy;
+    slowConsumerCallback_ = cb;
+    if (state_ == kConnected && watchesSlowConsumer() && !slowConsumerCheckQueued_ && !outputChain_.empty())
+    {
+        loop_->assertInLoopThread();
+        scheduleSlowConsumerCheck();
+    }
+}
+
+void TcpConnection::scheduleSlowConsumerCheck()
+{
+    slowConsumerCheckQueued_ = true;
+    std::weak_ptr<TcpConnection> weakThis(shared_from_this());
+    loop_->runAfter(slowConsumerPolicy_.checkInterval, [weakThis]()
+    {
+        TcpConnectionPtr conn = weakThis.lock();
+        if (conn)
+            conn->checkSlowConsumer();
+    });
+}
+
+bool TcpConnection::isSlowConsumer(Timestamp now)
+{
+    uint64_t removed = outputChain_.removedBytes();
+    while (!outputSamples_.empty() && outputSamples_.front().second <= removed)
+    {
+        outputSamples_.pop_front();
+    }
+    outputAge_ = outputSamples_.empty() ? 0
+        : now.microSecondsSinceEpoch() - outputSamples_.front().first.microSecondsSinceEpoch();
+
+    uint64_t appended = outputChain_.appendedBytes();
+    if (appended > removed && (outputSamples_.empty() || outputSamples_.back().second != appended))
+    {
+        // a full history gets coarser at its end, its front still tells the age
+        if (outputSamples_.size() >= kMaxOutputSamples)
+            outputSamples_.back() = std::make_pair(now, appended);
+        else
+            outputSamples_.push_back(std::make_pair(now, appended));
+    }
+
+    const SlowConsumerPolicy& policy = slowConsumerPolicy_;
+    return (policy.maxOutputBytes > 0 && outputChain_.readableBytes() > policy.maxOutputBytes)
+        || (policy.maxOutputAge > 0 && outputAge_ > policy.maxOutputAge);
+}
+
+void TcpConnection::checkSlowConsumer()
+{
+    slowConsumerCheckQueued_ = false;
+    if (state_ == kDisconnected || !watchesSlowConsumer())
+    {
+        outputSamples_.clear();
+        return;
+    }
+
+    const SlowConsumerPolicy& policy = slowConsumerPolicy_;
+    Timestamp now = Timestamp::now();
+    bool slow = isSlowConsumer(now);
+    if (slow && policy.dropDroppable)
+    {
+        // down to the size limit, or all of them if the queue is too old
+        size_t queued = outputChain_.readableBytes();
+        size_t excess = queued;
+        if (policy.maxOutputBytes > 0 && queued > policy.maxOutputBytes
+            && !(policy.maxOutputAge > 0 && outputAge_ > policy.maxOutputAge))
         {
-            loop_->queueInLoop(std::bind(highWaterMarkCallback_, shared_from_this(), oldLen + remaining));
+            excess = queued - policy.maxOutputBytes;
         }
-        outputBuffer_.append(static_cast<const char*>(data) + nwrote, remaining);
-        if (!channel_->isWriting())
+
+        size_t messages = 0;
+        size_t dropped = outputChain_.dropMessages(excess, &messages);
+        if (dropped > 0)
+        {
+            droppedMessages_ += messages;
+            droppedBytes_ += dropped;
+            g_droppedMessages.fetch_add(static_cast<int64_t>(messages), std::memory_order_relaxed);
+            g_droppedBytes.fetch_add(static_cast<int64_t>(dropped), std::memory_order_relaxed);
+            checkLowWaterMark();
+            if (outputChain_.empty())
+            {
+                if (state_ == kDisconnecting)
+                    shutdownInLoop();
+                else
+                    armWritable();
+            }
+            slow = isSlowConsumer(now);
+        }
+    }
+
+    if (slow != slowConsumer_)
+    {
+        slowConsumer_ = slow;
+        if (slow)
+        {
+            slowSince_ = now;
+            ++slowEvents_;
+            g_slowEvents.fetch_add(1, std::memory_order_relaxed);
+            LOGW("TcpConnection::checkSlowConsumer [%s] - slow consumer, %zu bytes queued for %lld us",
+                name_.c_str(), outputChain_.readableBytes(), (long long)outputAge_);
+        }
+        if (slowConsumerCallback_)
+            slowConsumerCallback_(shared_from_this(), slow);
+    }
+
+    if (slowConsumer_ && policy.evictAfter > 0
+        && now.microSecondsSinceEpoch() - slowSince_.microSecondsSinceEpoch() >= policy.evictAfter)
+    {
+        LOGW("TcpConnection::checkSlowConsumer [%s] - slow consumer for %lld us, evicted",
+            name_.c_str(), (long long)(now.microSecondsSinceEpoch() - slowSince_.microSecondsSinceEpoch()));
+        g_evictions.fetch_add(1, std::memory_order_relaxed);
+        outputSamples_.clear();
+        forceClose();
+        return;
+    }
+
+    if (slowConsumer_ || !outputChain_.empty())
+        scheduleSlowConsumerCheck();
+    else
+        outputSamples_.clear();
+}
+
+void TcpConnection::scheduleCorkFlush()
+{
+    disarmWritable();
+    // handleWrite() is draining the chain already, corked bytes go with it
+    if (channel_->isWriting())
+        return;
+
+    if (outputChain_.readableBytes() >= corkThreshold_)
+    {
+        flushCorked();
+    }
+    else if (!corkFlushQueued_)
+    {
+        corkFlushQueued_ = true;
+        loop_->queueAtIterationEnd(std::bind(&TcpConnection::flushCorked, shared_from_this()));
+    }
+}
+
+void TcpConnection::flushCorked()
+{
+    loop_->assertInLoopThread();
+    corkFlushQueued_ = false;
+    writeQueued();
+    if (state_ == kDisconnecting && outputChain_.empty())
+    {
+        shutdownInLoop();
+    }
+}
+
+void TcpConnection::writeQueued()
+{
+    disarmWritable();
+    if (state_ == kDisconnected || channel_->isWriting() || writeThrottled_ || outputChain_.empty())
+        return;
+
+    int savedErrno = 0;
+    int32_t n = outputChain_.writeFd(channel_->fd(), &savedErrno, writeQuota());
+    if (n > 0)
+    {
+        chargeWrite(static_cast<size_t>(n));
+    }
+    else if (n < 0 && savedErrno != EWOULDBLOCK)
+    {
+        errno = savedErrno;
+        LOGSYSE_LIMITED(10, 20, "TcpConnection::writeQueued");
+        if (savedErrno == EPIPE || savedErrno == ECONNRESET)
+            return;
+    }
+
+    checkLowWaterMark();
+    if (outputChain_.empty())
+    {
+        if (writeCompleteCallback_)
         {
-            channel_->enableWriting();
+            loop_->queueInLoop(std::bind(writeCompleteCallback_, shared_from_this()));
         }
+        armWritable();
+    }
+    else if (!writeThrottled_)
+    {
+        // one writev(2) takes at most kMaxIovecs chunks, handleWrite() does the rest
+        channel_->enableWriting();
     }
 }
 
@@ -200,15 +930,17 @@ void TcpConnection::shutdown()
     if (state_ == kConnected)
     {
         setState(kDisconnecting);
-        // FIXME: shared_from_this()?
-        loop_->runInLoop(std::bind(&TcpConnection::shutdownInLoop, this));
+        loop_->runInLoop(std::bind(&TcpConnection::shutdownInLoop, shared_from_this()));
     }
 }
 
 void TcpConnection::shutdownInLoop()
 {
     loop_->assertInLoopThread();
-    if (!channel_->isWriting())
+    // corked bytes go out before the FIN, writeQueued() also disarms
+    // writableCallback_
+    writeQueued();
+    if (!channel_->isWriting() && !writeThrottled_)
     {
         // we are not writing
         socket_->shutdownWrite();
@@ -288,39 +1020,105 @@ const char* TcpConnection::stateToString() const
     }
 }
 
+void TcpConnection::setFrameCallback(const FrameCallback& cb, Framing framing, size_t maxFrameSize)
+{
+    messageCallback_ = std::bind(&TcpConnection::handleFrames, cb, framing, maxFrameSize,
+        std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+}
+
+void TcpConnection::handleFrames(const FrameCallback& cb, Framing framing, size_t maxFrameSize,
+                                 const TcpConnectionPtr& conn, Buffer* buf, Timestamp receiveTime)
+{
+    std::string_view frame;
+    while (!conn->disconnected())
+    {
+        bool complete = framing == kFrameLines ? buf->retrieveLineView(&frame) : buf->retrieveFrameView(&frame);
+        if (!complete)
+            break;
+        // retrieved but not overwritten, nothing writes to buf during the callback
+        cb(conn, frame, receiveTime);
+    }
+
+    size_t pending = buf->readableBytes();
+    if (framing == kFrameLength32 && pending >= sizeof(int32_t))
+    {
+        // the prefix tells the size before the frame arrives
+        pending = static_cast<uint32_t>(buf->peekInt32());
+    }
+    if (pending > maxFrameSize)
+    {
+        LOGE("TcpConnection::handleFrames [%s] - frame of %zu bytes exceeds %zu, closing",
+            conn->name().c_str(), pending, maxFrameSize);
+        buf->retrieveAll();
+        conn->forceClose();
+    }
+}
+
 void TcpConnection::setTcpNoDelay(bool on)
 {
     socket_->setTcpNoDelay(on);
 }
 
-void TcpConnection::startRead()
+bool TcpConnection::setNotSentLowat(size_t bytes)
+{
+    loop_->assertInLoopThread();
+    if (!socket_->setNotSentLowat(bytes))
+    {
+        LOGW("TcpConnection::setNotSentLowat [%s] - TCP_NOTSENT_LOWAT not available", name_.c_str());
+        return false;
+    }
+    return true;
+}
+
+void TcpConnection::setAutoCork(bool on, size_t threshold)
 {
-    loop_->runInLoop(std::bind(&TcpConnection::startReadInLoop, this));
+    loop_->assertInLoopThread();
+    corkThreshold_ = threshold;
+    autoCork_ = on;
+    if (!on)
+    {
+        flushCorked();
+    }
 }
 
-void TcpConnection::startReadInLoop()
+bool TcpConnection::enableZeroCopy(size_t threshold)
 {
     loop_->assertInLoopThread();
-    if (!reading_ || !channel_->isReading())
+    if (threshold == 0 || !socket_->setZeroCopy(true))
     {
-        channel_->enableReading();
-        reading_ = true;
+        LOGW("TcpConnection::enableZeroCopy [%s] - SO_ZEROCOPY not available", name_.c_str());
+        return false;
     }
+
+    outputChain_.setZeroCopyThreshold(threshold);
+    return true;
+}
+
+void TcpConnection::startRead()
+{
+    loop_->runInLoop(std::bind(&TcpConnection::startReadInLoop, shared_from_this()));
+}
+
+void TcpConnection::startReadInLoop()
+{
+    loop_->assertInLoopThread();
+    if (state_ == kDisconnected)
+        return;
+    // a read rate limit or back-pressure resumes it when they let go
+    reading_ = true;
+    updateReading();
 }
 
 void TcpConnection::stopRead()
 {
-    loop_->runInLoop(std::bind(&TcpConnection::stopReadInLoop, this));
+    loop_->runInLoop(std::bind(&TcpConnection::stopReadInLoop, shared_from_this()));
 }
 
 void TcpConnection::stopReadInLoop()
 {
     loop_->assertInLoopThread();
-    if (reading_ || channel_->isReading())
-    {
-        channel_->disableReading();
-        reading_ = false;
-    }
+    reading_ = false;
+    updateReading();
 }
 
 void TcpConnection::connectEstablished()
@@ -351,36 +1149,127 @@ void TcpConnection::handleRead(Timestamp receiveTime)
 {
     loop_->assertInLoopThread();
     int savedErrno = 0;
-    int32_t n = inputBuffer_.readFd(channel_->fd(), &savedErrno);
+    // reserve what recent reads suggest, the loop's shared scratch buffer
+    // only takes what does not fit
+    inputBuffer_.ensureWritableBytes(receiveSizer_.guess());
+    int32_t n = inputBuffer_.readFd(channel_->fd(), &savedErrno, loop_->receiveScratch(), loop_->receiveScratchSize());
     if (n > 0)
     {
-        //messageCallback_ָCTcpSession::OnRead(const std::shared_ptr<TcpConnection>& conn, Buffer* pBuffer, Timestamp receiveTime)
-        messageCallback_(shared_from_this(), &inputBuffer_, receiveTime);
+        receiveSizer_.record(static_cast<size_t>(n));
+        chargeRead(static_cast<size_t>(n));
+        if (coalesceWindow_ > 0 && inputBuffer_.readableBytes() < coalesceBytes_)
+        {
+            ++coalescedReads_;
+            if (!coalescePending_)
+            {
+                coalescePending_ = true;
+                coalesceReceiveTime_ = receiveTime;
+                std::weak_ptr<TcpConnection> weakThis(shared_from_this());
+                coalesceTimer_ = loop_->runAfter(coalesceWindow_, [weakThis]()
+                {
+                    TcpConnectionPtr conn = weakThis.lock();
+                    if (conn)
+                        conn->flushCoalesced();
+                });
+            }
+            return;
+        }
+
+        if (coalescePending_)
+        {
+            // enough bytes arrived before the window closed
+            loop_->cancel(coalesceTimer_);
+            coalescePending_ = false;
+            ++coalescedDeliveries_;
+            receiveTime = coalesceReceiveTime_;
+        }
+        deliverInput(receiveTime);
     }
     else if (n == 0)
     {
+        // hand over what the window held back before the connection goes
+        flushCoalesced();
         handleClose();
     }
     else
     {
         errno = savedErrno;
-        LOGSYSE("TcpConnection::handleRead");
+        LOGSYSE_LIMITED(10, 20, "TcpConnection::handleRead");
         handleError();
     }
 }
 
+void TcpConnection::deliverInput(Timestamp receiveTime)
+{
+    //messageCallback_ָCTcpSession::OnRead(const std::shared_ptr<TcpConnection>& conn, Buffer* pBuffer, Timestamp receiveTime)
+    messageCallback_(shared_from_this(), &inputBuffer_, receiveTime);
+
+    // give back the memory of a burst once it has been consumed
+    if (inputBuffer_.readableBytes() == 0
+        && inputBuffer_.internalCapacity() > kInputShrinkCapacity
+        && inputBuffer_.internalCapacity() > 4 * receiveSizer_.guess())
+    {
+        inputBuffer_.shrink(receiveSizer_.guess());
+    }
+}
+
+void TcpConnection::setReceiveCoalescing(int64_t windowUs, size_t maxBytes)
+{
+    loop_->assertInLoopThread();
+    coalesceWindow_ = windowUs;
+    coalesceBytes_ = maxBytes;
+    if (windowUs <= 0 && coalescePending_)
+    {
+        loop_->cancel(coalesceTimer_);
+        flushCoalesced();
+    }
+}
+
+void TcpConnection::flushCoalesced()
+{
+    if (!coalescePending_)
+        return;
+
+    coalescePending_ = false;
+    if (state_ == kDisconnected)
+        return;
+
+    ++coalescedDeliveries_;
+    deliverInput(coalesceReceiveTime_);
+}
+
 void TcpConnection::handleWrite()
 {
     loop_->assertInLoopThread();
-    if (channel_->isWriting())
+    if (channel_->isWriting() && outputChain_.empty())
     {
-        int32_t n = SocketsOps::write(channel_->fd(), outputBuffer_.peek(), outputBuffer_.readableBytes());
+        // nothing to write: armed by armWritable(), or the queued bytes were
+        // dropped, which is no reason to call writableCallback_
+        channel_->disableWriting();
+        bool armed = writableArmed_;
+        writableArmed_ = false;
+        if (armed && writableCallback_)
+        {
+            loop_->queueInLoop(std::bind(writableCallback_, shared_from_this()));
+        }
+        if (state_ == kDisconnecting)
+        {
+            shutdownInLoop();
+        }
+    }
+    else if (channel_->isWriting())
+    {
+        int savedErrno = 0;
+        int32_t n = outputChain_.writeFd(channel_->fd(), &savedErrno, writeQuota());
         if (n > 0)
         {
-            outputBuffer_.retrieve(n);
-            if (outputBuffer_.readableBytes() == 0)
+            chargeWrite(static_cast<size_t>(n));
+            checkLowWaterMark();
+            if (outputChain_.empty())
             {
-                channel_->disableWriting();
+                // stay writable for writableCallback_, if it is set
+                if (!armWritable())
+                    channel_->disableWriting();
                 if (writeCompleteCallback_)
                 {
                     loop_->queueInLoop(std::bind(writeCompleteCallback_, shared_from_this()));
@@ -393,7 +1282,8 @@ void TcpConnection::handleWrite()
         }
         else
         {
-            LOGSYSE("TcpConnection::handleWrite");
+            errno = savedErrno;
+            LOGSYSE_LIMITED(10, 20, "TcpConnection::handleWrite");
             // if (state_ == kDisconnecting)
             // {
             //   shutdownInLoop();
@@ -423,6 +1313,12 @@ void TcpConnection::handleClose()
     setState(kDisconnected);
     channel_->disableAll();
 
+    // nothing will drain the output any more, do not hold the peer
+    if (readPausedByBackPressure_ && backPressurePaused_.lock().get() != this)
+    {
+        resumeReadingForBackPressure();
+    }
+
     TcpConnectionPtr guardThis(shared_from_this());
     connectionCallback_(guardThis);
     // must be the last line
@@ -431,8 +1327,16 @@ void TcpConnection::handleClose()
 
 void TcpConnection::handleError()
 {
+    //MSG_ZEROCOPY completions are queued on the socket error queue and
+    //reported as XPOLLERR too, that is not a broken connection
+    bool zeroCopyCompleted = outputChain_.zeroCopyPending() > 0
+        && outputChain_.handleZeroCopyCompletions(channel_->fd()) > 0;
+
     int err = SocketsOps::getSocketError(channel_->fd());
-    LOGE("TcpConnection::%s handleError [%d] - SO_ERROR = %s", name_.c_str(), err, strerror(err));
+    if (zeroCopyCompleted && err == 0)
+        return;
+
+    LOGE_LIMITED(10, 20, "TcpConnection::%s handleError [%d] - SO_ERROR = %s", name_.c_str(), err, strerror(err));
 
     //handleClose()رӣChannelfd
     handleClose();
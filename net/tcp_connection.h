@@ -3,11 +3,19 @@
 
 #include "callbacks.h"
 #include "buffer.h"
+#include "buffer_slice.h"
+#include "output_chain.h"
+#include "receive_sizer.h"
+#include "send_queue.h"
+#include "token_bucket.h"
+#include "timer_id.h"
 #include "inet_address.h"
 #include "net_common.h"
 
 #include <memory>
 #include <any>
+#include <deque>
+#include <vector>
 
 // struct tcp_info is in <netinet/tcp.h>
 //struct tcp_info;
@@ -18,6 +26,49 @@ class Channel;
 class EventLoop;
 class Socket;
 
+/// Flow control counters of a TcpConnection, see TcpConnection::stats().
+struct TcpConnectionStats
+{
+    size_t  outputBytes = 0;        // bytes queued in memory for writing
+    size_t  highWaterMark = 0;      // back-pressure thresholds, 0 if off
+    size_t  lowWaterMark = 0;
+    bool    readPaused = false;     // back-pressure holds reading now
+    int64_t readPauses = 0;         // times back-pressure stopped reading
+    int64_t readResumes = 0;        // times it resumed
+    int64_t readThrottles = 0;      // times a read rate limit paused reading
+    int64_t writeThrottles = 0;     // times a write rate limit deferred writing
+    int64_t coalescedReads = 0;     // reads held back by the receive coalescing window
+    int64_t coalescedDeliveries = 0;    // message callbacks made after holding reads back
+    bool    slowConsumer = false;   // the slow consumer policy holds now
+    int64_t outputAge = 0;          // microseconds the oldest queued byte waited, at the last check
+    int64_t slowEvents = 0;         // times the connection became a slow consumer
+    int64_t droppedMessages = 0;    // droppable messages discarded for it
+    int64_t droppedBytes = 0;
+    size_t  zeroCopyPending = 0;    // MSG_ZEROCOPY sends the kernel has not completed yet
+    int64_t zeroCopyCopied = 0;     // completions that said the kernel copied after all
+    bool    zeroCopyPaused = false; // zero-copy paused after a run of copied sends
+};
+
+/// When a connection counts as a slow consumer and what happens then,
+/// see TcpConnection::setSlowConsumerPolicy(). Times are in microseconds.
+struct SlowConsumerPolicy
+{
+    size_t  maxOutputBytes = 0;     // slow with more bytes queued, 0 ignores the size
+    int64_t maxOutputAge = 0;       // slow with a byte queued longer, 0 ignores the age
+    bool    dropDroppable = true;   // discard queued droppable messages while slow
+    int64_t evictAfter = 0;         // close the connection after being slow this long, 0 never
+    int64_t checkInterval = 100 * 1000;
+};
+
+/// Process wide slow consumer counters, for alerting.
+struct SlowConsumerCounters
+{
+    int64_t slowEvents = 0;
+    int64_t droppedMessages = 0;
+    int64_t droppedBytes = 0;
+    int64_t evictions = 0;
+};
+
 ///
 /// TCP connection, for both client and server usage.
 ///
@@ -25,6 +76,19 @@ class Socket;
 class NET_API TcpConnection : public std::enable_shared_from_this<TcpConnection>
 {
 public:
+    static const size_t kDefaultZeroCopyThreshold = 16 * 1024;
+    static const size_t kDefaultCorkThreshold = 64 * 1024;
+    /// Moved-in messages at least this large are queued by taking over
+    /// their storage, smaller ones are copied and coalesce in the output chain.
+    static const size_t kMinAdoptSize = 1024;
+    static const size_t kDefaultMaxFrameSize = 4 * 1024 * 1024;
+
+    enum Framing
+    {
+        kFrameLines,        // lines terminated by "\n" or "\r\n"
+        kFrameLength32,     // network endian int32_t length, then the payload
+    };
+
     /// Constructs a TcpConnection with a connected sockfd
     ///
     /// User should not create this object.
@@ -46,16 +110,55 @@ public:
     //bool getTcpInfo(struct tcp_info*) const;
     //std::string getTcpInfoString() const;
 
-    // void send(string&& message); // C++11
+    /// Thread safe. From other threads the message is copied into the
+    /// send queue of the connection and written by its loop.
     void send(const void* message, int len);
     void send(const std::string& message);
-    // void send(Buffer&& message); // C++11
+    /// Moves @c message into the output path, whatever is not written right
+    /// away is queued without copying, also when called from other threads.
+    void send(std::string&& message);
+    void send(std::vector<char>&& message);
+    void send(Buffer&& message);
     void send(Buffer* message);  // this one will swap data
+    /// Sends in priority lane @c priority. Queued messages of a higher
+    /// priority are written before queued ones of a lower priority, at
+    /// message boundaries, e.g. a heartbeat does not wait behind bulk data.
+    /// Thread safe.
+    void send(const void* message, int len, OutputChain::Priority priority);
+    void send(const std::string& message, OutputChain::Priority priority);
+    void send(const BufferSlice& slice, OutputChain::Priority priority);
+    /// Queues @c slice by reference, no matter which thread calls it.
+    /// The payload is shared, never copied, while the write is pending.
+    void send(const BufferSlice& slice);
+    /// Queues @c length bytes of file @c fd starting at @c offset, behind
+    /// any data already queued, and transmits them with sendfile(2).
+    /// @c fd is duplicated, the caller may close its own copy right away.
+    /// writeCompleteCallback fires once the region and everything before
+    /// it have been written.
+    /// Thread safe. Returns false if the file could not be queued.
+    bool sendFile(int fd, int64_t offset, size_t length);
     void shutdown(); // NOT thread safe, no simultaneous calling
     // void shutdownAndForceCloseAfter(double seconds); // NOT thread safe, no simultaneous calling
     void forceClose();
     //void forceCloseWithDelay(double seconds);
     void setTcpNoDelay(bool on);
+    /// Sets TCP_NOTSENT_LOWAT on the socket, see setWritableCallback().
+    /// Not thread safe, call it in the loop thread (e.g. connection callback).
+    /// Returns false if the option is not supported.
+    bool setNotSentLowat(size_t bytes);
+    /// Sends slices of at least @c threshold bytes with MSG_ZEROCOPY, so the
+    /// kernel reads them from the shared payload instead of copying them.
+    /// Pauses it for a while by itself when the kernel keeps reporting it copied.
+    /// Not thread safe, call it in the loop thread (e.g. connection callback).
+    /// Returns false if SO_ZEROCOPY is not supported.
+    bool enableZeroCopy(size_t threshold = kDefaultZeroCopyThreshold);
+    /// With auto-cork on, sends made during one loop iteration are queued
+    /// and written together with one writev(2) at the end of the iteration,
+    /// or as soon as @c threshold bytes are pending.
+    /// Not thread safe, call it in the loop thread (e.g. connection callback).
+    /// Turning it off flushes what is corked.
+    void setAutoCork(bool on, size_t threshold = kDefaultCorkThreshold);
+    bool autoCork() const { return autoCork_; }
     // reading or not
     void startRead();
     void stopRead();
@@ -86,25 +189,104 @@ public:
         messageCallback_ = cb;
     }
 
+    /// Replaces the message callback with one that splits the input into
+    /// frames and calls @c cb once per complete frame, with a view into the
+    /// input buffer, so parsing needs no copies. A peer that buffers more
+    /// than @c maxFrameSize bytes without completing a frame is closed.
+    /// Set it before connectEstablished() or in the loop thread.
+    void setFrameCallback(const FrameCallback& cb, Framing framing,
+                          size_t maxFrameSize = kDefaultMaxFrameSize);
+
     void setWriteCompleteCallback(const WriteCompleteCallback& cb)
     {
         writeCompleteCallback_ = cb;
     }
 
+    /// Called when the connection can take more data without queueing it in
+    /// user space: the output chain is empty and the socket polls writable.
+    /// With setNotSentLowat() that means the kernel holds fewer unsent bytes
+    /// than the low water mark, so a stream can produce data just in time
+    /// instead of filling the socket buffer ahead of the network.
+    void setWritableCallback(const WritableCallback& cb)
+    {
+        writableCallback_ = cb;
+    }
+
     void setHighWaterMarkCallback(const HighWaterMarkCallback& cb, size_t highWaterMark)
     {
         highWaterMarkCallback_ = cb; highWaterMark_ = highWaterMark;
     }
 
+    /// Flow control: once more than @c highWaterMark bytes wait in the
+    /// output chain, reading stops on the back-pressure peer (this
+    /// connection if none is set), and resumes when the output drains to
+    /// @c lowWaterMark. A high water mark of 0 turns it off.
+    /// Set it before connectEstablished() or in the loop thread.
+    void setBackPressure(size_t highWaterMark, size_t lowWaterMark)
+    {
+        assert(lowWaterMark < highWaterMark || highWaterMark == 0);
+        backPressureHigh_ = highWaterMark; backPressureLow_ = lowWaterMark;
+    }
+
+    /// Makes back-pressure stop reading on @c peer instead of this
+    /// connection, e.g. the upstream side of a proxy feeding this one.
+    /// Not thread safe, call it in the loop thread.
+    void setBackPressurePeer(const TcpConnectionPtr& peer);
+
+    /// Rate limits reading with @c bucket, on top of limits added before.
+    /// Reading pauses while the bucket is in debt and resumes from a loop
+    /// timer once it refilled. Pass a TokenBucket::group() bucket to cap a
+    /// group of connections together.
+    /// Set it before connectEstablished() or in the loop thread.
+    void addReadLimit(const TokenBucketPtr& bucket) { readLimits_.push_back(bucket); }
+    /// Same as addReadLimit(), writes are deferred instead.
+    void addWriteLimit(const TokenBucketPtr& bucket) { writeLimits_.push_back(bucket); }
+    /// Removes the read or write limits, a paused read or deferred write
+    /// resumes at once.
+    /// Not thread safe, call it in the loop thread.
+    void clearReadLimits();
+    void clearWriteLimits();
+
+    /// Receive coalescing, like interrupt moderation on a NIC: after a read,
+    /// the message callback waits up to @c windowUs microseconds or until
+    /// @c maxBytes are buffered, so a flood of small messages is handled in
+    /// batches, and replies sent meanwhile can go out in one write (see
+    /// setAutoCork(), the corked replies leave at the end of the iteration
+    /// the window closes in). Loop timers tick in milliseconds, so a window shorter
+    /// than that lasts about 1ms. A window of 0 turns it off.
+    /// Not thread safe, call it in the loop thread (e.g. connection callback).
+    void setReceiveCoalescing(int64_t windowUs, size_t maxBytes);
+
+    /// Watches the output of a peer that does not keep up, so a few stalled
+    /// subscribers can not hold unbounded memory. While output is queued, a
+    /// loop timer checks every @c checkInterval whether more than
+    /// @c maxOutputBytes are queued or a byte waited longer than
+    /// @c maxOutputAge. If so, queued messages sent with
+    /// OutputChain::kPriorityDroppable are discarded oldest first, @c cb is
+    /// called so the application can degrade to e.g. sending snapshots, and
+    /// after @c evictAfter the connection is closed.
+    /// Set it before connectEstablished() or in the loop thread.
+    void setSlowConsumerPolicy(const SlowConsumerPolicy& policy,
+                               const SlowConsumerCallback& cb = SlowConsumerCallback());
+
+    /// Thread safe.
+    static SlowConsumerCounters slowConsumerCounters();
+
+    /// Not thread safe, call it in the loop thread.
+    TcpConnectionStats stats() const;
+
     /// Advanced interface
     Buffer* inputBuffer()
     {
         return &inputBuffer_;
     }
 
-    Buffer* outputBuffer()
+    /// API change: replaces outputBuffer(), which returned the single output
+    /// Buffer*. Queued output can only be added with send() now;
+    /// outputChain()->readableBytes() tells how many bytes wait to be written.
+    OutputChain* outputChain()
     {
-        return &outputBuffer_;
+        return &outputChain_;
     }
 
     /// Internal use only.
@@ -124,9 +306,47 @@ private:
     void handleWrite();
     void handleClose();
     void handleError();
+    void deliverInput(Timestamp receiveTime);
+    void flushCoalesced();
+    static void handleFrames(const FrameCallback& cb, Framing framing, size_t maxFrameSize,
+                             const TcpConnectionPtr& conn, Buffer* buf, Timestamp receiveTime);
     // void sendInLoop(string&& message);
     void sendInLoop(const std::string& message);
-    void sendInLoop(const void* message, size_t len);
+    void sendInLoop(const void* message, size_t len,
+                    OutputChain::Priority priority = OutputChain::kPriorityNormal);
+    void sendSliceInLoop(const BufferSlice& slice,
+                         OutputChain::Priority priority = OutputChain::kPriorityNormal);
+    void sendFileInLoop(const FileRegionPtr& region);
+    bool writeDirectly(const void* data, size_t len, size_t* nwrote);
+    void queueOutput(size_t len);
+    void checkHighWaterMark(size_t len);
+    bool armWritable();
+    void disarmWritable();
+    void checkLowWaterMark();
+    void pauseReadingForBackPressure();
+    void resumeReadingForBackPressure();
+    // back-pressure of this or another connection holding this one's reading
+    void holdReadingInLoop();
+    void releaseReadingInLoop();
+    // enables reading only if nothing holds it off
+    void updateReading();
+    static int64_t chargeLimits(const std::vector<TokenBucketPtr>& limits, size_t bytes);
+    void chargeRead(size_t bytes);
+    void chargeWrite(size_t bytes);
+    size_t writeQuota() const;
+    void scheduleUnthrottle(int64_t delay, void (TcpConnection::*handler)());
+    void unthrottleReading();
+    void unthrottleWriting();
+    bool watchesSlowConsumer() const
+    { return slowConsumerPolicy_.maxOutputBytes > 0 || slowConsumerPolicy_.maxOutputAge > 0; }
+    void scheduleSlowConsumerCheck();
+    void checkSlowConsumer();
+    bool isSlowConsumer(Timestamp now);
+    void scheduleCorkFlush();
+    void flushCorked();
+    void writeQueued();
+    void queueSend(SendQueue::Node* node);
+    void drainSendQueue();
     void shutdownInLoop();
     // void shutdownAndForceCloseInLoop(double seconds);
     void forceCloseInLoop();
@@ -148,11 +368,57 @@ private:
     ConnectionCallback connectionCallback_;
     MessageCallback messageCallback_;
     WriteCompleteCallback writeCompleteCallback_;
+    WritableCallback writableCallback_;
     HighWaterMarkCallback highWaterMarkCallback_;
     CloseCallback closeCallback_;
     size_t highWaterMark_;
+    size_t backPressureHigh_;
+    size_t backPressureLow_;
+    // the connection whose reading is held, kept to resume the same one
+    std::weak_ptr<TcpConnection> backPressurePeer_;
+    std::weak_ptr<TcpConnection> backPressurePaused_;
+    bool readPausedByBackPressure_;
+    // holds on reading by back-pressure, kept apart from reading_ which the application sets
+    int readPausedByPeer_;
+    int64_t readPauses_;
+    int64_t readResumes_;
+    std::vector<TokenBucketPtr> readLimits_;
+    std::vector<TokenBucketPtr> writeLimits_;
+    bool readThrottled_;
+    bool writeThrottled_;
+    int64_t readThrottles_;
+    int64_t writeThrottles_;
+    // writing is enabled with an empty output chain, only to learn when
+    // the socket is writable for writableCallback_
+    bool writableArmed_;
+    bool autoCork_;
+    bool corkFlushQueued_;
+    size_t corkThreshold_;
+    int64_t coalesceWindow_;
+    size_t coalesceBytes_;
+    // a delivery is held back until coalesceTimer_ fires
+    bool coalescePending_;
+    Timestamp coalesceReceiveTime_;
+    TimerId coalesceTimer_;
+    int64_t coalescedReads_;
+    int64_t coalescedDeliveries_;
+    SlowConsumerPolicy slowConsumerPolicy_;
+    SlowConsumerCallback slowConsumerCallback_;
+    bool slowConsumerCheckQueued_;
+    bool slowConsumer_;
+    Timestamp slowSince_;
+    // (time, OutputChain::appendedBytes()) taken at checks, the oldest
+    // queued byte was appended before the first one counting past it
+    std::deque<std::pair<Timestamp, uint64_t>> outputSamples_;
+    int64_t outputAge_;
+    int64_t slowEvents_;
+    int64_t droppedMessages_;
+    int64_t droppedBytes_;
     Buffer inputBuffer_;
-    Buffer outputBuffer_; // FIXME: use list<Buffer> as output buffer.
+    AdaptiveReceiveSizer receiveSizer_;
+    OutputChain outputChain_;
+    // messages sent from other threads, drained by the loop
+    SendQueue sendQueue_;
     std::any context_;
     // FIXME: creationTime_, lastReceiveTime_
     //        bytesReceived_, bytesSent_
@@ -19,6 +19,8 @@ TcpServer::TcpServer(EventLoop* loop,
     eventLoopThreadPool_(nullptr),
     connectionCallback_(defaultConnectionCallback),
     messageCallback_(defaultMessageCallback),
+    backPressureHigh_(0),
+    backPressureLow_(0),
     nextConnId_(1)
 {
     acceptor_->setNewConnectionCallback(
@@ -91,6 +93,8 @@ void TcpServer::newConnection(int sockfd, const InetAddress& peerAddr)
     conn->setConnectionCallback(connectionCallback_);
     conn->setMessageCallback(messageCallback_);
     conn->setWriteCompleteCallback(writeCompleteCallback_);
+    conn->setBackPressure(backPressureHigh_, backPressureLow_);
+    conn->setSlowConsumerPolicy(slowConsumerPolicy_, slowConsumerCallback_);
     conn->setCloseCallback(std::bind(&TcpServer::removeConnection, this, std::placeholders::_1)); // FIXME: unsafe
     //̷߳io¼TcpConnection::connectEstablished
     ioLoop->runInLoop(std::bind(&TcpConnection::connectEstablished, conn));
@@ -87,6 +87,23 @@ public:
         writeCompleteCallback_ = cb;
     }
 
+    /// Back-pressure thresholds of new connections,
+    /// see TcpConnection::setBackPressure(). 0 turns it off (the default).
+    /// Not thread safe.
+    void setBackPressure(size_t highWaterMark, size_t lowWaterMark)
+    {
+        backPressureHigh_ = highWaterMark; backPressureLow_ = lowWaterMark;
+    }
+
+    /// Slow consumer policy of new connections,
+    /// see TcpConnection::setSlowConsumerPolicy(). Off by default.
+    /// Not thread safe.
+    void setSlowConsumerPolicy(const SlowConsumerPolicy& policy,
+                               const SlowConsumerCallback& cb = SlowConsumerCallback())
+    {
+        slowConsumerPolicy_ = policy; slowConsumerCallback_ = cb;
+    }
+
 private:
     /// Not thread safe, but in loop
     void newConnection(int sockfd, const InetAddress& peerAddr);
@@ -106,6 +123,10 @@ private:
     MessageCallback messageCallback_;
     WriteCompleteCallback writeCompleteCallback_;
     ThreadInitCallback threadInitCallback_;
+    size_t backPressureHigh_;
+    size_t backPressureLow_;
+    SlowConsumerPolicy slowConsumerPolicy_;
+    SlowConsumerCallback slowConsumerCallback_;
     std::atomic<int> started_;
     // always in loop thread
     int nextConnId_;
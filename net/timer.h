@@ -0,0 +1,56 @@
+#ifndef __NET_TIMER_H
+#define __NET_TIMER_H
+
+#include <atomic>
+
+#include "common.h"
+#include "timestamp.h"
+#include "callbacks.h"
+
+BEGIN_NS(net)
+
+///
+/// Internal class for timer event.
+///
+class Timer
+{
+public:
+    /// @param interval repeat interval in microseconds, 0 runs once
+    Timer(TimerCallback cb, Timestamp when, int64_t interval)
+        : callback_(std::move(cb)),
+          expiration_(when),
+          interval_(interval),
+          repeat_(interval > 0),
+          sequence_(++s_numCreated_)
+    {
+    }
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+    void run() const
+    {
+        callback_();
+    }
+
+    Timestamp expiration() const { return expiration_; }
+    bool repeat() const { return repeat_; }
+    int64_t sequence() const { return sequence_; }
+
+    void restart(Timestamp now);
+
+    static int64_t numCreated() { return s_numCreated_; }
+
+private:
+    const TimerCallback     callback_;
+    Timestamp               expiration_;
+    const int64_t           interval_;
+    const bool              repeat_;
+    const int64_t           sequence_;
+
+    static std::atomic<int64_t> s_numCreated_;
+};
+
+END_NS(net)
+
+#endif  // __NET_TIMER_H
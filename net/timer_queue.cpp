@@ -0,0 +1,170 @@
+#include "timer_queue.h"
+
+#include "async_log.h"
+#include "event_loop.h"
+#include "timer.h"
+
+#include <assert.h>
+
+BEGIN_NS(net)
+
+TimerQueue::TimerQueue(EventLoop* loop)
+    : loop_(loop),
+      timers_(),
+      callingExpiredTimers_(false)
+{
+}
+
+TimerQueue::~TimerQueue()
+{
+    // do not remove channel, since we're in EventLoop::dtor();
+    for (const Entry& timer : timers_)
+    {
+        delete timer.second;
+    }
+}
+
+TimerId TimerQueue::addTimer(TimerCallback cb, Timestamp when, int64_t interval)
+{
+    Timer* timer = new Timer(std::move(cb), when, interval);
+    // from another thread this also wakes the loop up, so it polls
+    // again with a timeout that accounts for the new timer
+    loop_->runInLoop(std::bind(&TimerQueue::addTimerInLoop, this, timer));
+    return TimerId(timer, timer->sequence());
+}
+
+void TimerQueue::cancel(TimerId timerId)
+{
+    loop_->runInLoop(std::bind(&TimerQueue::cancelInLoop, this, timerId));
+}
+
+void TimerQueue::addTimerInLoop(Timer* timer)
+{
+    loop_->assertInLoopThread();
+    insert(timer);
+}
+
+void TimerQueue::cancelInLoop(TimerId timerId)
+{
+    loop_->assertInLoopThread();
+    assert(timers_.size() == activeTimers_.size());
+    ActiveTimer timer(timerId.timer_, timerId.sequence_);
+    ActiveTimerSet::iterator it = activeTimers_.find(timer);
+    if (it != activeTimers_.end())
+    {
+        size_t n = timers_.erase(Entry(it->first->expiration(), it->first));
+        assert(n == 1); (void)n;
+        delete it->first;
+        activeTimers_.erase(it);
+    }
+    else if (callingExpiredTimers_)
+    {
+        // a repeating timer canceling itself from its callback
+        cancelingTimers_.insert(timer);
+    }
+    assert(timers_.size() == activeTimers_.size());
+}
+
+void TimerQueue::doTimer()
+{
+    loop_->assertInLoopThread();
+    if (timers_.empty())
+        return;
+
+    Timestamp now(Timestamp::now());
+    std::vector<Entry> expired = getExpired(now);
+    if (expired.empty())
+        return;
+
+    callingExpiredTimers_ = true;
+    cancelingTimers_.clear();
+    // safe to callback outside critical section
+    for (const Entry& it : expired)
+    {
+        it.second->run();
+    }
+    callingExpiredTimers_ = false;
+
+    reset(expired, now);
+}
+
+int TimerQueue::pollTimeoutMs(int maxMs) const
+{
+    if (timers_.empty())
+        return maxMs;
+
+    int64_t waitUs = timers_.begin()->first.microSecondsSinceEpoch() - Timestamp::now().microSecondsSinceEpoch();
+    if (waitUs <= 0)
+        return 0;
+
+    // round up, waking early would only spin until the timer is due
+    int64_t waitMs = (waitUs + 999) / 1000;
+    return waitMs < maxMs ? static_cast<int>(waitMs) : maxMs;
+}
+
+std::vector<TimerQueue::Entry> TimerQueue::getExpired(Timestamp now)
+{
+    assert(timers_.size() == activeTimers_.size());
+    std::vector<Entry> expired;
+    Entry sentry(now, reinterpret_cast<Timer*>(UINTPTR_MAX));
+    TimerList::iterator end = timers_.lower_bound(sentry);
+    assert(end == timers_.end() || now < end->first);
+    std::copy(timers_.begin(), end, back_inserter(expired));
+    timers_.erase(timers_.begin(), end);
+
+    for (const Entry& it : expired)
+    {
+        ActiveTimer timer(it.second, it.second->sequence());
+        size_t n = activeTimers_.erase(timer);
+        assert(n == 1); (void)n;
+    }
+
+    assert(timers_.size() == activeTimers_.size());
+    return expired;
+}
+
+void TimerQueue::reset(const std::vector<Entry>& expired, Timestamp now)
+{
+    for (const Entry& it : expired)
+    {
+        ActiveTimer timer(it.second, it.second->sequence());
+        if (it.second->repeat()
+            && cancelingTimers_.find(timer) == cancelingTimers_.end())
+        {
+            it.second->restart(now);
+            insert(it.second);
+        }
+        else
+        {
+            delete it.second;
+        }
+    }
+}
+
+bool TimerQueue::insert(Timer* timer)
+{
+    loop_->assertInLoopThread();
+    assert(timers_.size() == activeTimers_.size());
+    bool earliestChanged = false;
+    Timestamp when = timer->expiration();
+    TimerList::iterator it = timers_.begin();
+    if (it == timers_.end() || when < it->first)
+    {
+        earliestChanged = true;
+    }
+    {
+        std::pair<TimerList::iterator, bool> result
+            = timers_.insert(Entry(when, timer));
+        assert(result.second); (void)result;
+    }
+    {
+        std::pair<ActiveTimerSet::iterator, bool> result
+            = activeTimers_.insert(ActiveTimer(timer, timer->sequence()));
+        assert(result.second); (void)result;
+    }
+
+    assert(timers_.size() == activeTimers_.size());
+    return earliestChanged;
+}
+
+END_NS(net)
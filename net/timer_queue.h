@@ -0,0 +1,78 @@
+#ifndef __NET_TIMERQUEUE_H
+#define __NET_TIMERQUEUE_H
+
+#include <set>
+#include <vector>
+
+#include "common.h"
+#include "timestamp.h"
+#include "callbacks.h"
+#include "timer_id.h"
+
+BEGIN_NS(net)
+
+class EventLoop;
+class Timer;
+
+///
+/// A best efforts timer queue.
+/// No guarantee that the callback will be on time.
+///
+/// There is no timer fd, the loop bounds its poll timeout with
+/// pollTimeoutMs() and calls doTimer() after every poll, before the queued
+/// functors, so the same code runs with every poller. Resolution is one
+/// millisecond.
+class TimerQueue
+{
+public:
+    explicit TimerQueue(EventLoop* loop);
+    ~TimerQueue();
+
+    TimerQueue(const TimerQueue&) = delete;
+    TimerQueue& operator=(const TimerQueue&) = delete;
+
+    ///
+    /// Schedules the callback to be run at given time,
+    /// repeats if @c interval > 0.0.
+    ///
+    /// Must be thread safe. Usually be called from other threads.
+    TimerId addTimer(TimerCallback cb, Timestamp when, int64_t interval);
+
+    void cancel(TimerId timerId);
+
+    /// Runs the expired timers, in the loop thread.
+    void doTimer();
+
+    /// Milliseconds until the earliest timer expires, at most @c maxMs.
+    int pollTimeoutMs(int maxMs) const;
+
+private:
+    // FIXME: use unique_ptr<Timer> instead of raw pointers.
+    // This requires heterogeneous comparison lookup (N3465) from C++14
+    // so that we can find an T* in a set<unique_ptr<T>>.
+    typedef std::pair<Timestamp, Timer*> Entry;
+    typedef std::set<Entry> TimerList;
+    typedef std::pair<Timer*, int64_t> ActiveTimer;
+    typedef std::set<ActiveTimer> ActiveTimerSet;
+
+    void addTimerInLoop(Timer* timer);
+    void cancelInLoop(TimerId timerId);
+    // move out all expired timers
+    std::vector<Entry> getExpired(Timestamp now);
+    void reset(const std::vector<Entry>& expired, Timestamp now);
+
+    bool insert(Timer* timer);
+
+    EventLoop*          loop_;
+    // Timer list sorted by expiration
+    TimerList           timers_;
+
+    // for cancel()
+    ActiveTimerSet      activeTimers_;
+    bool                callingExpiredTimers_; /* atomic */
+    ActiveTimerSet      cancelingTimers_;
+};
+
+END_NS(net)
+
+#endif  // __NET_TIMERQUEUE_H
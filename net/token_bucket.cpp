@@ -0,0 +1,108 @@
+#include "token_bucket.h"
+
+#include "timestamp.h"
+
+#include <map>
+
+BEGIN_NS(net)
+
+namespace
+{
+
+std::mutex g_groupsMutex;
+// weak, so the names of groups nobody uses any more do not pile up
+std::map<std::string, std::weak_ptr<TokenBucket>> g_groups;
+
+}
+
+TokenBucket::TokenBucket(int64_t bytesPerSecond, int64_t burstBytes)
+    : tokens_(static_cast<double>(burstBytes)),
+      lastRefillUs_(Timestamp::now().microSecondsSinceEpoch()),
+      rate_(bytesPerSecond),
+      burst_(burstBytes)
+{
+}
+
+void TokenBucket::setRate(int64_t bytesPerSecond, int64_t burstBytes)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    refill(Timestamp::now().microSecondsSinceEpoch());
+    rate_ = bytesPerSecond;
+    burst_ = burstBytes;
+    if (tokens_ > burst_)
+        tokens_ = static_cast<double>(burst_);
+}
+
+int64_t TokenBucket::rate() const
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return rate_;
+}
+
+int64_t TokenBucket::burst() const
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return burst_;
+}
+
+void TokenBucket::consume(size_t bytes)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    refill(Timestamp::now().microSecondsSinceEpoch());
+    tokens_ -= static_cast<double>(bytes);
+}
+
+int64_t TokenBucket::delay()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    refill(Timestamp::now().microSecondsSinceEpoch());
+    if (tokens_ >= 1.0)
+        return 0;
+    if (rate_ <= 0)
+        return Timestamp::kMicroSecondsPerSecond;
+
+    // time to earn back the debt plus one byte
+    return static_cast<int64_t>((1.0 - tokens_) * Timestamp::kMicroSecondsPerSecond / rate_) + 1;
+}
+
+void TokenBucket::refill(int64_t nowUs)
+{
+    int64_t elapsedUs = nowUs - lastRefillUs_;
+    if (elapsedUs <= 0)
+        return;
+
+    lastRefillUs_ = nowUs;
+    tokens_ += static_cast<double>(elapsedUs) * rate_ / Timestamp::kMicroSecondsPerSecond;
+    if (tokens_ > burst_)
+        tokens_ = static_cast<double>(burst_);
+}
+
+TokenBucketPtr TokenBucket::group(const std::string& name, int64_t bytesPerSecond, int64_t burstBytes)
+{
+    std::unique_lock<std::mutex> lock(g_groupsMutex);
+    auto it = g_groups.find(name);
+    TokenBucketPtr bucket = it != g_groups.end() ? it->second.lock() : TokenBucketPtr();
+    if (bucket)
+        return bucket;
+
+    // a new group, drop the ones that went away meanwhile
+    for (auto expired = g_groups.begin(); expired != g_groups.end();)
+    {
+        if (expired->second.expired())
+            expired = g_groups.erase(expired);
+        else
+            ++expired;
+    }
+    bucket = std::make_shared<TokenBucket>(bytesPerSecond, burstBytes);
+    g_groups[name] = bucket;
+    return bucket;
+}
+
+TokenBucketPtr TokenBucket::findGroup(const std::string& name)
+{
+    std::unique_lock<std::mutex> lock(g_groupsMutex);
+    auto it = g_groups.find(name);
+    return it != g_groups.end() ? it->second.lock() : TokenBucketPtr();
+}
+
+END_NS(net)
@@ -0,0 +1,64 @@
+#ifndef __NET_TOKEN_BUCKET_H
+#define __NET_TOKEN_BUCKET_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "common.h"
+#include "net_common.h"
+
+BEGIN_NS(net)
+
+///
+/// Token bucket rate limiter counting bytes.
+///
+/// Tokens refill at @c bytesPerSecond up to @c burstBytes. Transfers are
+/// charged after they happen, so the bucket may go into debt by up to one
+/// read or write; the connection then waits until the debt is paid off.
+///
+/// Thread safe, one bucket can be shared by connections of several loops
+/// to cap them together, see group().
+class NET_API TokenBucket
+{
+public:
+    TokenBucket(int64_t bytesPerSecond, int64_t burstBytes);
+
+    TokenBucket(const TokenBucket&) = delete;
+    TokenBucket& operator=(const TokenBucket&) = delete;
+
+    void setRate(int64_t bytesPerSecond, int64_t burstBytes);
+    int64_t rate() const;
+    int64_t burst() const;
+
+    /// Charges @c bytes that were just transferred.
+    void consume(size_t bytes);
+
+    /// Microseconds until tokens are available again, 0 if they are now.
+    int64_t delay();
+
+    /// Returns the bucket shared by all connections of group @c name,
+    /// creating it with the given rate on first use. Later calls return the
+    /// same bucket whatever rate they pass, use setRate() to change it.
+    /// The registry holds groups weakly: a group goes away with the last
+    /// pointer to its bucket, and a later call creates it anew.
+    static std::shared_ptr<TokenBucket> group(const std::string& name, int64_t bytesPerSecond, int64_t burstBytes);
+
+    /// Returns the bucket of group @c name, null if there is none.
+    static std::shared_ptr<TokenBucket> findGroup(const std::string& name);
+
+private:
+    void refill(int64_t nowUs);
+
+    mutable std::mutex  mutex_;
+    double              tokens_;
+    int64_t             lastRefillUs_;
+    int64_t             rate_;
+    int64_t             burst_;
+};
+
+typedef std::shared_ptr<TokenBucket> TokenBucketPtr;
+
+END_NS(net)
+
+#endif  // __NET_TOKEN_BUCKET_H
@@ -0,0 +1,127 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <string.h>
+#include "async_log.h"
+#include "event_loop.h"
+#include "tcp_connection.h"
+#include "test_helper.h"
+
+using namespace net;
+
+//Back-pressure and the application's startRead()/stopRead() hold reading
+//off independently: back-pressure letting go must not undo a stopRead(),
+//and a startRead() must not undo back-pressure.
+//
+//usage: backPressureTest
+
+#ifndef WIN32
+
+static const size_t kMessageSize = 1024 * 1024;
+
+static void runOnce(EventLoop* loop)
+{
+	loop->queueInLoop([loop] { loop->quit(); });
+	loop->loop();
+}
+
+struct Fixture
+{
+	Fixture()
+	{
+		if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0)
+			std::cout << "socketpair failed: " << strerror(errno) << "\n";
+		conn.reset(new TcpConnection(&loop, "backPressure", fds[0], InetAddress(), InetAddress()));
+		conn->setConnectionCallback([](const TcpConnectionPtr&) {});
+		conn->setCloseCallback([](const TcpConnectionPtr&) {});
+		conn->setMessageCallback([this](const TcpConnectionPtr&, Buffer* buffer, Timestamp)
+		{
+			received += buffer->readableBytes();
+			buffer->retrieveAll();
+		});
+		conn->setBackPressure(64 * 1024, 16 * 1024);
+		conn->connectEstablished();
+	}
+
+	~Fixture()
+	{
+		conn->forceClose();
+		runOnce(&loop);
+		conn->connectDestroyed();
+		::close(fds[1]);
+	}
+
+	//the peer sends a few bytes, true if the connection read them
+	bool peerSendIsRead()
+	{
+		size_t before = received;
+		if (::write(fds[1], "data", 4) != 4)
+			return false;
+		for (int i = 0; i < 3; ++i)
+			runOnce(&loop);
+		return received > before;
+	}
+
+	//the peer reads everything the connection sent
+	void drain()
+	{
+		std::vector<char> buf(65536);
+		size_t total = 0;
+		while (total < kMessageSize)
+		{
+			ssize_t n = ::read(fds[1], buf.data(), buf.size());
+			if (n > 0)
+				total += static_cast<size_t>(n);
+			else if (n < 0 && errno != EAGAIN)
+				break;
+			runOnce(&loop);
+		}
+	}
+
+	EventLoop loop;
+	int fds[2];
+	TcpConnectionPtr conn;
+	size_t received = 0;
+};
+
+int main(int argc, char** argv)
+{
+	CAsyncLog::init();
+	CAsyncLog::setLevel(LOG_LEVEL_ERROR);
+
+	bool ok = true;
+	{
+		Fixture f;
+		ok &= check("reads before back-pressure", f.peerSendIsRead());
+		f.conn->send(std::string(kMessageSize, 'x'));
+		ok &= check("back-pressure stops reading", !f.peerSendIsRead());
+		f.conn->startRead();
+		ok &= check("startRead() does not override back-pressure", !f.peerSendIsRead());
+		f.drain();
+		ok &= check("reads again once the output drained", f.peerSendIsRead());
+	}
+	{
+		Fixture f;
+		f.conn->send(std::string(kMessageSize, 'x'));
+		f.conn->stopRead();
+		f.drain();
+		ok &= check("back-pressure letting go keeps stopRead()", !f.peerSendIsRead());
+		f.conn->startRead();
+		ok &= check("startRead() after back-pressure let go", f.peerSendIsRead());
+	}
+
+	CAsyncLog::uninit();
+
+	std::cout << (ok ? "all passed" : "FAILED") << "\n";
+	return ok ? 0 : 1;
+}
+
+#else
+
+int main(int argc, char** argv)
+{
+	std::cout << "backPressureTest needs socketpair(2), not supported on Windows\n";
+	return 0;
+}
+
+#endif
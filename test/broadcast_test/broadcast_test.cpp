@@ -0,0 +1,166 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include "async_log.h"
+#include "event_loop.h"
+#include "tcp_connection.h"
+
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace net;
+
+//Broadcasts the same payload to many subscribers whose peers never read, so
+//everything stays queued in the connections' output chains, and compares
+//copying the payload into every connection with sharing one BufferSlice.
+//
+//usage: broadcastTest [subscribers] [messages] [copy|slice|both]
+
+#ifndef WIN32
+
+static const size_t kPayloadSize = 2048;
+
+struct Subscriber
+{
+	TcpConnectionPtr	conn;
+	int					peerFd;
+};
+
+static long residentKB()
+{
+	long pages = 0;
+	long resident = 0;
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (fp == nullptr)
+		return 0;
+	if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double cpuMs()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+static int raiseFdLimit(int subscribers)
+{
+	struct rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+
+	//every subscriber takes two fds, keep some for the loop and the log
+	int maxSubscribers = static_cast<int>((rl.rlim_cur - 64) / 2);
+	if (subscribers > maxSubscribers)
+	{
+		std::cout << "RLIMIT_NOFILE is " << rl.rlim_cur << ", using " << maxSubscribers << " subscribers\n";
+		return maxSubscribers;
+	}
+	return subscribers;
+}
+
+static void runBroadcast(bool shared, int subscribers, int messages)
+{
+	EventLoop loop;
+	std::vector<Subscriber> subs;
+	subs.reserve(subscribers);
+	for (int i = 0; i < subscribers; ++i)
+	{
+		int fds[2];
+		if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0)
+		{
+			std::cout << "socketpair failed: " << strerror(errno) << "\n";
+			break;
+		}
+		//keep the kernel queue small, so pending data stays in user space
+		int sndbuf = 4096;
+		::setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);
+
+		TcpConnectionPtr conn(new TcpConnection(&loop, "sub#" + std::to_string(i), fds[0], InetAddress(), InetAddress()));
+		conn->setConnectionCallback([](const TcpConnectionPtr&) {});
+		conn->connectEstablished();
+		subs.push_back(Subscriber{ conn, fds[1] });
+	}
+
+	std::string payload(kPayloadSize, 'm');
+	long rssBefore = residentKB();
+	double cpuBefore = cpuMs();
+
+	for (int m = 0; m < messages; ++m)
+	{
+		payload[0] = static_cast<char>('a' + m % 26);
+		if (shared)
+		{
+			BufferSlice slice = BufferSlice::copyOf(payload);
+			for (const auto& sub : subs)
+				sub.conn->send(slice);
+		}
+		else
+		{
+			for (const auto& sub : subs)
+				sub.conn->send(payload);
+		}
+	}
+
+	double cpuUsed = cpuMs() - cpuBefore;
+	long rssGrowth = residentKB() - rssBefore;
+	size_t queued = 0;
+	for (const auto& sub : subs)
+		queued += sub.conn->outputChain()->readableBytes();
+
+	std::cout << (shared ? "slice" : "copy ")
+		<< " subscribers=" << subs.size()
+		<< " messages=" << messages
+		<< " queued=" << queued / 1024 << "KB"
+		<< " rss+=" << rssGrowth << "KB"
+		<< " cpu=" << cpuUsed << "ms"
+		<< " ns/send=" << cpuUsed * 1e6 / (static_cast<double>(subs.size()) * messages)
+		<< "\n";
+
+	for (auto& sub : subs)
+	{
+		sub.conn->connectDestroyed();
+		sub.conn.reset();
+		::close(sub.peerFd);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	CAsyncLog::init();
+	CAsyncLog::setLevel(LOG_LEVEL_ERROR);
+
+	int subscribers = argc > 1 ? atoi(argv[1]) : 10000;
+	int messages = argc > 2 ? atoi(argv[2]) : 8;
+	std::string mode = argc > 3 ? argv[3] : "both";
+
+	subscribers = raiseFdLimit(subscribers);
+
+	//run the shared mode first, so it can not reuse heap freed by the copy mode
+	if (mode == "slice" || mode == "both")
+		runBroadcast(true, subscribers, messages);
+	if (mode == "copy" || mode == "both")
+		runBroadcast(false, subscribers, messages);
+
+	CAsyncLog::uninit();
+
+	return 0;
+}
+
+#else
+
+int main(int argc, char** argv)
+{
+	std::cout << "broadcastTest needs socketpair(2), not supported on Windows\n";
+	return 0;
+}
+
+#endif
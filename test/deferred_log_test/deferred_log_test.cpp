@@ -0,0 +1,83 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include "async_log.h"
+#include "log_sink.h"
+
+using namespace base;
+
+//Logs the same format and arguments through LOGI and LOGI_DEFER and
+//checks the writer thread formats the deferred line exactly as printf
+//did the immediate one, integer sizes and length modifiers included.
+//
+//usage: deferredLogTest
+
+//every message starts with the marker, what follows must be the same
+#define COMPARE(fmt, ...)                       \
+	do                                          \
+	{                                           \
+		LOGI("msg|" fmt, __VA_ARGS__);          \
+		LOGI_DEFER("msg|" fmt, __VA_ARGS__);    \
+	} while (0)
+
+int main(int argc, char** argv)
+{
+	std::shared_ptr<MemoryLogSink> sink = std::make_shared<MemoryLogSink>(1024 * 1024);
+	CAsyncLog::init({ sink });
+
+	int minusOne = -1;
+	unsigned int big = 3000000000u;
+	short minusTwo = -2;
+	long minusFive = -5;
+	unsigned long maxLong = static_cast<unsigned long>(-1);
+	size_t size = 12345;
+	ptrdiff_t diff = -6;
+	long long minusSeven = -7;
+	unsigned char byte = 250;
+	char letter = 'A';
+	int value = 300;
+	const char* text = "text";
+
+	COMPARE("%x %u", minusOne, minusOne);
+	COMPARE("%d", big);
+	COMPARE("%hx %hd %hu", minusTwo, minusTwo, minusTwo);
+	COMPARE("%hhu %hhd %hhx", value, value, minusOne);
+	COMPARE("%ld %lu %lx", minusFive, maxLong, minusFive);
+	COMPARE("%zu %td", size, diff);
+	COMPARE("%lld %llx", minusSeven, minusSeven);
+	COMPARE("%d %u %c", byte, byte, letter);
+	COMPARE("%#o %#X %+d", value, value, value);
+	COMPARE("%5.2f %e %g", 3.14159, 0.000123, 1e20);
+	COMPARE("%*d|%-*d|%.*s", 6, value, 6, value, 2, text);
+	COMPARE("%s %-8s|", text, text);
+
+	CAsyncLog::uninit();
+
+	//the lines of one COMPARE follow each other
+	std::vector<std::string> messages;
+	std::string contents = sink->contents();
+	size_t pos = 0;
+	while ((pos = contents.find("msg|", pos)) != std::string::npos)
+	{
+		size_t end = contents.find('\n', pos);
+		messages.push_back(contents.substr(pos, end - pos));
+		pos = end;
+	}
+
+	bool ok = messages.size() == 24;
+	for (size_t i = 0; i + 1 < messages.size(); i += 2)
+	{
+		bool same = messages[i] == messages[i + 1];
+		ok &= same;
+		std::cout << (same ? "PASS " : "FAIL ") << messages[i];
+		if (!same)
+			std::cout << " deferred: " << messages[i + 1];
+		std::cout << "\n";
+	}
+
+	std::cout << (ok ? "all passed" : "FAILED") << "\n";
+	return ok ? 0 : 1;
+}
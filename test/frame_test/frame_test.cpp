@@ -0,0 +1,194 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "async_log.h"
+#include "event_loop.h"
+#include "tcp_connection.h"
+#include "test_helper.h"
+
+using namespace net;
+
+//The Buffer view accessors, and TcpConnection::setFrameCallback() over a
+//socketpair: frames split across reads arrive whole, several frames in one
+//read arrive in order from that read, a frame over maxFrameSize closes the
+//connection, and a view points into the input buffer and keeps its bytes
+//until the callback returns.
+//
+//usage: frameTest
+
+#ifndef WIN32
+
+static std::string lengthFrame(const std::string& payload)
+{
+	uint32_t len = htonl(static_cast<uint32_t>(payload.size()));
+	return std::string(reinterpret_cast<const char*>(&len), sizeof(len)) + payload;
+}
+
+static bool bufferViews()
+{
+	Buffer buffer;
+	buffer.append(std::string("one\r\ntwo\nthr"));
+	std::string_view line;
+	bool ok = check("peekView sees the bytes in place", buffer.peekView(3) == "one" && buffer.peekView(3).data() == buffer.peek());
+	ok &= check("retrieveLineView strips \\r\\n", buffer.retrieveLineView(&line) && line == "one");
+	ok &= check("retrieveLineView strips \\n", buffer.retrieveLineView(&line) && line == "two");
+	ok &= check("an incomplete line retrieves nothing", !buffer.retrieveLineView(&line) && buffer.toStringView() == "thr");
+	std::string_view rest = buffer.retrieveAsView(2);
+	ok &= check("retrieveAsView returns what it retrieved", rest == "th" && buffer.toStringView() == "r");
+	buffer.retrieveAll();
+
+	std::string frame = lengthFrame("payload");
+	buffer.append(frame.data(), frame.size() - 1);
+	std::string_view payload;
+	ok &= check("an incomplete frame retrieves nothing", !buffer.retrieveFrameView(&payload) && buffer.readableBytes() == frame.size() - 1);
+	buffer.append(frame.data() + frame.size() - 1, 1);
+	ok &= check("retrieveFrameView skips the length prefix", buffer.retrieveFrameView(&payload) && payload == "payload" && buffer.readableBytes() == 0);
+	return ok;
+}
+
+struct Frames
+{
+	std::vector<std::string> payloads;
+	std::vector<Timestamp>   receiveTimes;
+	bool                     inPlace = true;     // every view pointed into the input buffer
+	bool                     kept = true;        // and kept its bytes through a send()
+};
+
+class Fixture
+{
+public:
+	Fixture(TcpConnection::Framing framing, size_t maxFrameSize)
+	{
+		if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds_) < 0)
+			std::cout << "socketpair failed: " << strerror(errno) << "\n";
+		conn_.reset(new TcpConnection(&loop_, "frame", fds_[0], InetAddress(), InetAddress()));
+		conn_->setConnectionCallback([](const TcpConnectionPtr&) {});
+		conn_->setCloseCallback([](const TcpConnectionPtr&) {});
+		conn_->setFrameCallback([this](const TcpConnectionPtr& conn, std::string_view frame, Timestamp receiveTime)
+		{
+			Buffer* input = conn->inputBuffer();
+			const char* begin = input->peek() - input->prependableBytes();
+			frames_.inPlace &= frame.data() >= begin && frame.data() + frame.size() <= begin + input->internalCapacity();
+			std::string copy(frame);
+			//writing output must not touch the input buffer the view points into
+			conn->send(std::string("ack"));
+			frames_.kept &= frame == copy;
+			frames_.payloads.push_back(copy);
+			frames_.receiveTimes.push_back(receiveTime);
+		}, framing, maxFrameSize);
+		conn_->connectEstablished();
+	}
+
+	~Fixture()
+	{
+		conn_->forceClose();
+		loop_.queueInLoop([this] { loop_.quit(); });
+		loop_.loop();
+		conn_->connectDestroyed();
+		::close(fds_[1]);
+	}
+
+	//the peer writes @c bytes, then the loop runs until the connection read them
+	void peerWrites(const std::string& bytes)
+	{
+		if (::write(fds_[1], bytes.data(), bytes.size()) != static_cast<ssize_t>(bytes.size()))
+			std::cout << "write failed: " << strerror(errno) << "\n";
+		loop_.runAfter(20 * 1000, [this] { loop_.quit(); });
+		loop_.loop();
+	}
+
+	const Frames& frames() const { return frames_; }
+	bool disconnected() const { return conn_->disconnected(); }
+
+private:
+	int              fds_[2];
+	EventLoop        loop_;
+	TcpConnectionPtr conn_;
+	Frames           frames_;
+};
+
+static bool lengthFrames()
+{
+	Fixture f(TcpConnection::kFrameLength32, 1024);
+	std::string three = lengthFrame("alpha") + lengthFrame("") + lengthFrame("gamma");
+	f.peerWrites(three);
+	const Frames& frames = f.frames();
+	bool ok = check("several frames in one read arrive in order",
+	                frames.payloads == std::vector<std::string>({ "alpha", "", "gamma" }));
+	ok &= check("they come from the same read", frames.receiveTimes.size() == 3
+	            && frames.receiveTimes[0] == frames.receiveTimes[1] && frames.receiveTimes[1] == frames.receiveTimes[2]);
+
+	//cut inside the length prefix, then inside the payload
+	std::string split = lengthFrame(std::string(500, 's'));
+	f.peerWrites(split.substr(0, 2));
+	f.peerWrites(split.substr(2, 200));
+	bool none = frames.payloads.size() == 3;
+	f.peerWrites(split.substr(202));
+	ok &= check("a frame split across reads arrives once, whole",
+	            none && frames.payloads.size() == 4 && frames.payloads[3] == std::string(500, 's'));
+	ok &= check("views point into the input buffer and keep their bytes", frames.inPlace && frames.kept);
+	ok &= check("frames within maxFrameSize keep the connection", !f.disconnected());
+	return ok;
+}
+
+static bool lineFrames()
+{
+	Fixture f(TcpConnection::kFrameLines, 1024);
+	f.peerWrites("one\r\ntwo\nth");
+	f.peerWrites("ree\n");
+	bool ok = check("lines arrive split and together, without terminators",
+	                f.frames().payloads == std::vector<std::string>({ "one", "two", "three" }));
+	return ok;
+}
+
+static bool oversized()
+{
+	//one EventLoop per thread at a time, so one fixture at a time
+	bool ok = true;
+	{
+		//the prefix announces more than maxFrameSize, no need to wait for the payload
+		Fixture prefix(TcpConnection::kFrameLength32, 1024);
+		std::string frame = lengthFrame(std::string(4096, 'x'));
+		prefix.peerWrites(frame.substr(0, 100));
+		ok &= check("a length prefix over maxFrameSize closes the connection",
+		            prefix.disconnected() && prefix.frames().payloads.empty());
+	}
+	{
+		Fixture line(TcpConnection::kFrameLines, 1024);
+		line.peerWrites(std::string(2048, 'x'));
+		ok &= check("a line longer than maxFrameSize closes the connection",
+		            line.disconnected() && line.frames().payloads.empty());
+	}
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	CAsyncLog::init();
+	//the oversized frames log an error each, on purpose
+	CAsyncLog::setLevel(LOG_LEVEL_FATAL);
+
+	bool ok = true;
+	ok &= bufferViews();
+	ok &= lengthFrames();
+	ok &= lineFrames();
+	ok &= oversized();
+
+	CAsyncLog::uninit();
+
+	std::cout << (ok ? "all passed" : "FAILED") << "\n";
+	return ok ? 0 : 1;
+}
+
+#else
+
+int main(int argc, char** argv)
+{
+	std::cout << "frameTest needs socketpair(2), not supported on Windows\n";
+	return 0;
+}
+
+#endif
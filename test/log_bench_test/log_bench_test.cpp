@@ -0,0 +1,235 @@
+#include <chrono>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "async_log.h"
+
+using namespace base;
+
+//Measures the producer side cost of one log line: the formatting the
+//old CAsyncLog::output did (two vsnprintf, several std::string and an
+//ostringstream per line, then a locked std::list push and a notify),
+//against the current CAsyncLog::output writing into the thread's ring and
+//LOGI_DEFER, which only copies the arguments and leaves the formatting
+//to the writer thread. The hex dump of a packet is measured the same way:
+//the old outputBinary (ostringstream, strcat and a static sprintf buffer)
+//against the table lookup straight into the ring.
+//
+//usage: logBenchTest [lines]
+
+static std::list<std::string> g_legacyLines;
+static std::mutex g_legacyMutex;
+static std::condition_variable g_legacyCv;
+
+static void legacyPrefix(long nLevel, std::string& strPrefix)
+{
+	strPrefix = nLevel == LOG_LEVEL_INFO ? "[INFO]" : "[WARN]";
+
+	char szTime[64] = { 0 };
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	time_t now = ts.tv_sec;
+	tm time;
+	localtime_r(&now, &time);
+	snprintf(szTime, sizeof(szTime), "[%04d-%02d-%02d %02d:%02d:%02d:%03d]", time.tm_year + 1900, time.tm_mon + 1, time.tm_mday,
+		time.tm_hour, time.tm_min, time.tm_sec, (int)(ts.tv_nsec / 1000000));
+	strPrefix += "[";
+	strPrefix += szTime;
+	strPrefix += "]";
+
+	char szThreadID[32] = { 0 };
+	std::ostringstream osThreadID;
+	osThreadID << std::this_thread::get_id();
+	snprintf(szThreadID, sizeof(szThreadID), "[%s]", osThreadID.str().c_str());
+	strPrefix += szThreadID;
+}
+
+static bool legacyOutput(long nLevel, const char* pszFileName, int nLineNo, const char* pszFmt, ...)
+{
+	std::string strLine;
+	legacyPrefix(nLevel, strLine);
+
+	char szFileName[512] = { 0 };
+	snprintf(szFileName, sizeof(szFileName), "[%s:%d]", pszFileName, nLineNo);
+	strLine += szFileName;
+
+	std::string strLogMsg;
+	va_list ap;
+	va_start(ap, pszFmt);
+	int nLogMsgLength = vsnprintf(nullptr, 0, pszFmt, ap);
+	va_end(ap);
+	if ((int)strLogMsg.capacity() < nLogMsgLength + 1)
+		strLogMsg.resize(nLogMsgLength + 1);
+	va_list aq;
+	va_start(aq, pszFmt);
+	vsnprintf((char*)strLogMsg.data(), strLogMsg.capacity(), pszFmt, aq);
+	va_end(aq);
+
+	std::string strMsgFormal;
+	strMsgFormal.append(strLogMsg.c_str(), nLogMsgLength);
+	strLine += strMsgFormal;
+	strLine += "\n";
+
+	std::lock_guard<std::mutex> lock_guard(g_legacyMutex);
+	g_legacyLines.push_back(strLine);
+	g_legacyCv.notify_one();
+	return true;
+}
+
+static const char* legacyUllto4Str(int n)
+{
+	static char buf[64 + 1];
+	memset(buf, 0, sizeof(buf));
+	sprintf(buf, "%06u", n);
+	return buf;
+}
+
+static char* legacyFormLog(int& index, char* szbuf, size_t size_buf, const unsigned char* buffer, size_t size)
+{
+	size_t len = 0;
+	size_t lsize = 0;
+	size_t headlen = 0;
+	char szhead[64 + 1] = { 0 };
+	char szchar[17] = "0123456789abcdef";
+	while (size > lsize && len + 10 < size_buf)
+	{
+		if (lsize % 32 == 0)
+		{
+			if (0 != headlen)
+			{
+				szbuf[len++] = '\n';
+			}
+
+			memset(szhead, 0, sizeof(szhead));
+			strncpy(szhead, legacyUllto4Str(index++), sizeof(szhead) - 1);
+			headlen = strlen(szhead);
+			szhead[headlen++] = ' ';
+
+			strcat(szbuf, szhead);
+			len += headlen;
+		}
+		if (lsize % 16 == 0 && 0 != headlen)
+			szbuf[len++] = ' ';
+		szbuf[len++] = szchar[(buffer[lsize] >> 4) & 0xf];
+		szbuf[len++] = szchar[(buffer[lsize]) & 0xf];
+		lsize++;
+	}
+	szbuf[len++] = '\n';
+	szbuf[len++] = '\0';
+	return szbuf;
+}
+
+static bool legacyOutputBinary(const unsigned char* buffer, size_t size)
+{
+	std::ostringstream os;
+
+	static const size_t PRINTSIZE = 512;
+	char szbuf[PRINTSIZE * 3 + 8];
+
+	size_t lsize = 0;
+	size_t lprintbufsize = 0;
+	int index = 0;
+	os << "address[" << (long)buffer << "] size[" << size << "] \n";
+	while (size > lsize)
+	{
+		memset(szbuf, 0, sizeof(szbuf));
+		lprintbufsize = (size - lsize);
+		lprintbufsize = lprintbufsize > PRINTSIZE ? PRINTSIZE : lprintbufsize;
+		legacyFormLog(index, szbuf, sizeof(szbuf), buffer + lsize, lprintbufsize);
+		os << szbuf;
+		lsize += lprintbufsize;
+	}
+
+	std::lock_guard<std::mutex> lock_guard(g_legacyMutex);
+	g_legacyLines.push_back(os.str());
+	g_legacyCv.notify_one();
+	return true;
+}
+
+template <typename Func>
+static double nsPerLine(int lines, Func func)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < lines; ++i)
+		func(i);
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(end - start).count() / lines;
+}
+
+int main(int argc, char** argv)
+{
+	int lines = argc > 1 ? atoi(argv[1]) : 200000;
+
+	double legacy = nsPerLine(lines, [](int i)
+	{
+		legacyOutput(LOG_LEVEL_INFO, __FILE__, __LINE__, "request %d from %s took %.3f ms", i, "10.0.0.1:5000", i * 0.25);
+	});
+	g_legacyLines.clear();
+
+	//lines logged before init() wait in the ring, so the writer thread does
+	//not share the CPU with the timed loop; the ring must hold all of them
+	CAsyncLog::setThreadBufferSize(512 * 1024 * 1024);
+	double current = nsPerLine(lines, [](int i)
+	{
+		LOGI("request %d from %s took %.3f ms", i, "10.0.0.1:5000", i * 0.25);
+	});
+
+	//no sinks: the writer drains the ring and discards the lines
+	const std::vector<std::shared_ptr<LogSink>> noSinks;
+	CAsyncLog::init(noSinks);
+	CAsyncLog::uninit();
+
+	//a fresh thread gets a fresh ring for the deferred lines
+	double deferred = 0;
+	std::thread producer([lines, &deferred]
+	{
+		deferred = nsPerLine(lines, [](int i)
+		{
+			LOGI_DEFER("request %d from %s took %.3f ms", i, "10.0.0.1:5000", i * 0.25);
+		});
+	});
+	producer.join();
+	CAsyncLog::init(noSinks);
+	CAsyncLog::uninit();
+
+	unsigned char packet[256];
+	for (size_t i = 0; i < sizeof(packet); ++i)
+		packet[i] = static_cast<unsigned char>(i * 7);
+	double legacyBinary = nsPerLine(lines, [&packet](int)
+	{
+		legacyOutputBinary(packet, sizeof(packet));
+	});
+	g_legacyLines.clear();
+
+	double binary = 0;
+	std::thread dumper([lines, &packet, &binary]
+	{
+		binary = nsPerLine(lines, [&packet](int)
+		{
+			LOG_DEBUG_BIN(packet, sizeof(packet));
+		});
+	});
+	dumper.join();
+	CAsyncLog::init(noSinks);
+	CAsyncLog::uninit();
+
+	std::cerr << "lines=" << lines
+		<< " legacy=" << legacy << "ns/line"
+		<< " current=" << current << "ns/line"
+		<< " deferred=" << deferred << "ns/line\n"
+		<< "hexdump of " << sizeof(packet) << " bytes:"
+		<< " legacy=" << legacyBinary << "ns/dump"
+		<< " current=" << binary << "ns/dump\n";
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include "async_log.h"
+#include "log_sink.h"
+
+using namespace base;
+
+//Reaches each sampled or rate limited call site while its level is off,
+//then again with the level on, and checks the first line that is on still
+//gets through: a line below the current level must not be counted, take
+//the interval or use up a token. A binary dump is DEBUG and is not written
+//while DEBUG is off.
+//
+//usage: logLimitTest
+
+//one call site each, every call reaches the same static state
+static void everyN(const char* pszWhen)
+{
+	LOGI_EVERY_N(3, "every_n|%s", pszWhen);
+}
+
+static void everyMs(const char* pszWhen)
+{
+	LOGI_EVERY_MS(60 * 1000, "every_ms|%s", pszWhen);
+}
+
+static void limited(const char* pszWhen)
+{
+	LOGI_LIMITED(1, 1, "limited|%s", pszWhen);
+}
+
+static bool check(const std::string& contents, const char* pszLine)
+{
+	bool found = contents.find(pszLine) != std::string::npos;
+	std::cout << (found ? "PASS " : "FAIL ") << pszLine << "\n";
+	return found;
+}
+
+int main(int argc, char** argv)
+{
+	std::shared_ptr<MemoryLogSink> sink = std::make_shared<MemoryLogSink>(64 * 1024);
+	CAsyncLog::init({ sink });
+
+	CAsyncLog::setLevel(LOG_LEVEL_WARNING);
+	everyN("off");
+	everyMs("off");
+	limited("off");
+	bool bDumped = LOG_DEBUG_BIN(reinterpret_cast<const unsigned char*>("dump"), 4);
+
+	CAsyncLog::setLevel(LOG_LEVEL_INFO);
+	everyN("on");
+	everyMs("on");
+	limited("on");
+
+	CAsyncLog::uninit();
+
+	std::string contents = sink->contents();
+	bool ok = true;
+	ok &= check(contents, "every_n|on");
+	ok &= check(contents, "every_ms|on");
+	ok &= check(contents, "limited|on");
+	bool bNoDump = !bDumped && contents.find("size[4]") == std::string::npos;
+	std::cout << (bNoDump ? "PASS " : "FAIL ") << "no binary dump below DEBUG\n";
+	ok &= bNoDump;
+
+	std::cout << (ok ? "all passed" : "FAILED") << "\n";
+	return ok ? 0 : 1;
+}
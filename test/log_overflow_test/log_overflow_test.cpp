@@ -0,0 +1,174 @@
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "async_log.h"
+#include "log_sink.h"
+#include "test_helper.h"
+
+using namespace base;
+
+//Holds the writer thread in a sink while one thread fills its ring, then
+//checks what each overflow policy did with the lines that did not fit:
+//BLOCK keeps them all and sleeps meanwhile instead of spinning, DROP and
+//DROP_LOW_LEVELS count them and the writer reports the count in its
+//"N log lines dropped" line.
+//
+//usage: logOverflowTest
+
+#ifndef WIN32
+
+static const int kLines = 2000;
+static const int kWarnings = 20;
+
+//keeps what it is given, write() waits while the gate is closed
+class GateSink : public LogSink
+{
+public:
+	void write(const LogBatch& batch) override
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		entered_ = true;
+		cond_.notify_all();
+		cond_.wait(lock, [this] { return open_; });
+		text_.append(batch.data, batch.length);
+	}
+
+	void waitEntered()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_.wait(lock, [this] { return entered_; });
+	}
+
+	void open()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		open_ = true;
+		cond_.notify_all();
+	}
+
+	std::string text()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return text_;
+	}
+
+private:
+	std::mutex              mutex_;
+	std::condition_variable cond_;
+	bool                    entered_ = false;
+	bool                    open_ = false;
+	std::string             text_;
+};
+
+struct Result
+{
+	int      lines = 0;         // "line|" lines written
+	int      warnings = 0;      // "warning|" lines written
+	uint64_t dropped = 0;       // droppedCount() grew by
+	uint64_t reported = 0;      // sum of the "N log lines dropped" lines
+	bool     infoReported = false;
+	int64_t  producerCpuUs = 0;
+};
+
+static std::ostream& operator<<(std::ostream& os, const Result& result)
+{
+	return os << "lines " << result.lines << " warnings " << result.warnings
+	          << " dropped " << result.dropped << " reported " << result.reported
+	          << " producer cpu " << result.producerCpuUs / 1000 << "ms";
+}
+
+static size_t countOf(const std::string& text, const char* marker)
+{
+	size_t count = 0;
+	for (size_t pos = text.find(marker); pos != std::string::npos; pos = text.find(marker, pos + 1))
+		++count;
+	return count;
+}
+
+static int64_t threadCpuUs()
+{
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+//a new thread gets a new 64KB ring, the writer is held until the gate opens 200ms later
+static Result run(LOG_OVERFLOW_POLICY policy)
+{
+	std::shared_ptr<GateSink> sink = std::make_shared<GateSink>();
+	CAsyncLog::setOverflowPolicy(policy);
+	CAsyncLog::setThreadBufferSize(64 * 1024);
+	CAsyncLog::init({ sink });
+	uint64_t droppedBefore = CAsyncLog::droppedCount();
+
+	Result result;
+	std::thread producer([&sink, &result]
+	{
+		LOGI("first");
+		sink->waitEntered();
+		int64_t start = threadCpuUs();
+		for (int i = 0; i < kLines; ++i)
+			LOGI("line|%04d %s", i, "................................................................................");
+		for (int i = 0; i < kWarnings; ++i)
+			LOGW("warning|%02d", i);
+		result.producerCpuUs = threadCpuUs() - start;
+	});
+
+	sink->waitEntered();
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	sink->open();
+	producer.join();
+	CAsyncLog::uninit();
+
+	std::string text = sink->text();
+	result.lines = static_cast<int>(countOf(text, "line|"));
+	result.warnings = static_cast<int>(countOf(text, "warning|"));
+	result.dropped = CAsyncLog::droppedCount() - droppedBefore;
+	for (size_t pos = text.find(" log lines dropped"); pos != std::string::npos; pos = text.find(" log lines dropped", pos + 1))
+	{
+		size_t start = text.rfind(']', pos) + 1;
+		result.reported += strtoull(text.c_str() + start, nullptr, 10);
+		result.infoReported |= text.compare(text.find('(', pos), 6, "(info ") == 0;
+	}
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	bool ok = true;
+
+	//the producer waits about 200ms for the writer, sleeping rather than spinning
+	Result block = run(LOG_OVERFLOW_BLOCK);
+	ok &= check("block keeps every line", block.lines == kLines && block.warnings == kWarnings && block.dropped == 0 && block.reported == 0, block);
+	ok &= check("block sleeps while it waits", block.producerCpuUs < 50 * 1000, block);
+
+	Result drop = run(LOG_OVERFLOW_DROP);
+	ok &= check("drop counts what it drops", drop.dropped > 0 && drop.lines + drop.warnings + static_cast<int>(drop.dropped) == kLines + kWarnings, drop);
+	ok &= check("drop is reported", drop.reported == drop.dropped, drop);
+
+	//INFO lines stop at three quarters of the ring, the warnings still fit
+	Result lowLevels = run(LOG_OVERFLOW_DROP_LOW_LEVELS);
+	ok &= check("drop low levels keeps warnings", lowLevels.warnings == kWarnings && lowLevels.lines + static_cast<int>(lowLevels.dropped) == kLines, lowLevels);
+	ok &= check("drop low levels is reported per level", lowLevels.dropped > 0 && lowLevels.reported == lowLevels.dropped && lowLevels.infoReported, lowLevels);
+
+	std::cout << (ok ? "all passed" : "FAILED") << "\n";
+	return ok ? 0 : 1;
+}
+
+#else
+
+int main(int argc, char** argv)
+{
+	std::cout << "logOverflowTest is not supported on Windows\n";
+	return 0;
+}
+
+#endif
@@ -0,0 +1,76 @@
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include "async_log.h"
+#include "platform.h"
+
+#ifndef WIN32
+#include <sys/wait.h>
+#endif
+
+using namespace base;
+
+//Recovers the log lines a crashed process left in its ring files.
+//
+//usage: logRecoverTest <dir>   writes the lines found in <dir> to stdout
+//       logRecoverTest         self test: a child process logs into ring
+//                              files under /tmp and dies in LOGF before the
+//                              writer runs, then the parent recovers them,
+//                              the LOGI_DEFER line formatted from its site
+
+static const int kChildLines = 1000;
+
+int main(int argc, char** argv)
+{
+	if (argc > 1)
+	{
+		std::string strText;
+		size_t nLines = CAsyncLog::recoverCrashBuffers(argv[1], &strText);
+		fwrite(strText.data(), 1, strText.size(), stdout);
+		std::cerr << nLines << " lines recovered\n";
+		return 0;
+	}
+
+#ifdef WIN32
+	std::cerr << "the self test needs fork()\n";
+	return 1;
+#else
+	char szDir[] = "/tmp/logRecoverTest.XXXXXX";
+	if (mkdtemp(szDir) == nullptr)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		//no init(): nothing is written, every line is still in the ring when LOGF crashes
+		CAsyncLog::setCrashBufferDir(szDir);
+		for (int i = 0; i < kChildLines; ++i)
+			LOGI("line %d before the crash", i);
+		LOGI_DEFER("deferred line %d", kChildLines);
+		LOGF("giving up");
+		return 0;
+	}
+
+	int status;
+	waitpid(pid, &status, 0);
+	std::string strText;
+	size_t nLines = CAsyncLog::recoverCrashBuffers(szDir, &strText);
+	//the ring files and the sites file are gone
+	bool bRemoved = rmdir(szDir) == 0;
+
+	//every LOGI line and the deferred one, formatted from the saved site, the LOGF line was written before the crash
+	size_t nExpected = kChildLines + 1;
+	bool bOk = WIFSIGNALED(status) && nLines == nExpected && bRemoved
+		&& strText.find("line 0 before the crash") != std::string::npos
+		&& strText.find("line 999 before the crash") != std::string::npos
+		&& strText.find("]deferred line 1000\n") != std::string::npos
+		&& strText.find("<deferred line") == std::string::npos;
+	std::cerr << strText.substr(0, strText.find('\n') + 1)
+		<< nLines << " of " << nExpected << " lines recovered: " << (bOk ? "ok" : "FAILED") << "\n";
+	return bOk ? 0 : 1;
+#endif
+}
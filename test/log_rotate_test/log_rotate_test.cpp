@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include "log_sink.h"
+#include "platform.h"
+
+using namespace base;
+
+//Writes batches straight to a FileLogSink that rolls by size and checks
+//what retention leaves behind: how many files, which batches they hold,
+//no pre-opened ".next" file and no file descriptor left open.
+//
+//usage: logRotateTest
+
+#ifndef WIN32
+
+static const size_t kBatchSize = 1024;
+static const int kBatches = 20;
+static const int64_t kRollSize = 4 * kBatchSize;
+
+struct LogFile
+{
+	std::string name;
+	std::string firstLine;
+	int64_t     size;
+};
+
+static std::vector<LogFile> listFiles(const std::string& dir, std::vector<std::string>* others)
+{
+	std::vector<LogFile> files;
+	DIR* d = opendir(dir.c_str());
+	while (struct dirent* entry = readdir(d))
+	{
+		std::string name(entry->d_name);
+		if (name == "." || name == "..")
+			continue;
+		if (name.size() < 4 || name.compare(name.size() - 4, 4, ".log") != 0)
+		{
+			others->push_back(name);
+			continue;
+		}
+
+		std::string path = dir + "/" + name;
+		char line[64] = { 0 };
+		FILE* f = fopen(path.c_str(), "r");
+		if (f != nullptr)
+		{
+			if (fgets(line, sizeof(line), f) == nullptr)
+				line[0] = 0;
+			fclose(f);
+		}
+		struct stat st;
+		stat(path.c_str(), &st);
+		files.push_back(LogFile{ name, std::string(line, strcspn(line, " ")), static_cast<int64_t>(st.st_size) });
+	}
+	closedir(d);
+	std::sort(files.begin(), files.end(), [](const LogFile& a, const LogFile& b) { return a.firstLine < b.firstLine; });
+	return files;
+}
+
+static int openDescriptors()
+{
+	int count = 0;
+	DIR* d = opendir("/proc/self/fd");
+	while (readdir(d) != nullptr)
+		++count;
+	closedir(d);
+	return count;
+}
+
+//writes kBatches batches of kBatchSize bytes, "bNN ..." each
+static void writeBatches(const std::string& dir, const LogFileOptions& options)
+{
+	FileLogSink sink(dir + "/rotate", options);
+	for (int i = 0; i < kBatches; ++i)
+	{
+		char head[16];
+		snprintf(head, sizeof(head), "b%02d ", i);
+		std::string line(head);
+		line.append(kBatchSize - line.size() - 1, 'x');
+		line += '\n';
+		LogLineEnd end{ line.size(), LOG_LEVEL_INFO };
+		LogBatch batch{ line.data(), line.size(), &end, 1, 0 };
+		sink.write(batch);
+	}
+}
+
+static bool runCase(const char* name, const LogFileOptions& options, const std::vector<std::string>& expected)
+{
+	char dir[] = "/tmp/logRotateTest.XXXXXX";
+	if (mkdtemp(dir) == nullptr)
+	{
+		perror("mkdtemp");
+		return false;
+	}
+
+	int fdsBefore = openDescriptors();
+	writeBatches(dir, options);
+	int fdsAfter = openDescriptors();
+
+	std::vector<std::string> others;
+	std::vector<LogFile> files = listFiles(dir, &others);
+	std::vector<std::string> firstLines;
+	bool fullFiles = true;
+	for (const LogFile& file : files)
+	{
+		firstLines.push_back(file.firstLine);
+		fullFiles &= file.size == kRollSize;
+	}
+
+	bool ok = firstLines == expected && fullFiles && others.empty() && fdsBefore == fdsAfter;
+	std::cout << (ok ? "PASS " : "FAIL ") << name << " files:";
+	for (const LogFile& file : files)
+		std::cout << " " << file.name << "(" << file.size << ")";
+	for (const std::string& other : others)
+		std::cout << " unexpected " << other;
+	std::cout << " fds " << fdsBefore << "->" << fdsAfter << "\n";
+
+	for (const LogFile& file : files)
+		remove((std::string(dir) + "/" + file.name).c_str());
+	for (const std::string& other : others)
+		remove((std::string(dir) + "/" + other).c_str());
+	rmdir(dir);
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	bool ok = true;
+
+	//20 batches in files of 4 make 5 files, all started in the same second
+	LogFileOptions all;
+	all.rollSize = kRollSize;
+	ok &= runCase("roll by size", all, { "b00", "b04", "b08", "b12", "b16" });
+
+	LogFileOptions byCount = all;
+	byCount.maxFiles = 3;
+	ok &= runCase("maxFiles", byCount, { "b08", "b12", "b16" });
+
+	LogFileOptions byBytes = all;
+	byBytes.maxTotalBytes = 10 * 1024;
+	ok &= runCase("maxTotalBytes", byBytes, { "b12", "b16" });
+
+	std::cout << (ok ? "all passed" : "FAILED") << "\n";
+	return ok ? 0 : 1;
+}
+
+#else
+
+int main(int argc, char** argv)
+{
+	std::cout << "logRotateTest is not supported on Windows\n";
+	return 0;
+}
+
+#endif
@@ -0,0 +1,148 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <string.h>
+#include "async_log.h"
+#include "event_loop.h"
+#include "socketsOps.h"
+#include "tcp_connection.h"
+#include "timestamp.h"
+
+using namespace net;
+
+//Measures how long work handed on by a timer callback waits for the
+//loop. A functor queued with queueInLoop() or queueAtIterationEnd() from
+//a timer must run in the same iteration, not a poll timeout (100ms) later.
+//The same goes for an echo through a connection with receive coalescing
+//and auto-cork: the window's timer delivers the input, and the corked
+//reply must go out at the end of that iteration.
+//
+//usage: loopLatencyTest
+
+static const int kRounds = 20;
+static const int64_t kMaxDelayUs = 5000;
+
+//the slowest of kRounds timer -> queued functor hand-overs, in microseconds
+static int64_t timerHandOver(bool atIterationEnd)
+{
+	EventLoop loop;
+	int64_t worst = 0;
+	int round = 0;
+	std::function<void()> arm;
+	arm = [&]
+	{
+		loop.runAfter(1000, [&]
+		{
+			Timestamp fired = Timestamp::now();
+			auto handOver = [&, fired]
+			{
+				int64_t delay = Timestamp::now().microSecondsSinceEpoch() - fired.microSecondsSinceEpoch();
+				if (delay > worst)
+					worst = delay;
+				if (++round < kRounds)
+					arm();
+				else
+					loop.quit();
+			};
+			if (atIterationEnd)
+				loop.queueAtIterationEnd(handOver);
+			else
+				loop.queueInLoop(handOver);
+		});
+	};
+	arm();
+	loop.loop();
+	return worst;
+}
+
+#ifndef WIN32
+
+static const int64_t kCoalesceWindowUs = 2000;
+static const int kEchoRounds = 50;
+
+//average round trip of small messages echoed with coalescing and auto-cork on, in microseconds
+static int64_t coalescedEcho()
+{
+	int fds[2];
+	if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+	{
+		std::cout << "socketpair failed: " << strerror(errno) << "\n";
+		return -1;
+	}
+	SocketsOps::setNonBlockAndCloseOnExec(fds[0]);
+
+	EventLoop loop;
+	TcpConnectionPtr conn(new TcpConnection(&loop, "echo", fds[0], InetAddress(), InetAddress()));
+	conn->setConnectionCallback([](const TcpConnectionPtr&) {});
+	conn->setCloseCallback([](const TcpConnectionPtr&) {});
+	conn->setMessageCallback([](const TcpConnectionPtr& c, Buffer* buffer, Timestamp)
+	{
+		c->send(buffer->retrieveAllAsString());
+	});
+	conn->connectEstablished();
+	conn->setAutoCork(true);
+	conn->setReceiveCoalescing(kCoalesceWindowUs, 64 * 1024);
+
+	//blocking client on the other end
+	int64_t total = 0;
+	std::thread client([&]
+	{
+		char reply[64];
+		for (int i = 0; i < kEchoRounds; ++i)
+		{
+			int64_t start = Timestamp::now().microSecondsSinceEpoch();
+			if (::write(fds[1], "ping", 4) != 4)
+				break;
+			size_t received = 0;
+			while (received < 4)
+			{
+				ssize_t n = ::read(fds[1], reply + received, sizeof(reply) - received);
+				if (n <= 0)
+					break;
+				received += static_cast<size_t>(n);
+			}
+			total += Timestamp::now().microSecondsSinceEpoch() - start;
+		}
+		loop.queueInLoop([&loop] { loop.quit(); });
+	});
+	loop.loop();
+	client.join();
+
+	conn->forceClose();
+	loop.queueInLoop([&loop] { loop.quit(); });
+	loop.loop();
+	conn->connectDestroyed();
+	::close(fds[1]);
+	return total / kEchoRounds;
+}
+
+#endif
+
+int main(int argc, char** argv)
+{
+	CAsyncLog::init();
+	CAsyncLog::setLevel(LOG_LEVEL_ERROR);
+
+	bool ok = true;
+	const char* names[] = { "timer -> queueInLoop", "timer -> queueAtIterationEnd" };
+	for (int i = 0; i < 2; ++i)
+	{
+		int64_t worst = timerHandOver(i == 1);
+		bool passed = worst < kMaxDelayUs;
+		ok &= passed;
+		std::cout << (passed ? "PASS " : "FAIL ") << names[i] << " worst=" << worst << "us\n";
+	}
+
+#ifndef WIN32
+	//the window and the millisecond timer tick, plus scheduling
+	int64_t echo = coalescedEcho();
+	bool echoPassed = echo >= 0 && echo < kCoalesceWindowUs + kMaxDelayUs;
+	ok &= echoPassed;
+	std::cout << (echoPassed ? "PASS " : "FAIL ") << "coalesced echo with auto-cork average=" << echo << "us\n";
+#endif
+
+	CAsyncLog::uninit();
+
+	std::cout << (ok ? "all passed" : "FAILED") << "\n";
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,163 @@
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "async_log.h"
+#include "event_loop.h"
+#include "tcp_connection.h"
+#include "test_helper.h"
+
+using namespace net;
+
+//Priority lanes on the wire, over loopback TCP: a bulk message is written
+//partly before the peer stalls, then a second bulk message, droppable
+//messages and a high priority message are queued. The high priority
+//message must follow the rest of the first bulk message, never split it,
+//and overtake the second one; droppable messages go last. With a slow
+//consumer policy only the droppable messages are dropped.
+//
+//usage: priorityLaneTest
+
+#ifndef WIN32
+
+//larger than what the socket buffers take, so the first one is cut
+static const size_t kBulkSize = 32 * 1024 * 1024;
+static const size_t kHighSize = 100;
+static const size_t kDroppableSize = 1024;
+static const int kDroppables = 10;
+
+struct Outcome
+{
+	std::string runs;           // what arrived, as "<byte>:<count>" runs
+	bool        partial = false;    // the first bulk message was written partly at first
+	int64_t     dropped = 0;
+};
+
+static void appendRun(std::ostringstream& os, char byte, size_t count)
+{
+	if (count > 0)
+		os << (os.tellp() > 0 ? " " : "") << byte << ":" << count;
+}
+
+static Outcome run(bool slowConsumer)
+{
+	Outcome outcome;
+	int fds[2];
+	if (!tcpPair(fds))
+		return outcome;
+
+	EventLoop loop;
+	TcpConnectionPtr conn(new TcpConnection(&loop, "lanes", fds[0], InetAddress(), InetAddress()));
+	conn->setConnectionCallback([](const TcpConnectionPtr&) {});
+	conn->setCloseCallback([](const TcpConnectionPtr&) {});
+	conn->setMessageCallback([](const TcpConnectionPtr&, Buffer* buffer, Timestamp) { buffer->retrieveAll(); });
+	if (slowConsumer)
+	{
+		//output queued longer than 50ms counts as slow
+		SlowConsumerPolicy policy;
+		policy.maxOutputAge = 50 * 1000;
+		policy.checkInterval = 10 * 1000;
+		conn->setSlowConsumerPolicy(policy);
+	}
+	conn->connectEstablished();
+
+	//the peer reads once told to, until EOF
+	std::atomic<bool> go(false);
+	std::atomic<bool> peerDone(false);
+	std::thread peer([&]
+	{
+		while (!go)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		std::ostringstream os;
+		std::vector<char> buf(65536);
+		char byte = 0;
+		size_t count = 0;
+		ssize_t n;
+		while ((n = ::read(fds[1], buf.data(), buf.size())) > 0)
+		{
+			for (ssize_t i = 0; i < n; ++i)
+			{
+				if (buf[i] != byte)
+				{
+					appendRun(os, byte, count);
+					byte = buf[i];
+					count = 0;
+				}
+				++count;
+			}
+		}
+		appendRun(os, byte, count);
+		outcome.runs = os.str();
+		peerDone = true;
+	});
+
+	conn->send(std::string(kBulkSize, 'A'));
+	outcome.partial = conn->stats().outputBytes > 0 && conn->stats().outputBytes < kBulkSize;
+	conn->send(std::string(kBulkSize / 32, 'B'));
+	for (int i = 0; i < kDroppables; ++i)
+		conn->send(std::string(kDroppableSize, 'd'), OutputChain::kPriorityDroppable);
+	conn->send(std::string(kHighSize, 'H'), OutputChain::kPriorityHigh);
+
+	//the peer stalls for a while, then reads everything up to the shutdown
+	loop.runAfter(200 * 1000, [&loop] { loop.quit(); });
+	loop.loop();
+	go = true;
+	conn->shutdown();
+	int ticks = 0;
+	TimerId timer = loop.runEvery(1000, [&]
+	{
+		if (peerDone || ++ticks > 5000)
+			loop.quit();
+	});
+	loop.loop();
+	loop.cancel(timer);
+	if (!peerDone)
+		::shutdown(fds[1], SHUT_RDWR);
+	peer.join();
+
+	outcome.dropped = conn->stats().droppedBytes;
+	conn->forceClose();
+	loop.queueInLoop([&loop] { loop.quit(); });
+	loop.loop();
+	conn->connectDestroyed();
+	::close(fds[1]);
+	return outcome;
+}
+
+int main(int argc, char** argv)
+{
+	CAsyncLog::init();
+	CAsyncLog::setLevel(LOG_LEVEL_ERROR);
+
+	std::ostringstream expected;
+	expected << "A:" << kBulkSize << " H:" << kHighSize << " B:" << kBulkSize / 32;
+	std::string ordered = expected.str();
+	expected << " d:" << kDroppableSize * kDroppables;
+
+	bool ok = true;
+	Outcome lanes = run(false);
+	ok &= check("the first bulk message is written partly before the peer stalls", lanes.partial);
+	ok &= check("high priority overtakes queued output at a message boundary, droppable goes last",
+	            lanes.runs == expected.str(), lanes.runs);
+
+	Outcome slow = run(true);
+	ok &= check("a slow consumer loses the droppable messages and nothing else",
+	            slow.runs == ordered && slow.dropped == static_cast<int64_t>(kDroppableSize * kDroppables), slow.runs);
+
+	CAsyncLog::uninit();
+
+	std::cout << (ok ? "all passed" : "FAILED") << "\n";
+	return ok ? 0 : 1;
+}
+
+#else
+
+int main(int argc, char** argv)
+{
+	std::cout << "priorityLaneTest is not supported on Windows\n";
+	return 0;
+}
+
+#endif
@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "async_log.h"
+#include "event_loop.h"
+#include "tcp_connection.h"
+#include "token_bucket.h"
+#include "test_helper.h"
+
+using namespace net;
+
+//Token bucket rate limits over loopback TCP: the time a transfer takes
+//under a write limit, a read limit and a group limit shared by two
+//connections, that clearing a limit lets a throttled transfer finish at
+//once, and that a group nobody holds any more is forgotten.
+//
+//usage: rateLimitTest
+
+#ifndef WIN32
+
+static const int64_t kRate = 1024 * 1024;
+static const int64_t kBurst = 64 * 1024;
+static const size_t kBytes = 512 * 1024;
+//(kBytes - kBurst) / kRate, the time a limited transfer takes
+static const double kLimitedSeconds = 0.4375;
+
+static double now()
+{
+	return static_cast<double>(Timestamp::now().microSecondsSinceEpoch()) / Timestamp::kMicroSecondsPerSecond;
+}
+
+//a loopback connection, its peer thread reads or writes @c bytes
+class Link
+{
+public:
+	Link(EventLoop* loop, bool peerReads, size_t bytes)
+		: loop_(loop)
+	{
+		if (!tcpPair(fds_))
+			return;
+		conn_.reset(new TcpConnection(loop, "rateLimit", fds_[0], InetAddress(), InetAddress()));
+		conn_->setConnectionCallback([](const TcpConnectionPtr&) {});
+		conn_->setCloseCallback([](const TcpConnectionPtr&) {});
+		conn_->setMessageCallback([this, bytes](const TcpConnectionPtr&, Buffer* buffer, Timestamp)
+		{
+			received_ += buffer->readableBytes();
+			buffer->retrieveAll();
+			if (received_ >= bytes)
+				finished_ = now();
+		});
+		conn_->connectEstablished();
+
+		peer_ = std::thread([this, peerReads, bytes]
+		{
+			std::vector<char> buf(65536, 'r');
+			size_t total = 0;
+			while (total < bytes)
+			{
+				ssize_t n = peerReads ? ::read(fds_[1], buf.data(), buf.size())
+				                      : ::write(fds_[1], buf.data(), std::min(buf.size(), bytes - total));
+				if (n <= 0)
+					break;
+				total += static_cast<size_t>(n);
+			}
+			if (peerReads)
+				finished_ = now();
+		});
+	}
+
+	~Link()
+	{
+		if (!conn_)
+			return;
+		if (finished_ == 0)
+			::shutdown(fds_[1], SHUT_RDWR);
+		peer_.join();
+		conn_->forceClose();
+		loop_->queueInLoop([this] { loop_->quit(); });
+		loop_->loop();
+		conn_->connectDestroyed();
+		::close(fds_[1]);
+	}
+
+	const TcpConnectionPtr& conn() const { return conn_; }
+	double finished() const { return finished_; }
+
+private:
+	EventLoop*          loop_;
+	int                 fds_[2];
+	TcpConnectionPtr    conn_;
+	std::thread         peer_;
+	size_t              received_ = 0;
+	std::atomic<double> finished_{ 0 };
+};
+
+//runs the loop until every link finished, 10s at most, returns the seconds since @c start
+static double waitFor(EventLoop* loop, const std::vector<Link*>& links, double start)
+{
+	int ticks = 0;
+	bool all = false;
+	double last = 0;
+	TimerId timer = loop->runEvery(1000, [&]
+	{
+		all = true;
+		for (Link* link : links)
+		{
+			all &= link->finished() > 0;
+			last = std::max(last, link->finished());
+		}
+		if (all || ++ticks > 10 * 1000)
+			loop->quit();
+	});
+	loop->loop();
+	loop->cancel(timer);
+	return all ? last - start : 10.0;
+}
+
+static bool limited(double seconds)
+{
+	return seconds > kLimitedSeconds * 0.7 && seconds < kLimitedSeconds * 2.5;
+}
+
+static bool writeLimit(EventLoop* loop)
+{
+	Link link(loop, true, kBytes);
+	link.conn()->addWriteLimit(std::make_shared<TokenBucket>(kRate, kBurst));
+	double start = now();
+	link.conn()->send(std::string(kBytes, 'w'));
+	double seconds = waitFor(loop, { &link }, start);
+	bool ok = check("a write limit paces the transfer", limited(seconds), seconds);
+	ok &= check("writes were deferred", link.conn()->stats().writeThrottles > 0, link.conn()->stats().writeThrottles);
+	return ok;
+}
+
+static bool readLimit(EventLoop* loop)
+{
+	double start = now();
+	Link link(loop, false, kBytes);
+	link.conn()->addReadLimit(std::make_shared<TokenBucket>(kRate, kBurst));
+	double seconds = waitFor(loop, { &link }, start);
+	bool ok = check("a read limit paces the transfer", limited(seconds), seconds);
+	ok &= check("reading paused and resumed from the timer", link.conn()->stats().readThrottles > 0 && !link.conn()->stats().readPaused,
+	            link.conn()->stats().readThrottles);
+	return ok;
+}
+
+static bool groupLimit(EventLoop* loop)
+{
+	bool ok = true;
+	{
+		//half the bytes each, together as slow as one connection with all of them
+		Link first(loop, true, kBytes / 2);
+		Link second(loop, true, kBytes / 2);
+		first.conn()->addWriteLimit(TokenBucket::group("tenant", kRate, kBurst));
+		second.conn()->addWriteLimit(TokenBucket::group("tenant", kRate * 100, kBurst * 100));
+		ok &= check("one group shares one bucket", TokenBucket::findGroup("tenant")->rate() == kRate);
+		double start = now();
+		first.conn()->send(std::string(kBytes / 2, 'g'));
+		second.conn()->send(std::string(kBytes / 2, 'g'));
+		double seconds = waitFor(loop, { &first, &second }, start);
+		ok &= check("a group limit caps two connections together", limited(seconds), seconds);
+	}
+	ok &= check("a group nobody holds is forgotten", !TokenBucket::findGroup("tenant"));
+	TokenBucketPtr again = TokenBucket::group("tenant", kRate * 2, kBurst);
+	ok &= check("and comes back anew", again->rate() == kRate * 2);
+	return ok;
+}
+
+static bool clearLimits(EventLoop* loop)
+{
+	//64KB/s would take 15s for 1MB, clearing the limit after 100ms finishes it at once
+	bool ok = true;
+	{
+		Link link(loop, true, 2 * kBytes);
+		link.conn()->addWriteLimit(std::make_shared<TokenBucket>(kBurst, kBurst));
+		double start = now();
+		link.conn()->send(std::string(2 * kBytes, 'c'));
+		TcpConnectionPtr conn = link.conn();
+		loop->runAfter(100 * 1000, [conn] { conn->clearWriteLimits(); });
+		double seconds = waitFor(loop, { &link }, start);
+		ok &= check("clearWriteLimits() resumes deferred writes", seconds < 0.5, seconds);
+	}
+	{
+		double start = now();
+		Link link(loop, false, 2 * kBytes);
+		link.conn()->addReadLimit(std::make_shared<TokenBucket>(kBurst, kBurst));
+		TcpConnectionPtr conn = link.conn();
+		loop->runAfter(100 * 1000, [conn] { conn->clearReadLimits(); });
+		double seconds = waitFor(loop, { &link }, start);
+		ok &= check("clearReadLimits() resumes paused reading", seconds < 0.5, seconds);
+	}
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	CAsyncLog::init();
+	CAsyncLog::setLevel(LOG_LEVEL_ERROR);
+
+	bool ok = true;
+	{
+		EventLoop loop;
+		ok &= writeLimit(&loop);
+		ok &= readLimit(&loop);
+		ok &= groupLimit(&loop);
+		ok &= clearLimits(&loop);
+	}
+
+	CAsyncLog::uninit();
+
+	std::cout << (ok ? "all passed" : "FAILED") << "\n";
+	return ok ? 0 : 1;
+}
+
+#else
+
+int main(int argc, char** argv)
+{
+	std::cout << "rateLimitTest is not supported on Windows\n";
+	return 0;
+}
+
+#endif
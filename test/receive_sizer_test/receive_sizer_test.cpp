@@ -0,0 +1,100 @@
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <unistd.h>
+#include "buffer.h"
+#include "receive_sizer.h"
+#include "test_helper.h"
+
+using namespace net;
+
+//How the input side sizes its reads: the steps AdaptiveReceiveSizer takes
+//up and down and the bounds it keeps to, and how Buffer grows: doubling,
+//copying only the readable bytes, and leaving new storage untouched
+//(DefaultInitAllocator), so a large reserve costs no page faults until
+//read(2) fills it.
+//
+//usage: receiveSizerTest
+
+#ifndef WIN32
+//resident bytes of the process
+static size_t residentBytes()
+{
+	size_t pages = 0, resident = 0;
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (fp != nullptr)
+	{
+		if (fscanf(fp, "%zu %zu", &pages, &resident) != 2)
+			resident = 0;
+		fclose(fp);
+	}
+	return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+#endif
+
+int main(int argc, char** argv)
+{
+	bool ok = true;
+
+	AdaptiveReceiveSizer sizer;
+	ok &= check("starts at kInitial", sizer.guess() == AdaptiveReceiveSizer::kInitial, sizer.guess());
+	sizer.record(sizer.guess());
+	//4 steps up the table: 2K, 4K, 8K, 16K, 32K
+	ok &= check("a full read jumps 4 steps up", sizer.guess() == 32 * 1024, sizer.guess());
+	sizer.record(sizer.guess());
+	ok &= check("never above kMaximum", sizer.guess() == AdaptiveReceiveSizer::kMaximum, sizer.guess());
+
+	sizer.record(100);
+	ok &= check("one small read keeps the guess", sizer.guess() == AdaptiveReceiveSizer::kMaximum, sizer.guess());
+	sizer.record(100);
+	ok &= check("a second small read in a row steps down once", sizer.guess() == 32 * 1024, sizer.guess());
+	sizer.record(100);
+	sizer.record(sizer.guess());
+	ok &= check("a full read cancels a pending step down", sizer.guess() == AdaptiveReceiveSizer::kMaximum, sizer.guess());
+
+	for (int i = 0; i < 200; ++i)
+		sizer.record(1);
+	ok &= check("never below kMinimum", sizer.guess() == AdaptiveReceiveSizer::kMinimum, sizer.guess());
+
+	//below 512 the table steps by 16, so 100 is 112; the initial guess is clamped to the bounds
+	AdaptiveReceiveSizer bounded(100, 1024 * 1024, 8192);
+	ok &= check("the initial guess is clamped to the maximum", bounded.guess() == 8192, bounded.guess());
+	for (int i = 0; i < 200; ++i)
+		bounded.record(0);
+	ok &= check("bounds round up to the size table", bounded.guess() == 112, bounded.guess());
+
+	//appends in small pieces: the buffer doubles, so few growths and copies
+	Buffer buffer;
+	std::string piece(100, 'x');
+	size_t growths = 0;
+	size_t capacity = buffer.internalCapacity();
+	for (int i = 0; i < 10000; ++i)
+	{
+		buffer.append(piece);
+		if (buffer.internalCapacity() != capacity)
+		{
+			++growths;
+			capacity = buffer.internalCapacity();
+		}
+	}
+	ok &= check("growth doubles the storage", growths <= 12, growths);
+	ok &= check("growth copies less than twice what was appended", buffer.bytesCopied() < 2 * buffer.readableBytes(), buffer.bytesCopied());
+
+	//only the readable bytes move into the new storage, not the retrieved ones before them
+	buffer.retrieve(buffer.readableBytes() - 1000);
+	size_t copied = buffer.bytesCopied();
+	buffer.ensureWritableBytes(buffer.internalCapacity() * 2);
+	ok &= check("growth copies only the readable bytes", buffer.bytesCopied() - copied == 1000, buffer.bytesCopied() - copied);
+
+#ifndef WIN32
+	//64MB reserved and never written must not become resident: no zero fill
+	size_t before = residentBytes();
+	Buffer large;
+	large.ensureWritableBytes(64 * 1024 * 1024);
+	size_t grown = residentBytes() - before;
+	ok &= check("growth leaves new storage untouched", large.writableBytes() >= 64 * 1024 * 1024 && grown < 8 * 1024 * 1024, grown);
+#endif
+
+	std::cout << (ok ? "all passed" : "FAILED") << "\n";
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,190 @@
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "async_log.h"
+#include "event_loop.h"
+#include "tcp_connection.h"
+#include "test_helper.h"
+
+using namespace net;
+
+//TcpConnection::sendFile() over a socketpair: a file region keeps its
+//place between the messages sent before and after it, from the loop
+//thread and from another thread, the caller may close its fd at once, a
+//region running past the end of the file closes the connection, and no
+//file descriptor is left open.
+//
+//usage: sendFileTest
+
+#ifndef WIN32
+
+static const size_t kFileSize = 3 * 1024 * 1024;
+static const int64_t kOffset = 1000;
+static const size_t kLength = 2 * 1024 * 1024;
+
+static char fileByte(size_t offset)
+{
+	return static_cast<char>((offset * 7) % 256);
+}
+
+static int openFds()
+{
+	int count = 0;
+	DIR* d = opendir("/proc/self/fd");
+	while (d != nullptr && readdir(d) != nullptr)
+		++count;
+	if (d != nullptr)
+		closedir(d);
+	return count;
+}
+
+struct Peer
+{
+	std::string data;
+	bool        eof = false;
+};
+
+//sends what @c send queues on a new connection, the peer reads until EOF or @c expected bytes
+static Peer transfer(const std::function<void(const TcpConnectionPtr&)>& send, size_t expected, bool* disconnected)
+{
+	Peer peer;
+	int fds[2];
+	if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+	{
+		std::cout << "socketpair failed: " << strerror(errno) << "\n";
+		return peer;
+	}
+	int flags = ::fcntl(fds[0], F_GETFL, 0);
+	::fcntl(fds[0], F_SETFL, flags | O_NONBLOCK);
+
+	EventLoop loop;
+	TcpConnectionPtr conn(new TcpConnection(&loop, "sendFile", fds[0], InetAddress(), InetAddress()));
+	conn->setConnectionCallback([](const TcpConnectionPtr&) {});
+	conn->setCloseCallback([](const TcpConnectionPtr&) {});
+	conn->setMessageCallback([](const TcpConnectionPtr&, Buffer* buffer, Timestamp) { buffer->retrieveAll(); });
+	conn->connectEstablished();
+
+	std::atomic<bool> done(false);
+	std::thread reader([&]
+	{
+		std::vector<char> buf(65536);
+		while (peer.data.size() < expected)
+		{
+			ssize_t n = ::read(fds[1], buf.data(), buf.size());
+			if (n <= 0)
+			{
+				peer.eof = n == 0;
+				break;
+			}
+			peer.data.append(buf.data(), n);
+		}
+		done = true;
+	});
+
+	send(conn);
+	int ticks = 0;
+	TimerId timer = loop.runEvery(1000, [&]
+	{
+		if (done || ++ticks > 5000)
+			loop.quit();
+	});
+	loop.loop();
+	loop.cancel(timer);
+	if (!done)
+		::shutdown(fds[1], SHUT_RDWR);
+	reader.join();
+
+	*disconnected = conn->disconnected();
+	conn->forceClose();
+	loop.queueInLoop([&loop] { loop.quit(); });
+	loop.loop();
+	conn->connectDestroyed();
+	::close(fds[1]);
+	return peer;
+}
+
+int main(int argc, char** argv)
+{
+	CAsyncLog::init();
+	CAsyncLog::setLevel(LOG_LEVEL_ERROR);
+
+	char path[] = "/tmp/sendFileTest.XXXXXX";
+	int file = mkstemp(path);
+	std::string contents(kFileSize, 0);
+	for (size_t i = 0; i < kFileSize; ++i)
+		contents[i] = fileByte(i);
+	if (file < 0 || ::write(file, contents.data(), contents.size()) != static_cast<ssize_t>(contents.size()))
+	{
+		std::cout << "can not write " << path << "\n";
+		return 1;
+	}
+	::close(file);
+
+	std::string expected = "head|" + contents.substr(kOffset, kLength) + "|tail";
+	int fdsBefore = openFds();
+	bool ok = true;
+	bool disconnected = false;
+
+	//the fd is closed right after sendFile(), the connection keeps a dup of it
+	Peer inLoop = transfer([&path](const TcpConnectionPtr& conn)
+	{
+		int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+		conn->send(std::string("head|"));
+		conn->sendFile(fd, kOffset, kLength);
+		conn->send(std::string("|tail"));
+		::close(fd);
+	}, expected.size(), &disconnected);
+	ok &= check("in the loop thread: the file region arrives between the messages", inLoop.data == expected);
+
+	//a thread that is not the loop's goes through the send queue, the order holds as well
+	Peer otherThread = transfer([&path](const TcpConnectionPtr& conn)
+	{
+		std::thread sender([&path, conn]
+		{
+			int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+			conn->send(std::string("head|"));
+			conn->sendFile(fd, kOffset, kLength);
+			conn->send(std::string("|tail"));
+			::close(fd);
+		});
+		sender.join();
+	}, expected.size(), &disconnected);
+	ok &= check("from another thread: the file region arrives between the messages", otherThread.data == expected);
+
+	//only 10 of the 100 bytes exist, what is there is sent, then the connection closes
+	Peer pastEnd = transfer([&path](const TcpConnectionPtr& conn)
+	{
+		int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+		conn->sendFile(fd, kFileSize - 10, 100);
+		::close(fd);
+	}, 100, &disconnected);
+	ok &= check("a region past the end of the file closes the connection",
+	            pastEnd.data == contents.substr(kFileSize - 10) && pastEnd.eof && disconnected);
+
+	ok &= check("no file descriptor is left open", openFds() == fdsBefore);
+	::unlink(path);
+
+	CAsyncLog::uninit();
+
+	std::cout << (ok ? "all passed" : "FAILED") << "\n";
+	return ok ? 0 : 1;
+}
+
+#else
+
+int main(int argc, char** argv)
+{
+	std::cout << "sendFileTest needs socketpair(2), not supported on Windows\n";
+	return 0;
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef __TEST_TEST_HELPER_H
+#define __TEST_TEST_HELPER_H
+
+//Fixture code shared by the test programs: a PASS/FAIL line per check and,
+//off Windows, a connected loopback TCP pair.
+
+#include <iostream>
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#endif
+
+//prints "PASS name" or "FAIL name", returns @c passed
+inline bool check(const char* name, bool passed)
+{
+	std::cout << (passed ? "PASS " : "FAIL ") << name << "\n";
+	return passed;
+}
+
+//the same, followed by the measured @c value
+template<typename T>
+inline bool check(const char* name, bool passed, const T& value)
+{
+	std::cout << (passed ? "PASS " : "FAIL ") << name << " (" << value << ")\n";
+	return passed;
+}
+
+#ifndef WIN32
+//a connected loopback pair, fds[0] nonblocking for a TcpConnection
+inline bool tcpPair(int fds[2])
+{
+	int listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	bool ok = listener >= 0
+		&& ::bind(listener, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0
+		&& ::listen(listener, 1) == 0
+		&& ::getsockname(listener, reinterpret_cast<struct sockaddr*>(&addr), &len) == 0;
+	fds[1] = ok ? ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0) : -1;
+	ok = ok && fds[1] >= 0 && ::connect(fds[1], reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0;
+	fds[0] = ok ? ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC) : -1;
+	if (listener >= 0)
+		::close(listener);
+	if (fds[0] < 0)
+	{
+		std::cout << "loopback connection failed: " << strerror(errno) << "\n";
+		if (fds[1] >= 0)
+			::close(fds[1]);
+		return false;
+	}
+	return true;
+}
+#endif
+
+#endif  // __TEST_TEST_HELPER_H
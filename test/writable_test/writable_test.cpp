@@ -0,0 +1,175 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "async_log.h"
+#include "event_loop.h"
+#include "socketsOps.h"
+#include "tcp_connection.h"
+#include "test_helper.h"
+
+using namespace net;
+
+//The writable callback over loopback TCP: with TCP_NOTSENT_LOWAT a stream
+//produced from the callback alone arrives whole and in order, and the
+//callback is not called when queued output is dropped for a slow peer
+//rather than written.
+//
+//usage: writableTest
+
+#ifndef WIN32
+
+static const size_t kStreamSize = 4 * 1024 * 1024;
+static const size_t kChunkSize = 16 * 1024;
+
+static TcpConnectionPtr makeConnection(EventLoop* loop, int fd)
+{
+	TcpConnectionPtr conn(new TcpConnection(loop, "writable", fd, InetAddress(), InetAddress()));
+	conn->setConnectionCallback([](const TcpConnectionPtr&) {});
+	conn->setCloseCallback([](const TcpConnectionPtr&) {});
+	conn->setMessageCallback([](const TcpConnectionPtr&, Buffer* buffer, Timestamp) { buffer->retrieveAll(); });
+	return conn;
+}
+
+//the callback sends the next chunk each time the kernel is low on unsent bytes
+static bool streamFromCallback()
+{
+	int fds[2];
+	if (!tcpPair(fds))
+		return false;
+
+	EventLoop loop;
+	TcpConnectionPtr conn = makeConnection(&loop, fds[0]);
+	size_t sent = 0;
+	int calls = 0;
+	WritableCallback produce = [&sent, &calls](const TcpConnectionPtr& c)
+	{
+		++calls;
+		if (sent >= kStreamSize)
+			return;
+		std::string chunk(kChunkSize, 0);
+		for (size_t i = 0; i < kChunkSize; ++i)
+			chunk[i] = static_cast<char>((sent + i) % 251);
+		sent += kChunkSize;
+		c->send(chunk);
+	};
+	conn->setWritableCallback(produce);
+
+	size_t received = 0;
+	bool inOrder = true;
+	std::thread peer([&]
+	{
+		std::vector<char> buf(65536);
+		while (received < kStreamSize)
+		{
+			ssize_t n = ::read(fds[1], buf.data(), buf.size());
+			if (n <= 0)
+				break;
+			for (ssize_t i = 0; i < n; ++i)
+				inOrder &= buf[i] == static_cast<char>((received + i) % 251);
+			received += static_cast<size_t>(n);
+		}
+		loop.queueInLoop([&loop] { loop.quit(); });
+	});
+
+	bool lowat = conn->setNotSentLowat(kChunkSize);
+	conn->connectEstablished();
+	//the first chunk starts the stream, the callback is armed once the output is empty
+	produce(conn);
+	loop.loop();
+	peer.join();
+
+	conn->forceClose();
+	loop.queueInLoop([&loop] { loop.quit(); });
+	loop.loop();
+	conn->connectDestroyed();
+	::close(fds[1]);
+
+	bool ok = check("TCP_NOTSENT_LOWAT is supported", lowat);
+	ok &= check("the stream arrives whole and in order", received == kStreamSize && inOrder);
+	ok &= check("the callback produced every chunk", calls >= static_cast<int>(kStreamSize / kChunkSize));
+	return ok;
+}
+
+//the peer never reads, the queued droppable output is dropped while the connection shuts down
+static bool dropIsNotWritable()
+{
+	int fds[2];
+	if (!tcpPair(fds))
+		return false;
+
+	EventLoop loop;
+	TcpConnectionPtr conn = makeConnection(&loop, fds[0]);
+	int calls = 0;
+	conn->setWritableCallback([&calls](const TcpConnectionPtr&) { ++calls; });
+	//output queued longer than 50ms is dropped, all of it
+	SlowConsumerPolicy policy;
+	policy.maxOutputAge = 50 * 1000;
+	policy.checkInterval = 10 * 1000;
+	conn->setSlowConsumerPolicy(policy);
+	conn->connectEstablished();
+	loop.queueInLoop([&loop] { loop.quit(); });
+	loop.loop();
+
+	//the socket buffer is full, so every message is queued whole and may be dropped
+	std::vector<char> fill(65536, 'f');
+	while (::write(fds[0], fill.data(), fill.size()) > 0)
+		;
+	for (size_t i = 0; i < 16; ++i)
+		conn->send(std::string(kChunkSize, 'x'), OutputChain::kPriorityDroppable);
+	int before = calls;
+	size_t queued = conn->stats().outputBytes;
+	conn->shutdown();
+	loop.runAfter(200 * 1000, [&loop] { loop.quit(); });
+	loop.loop();
+	int64_t dropped = conn->stats().droppedBytes;
+
+	//the peer reads what the socket holds, the socket polls writable with nothing queued
+	SocketsOps::setNonBlockAndCloseOnExec(fds[1]);
+	bool eof = false;
+	for (int i = 0; i < 200 && !eof; ++i)
+	{
+		ssize_t n;
+		while ((n = ::read(fds[1], fill.data(), fill.size())) > 0)
+			;
+		eof = n == 0;
+		loop.runAfter(5 * 1000, [&loop] { loop.quit(); });
+		loop.loop();
+	}
+
+	conn->forceClose();
+	loop.queueInLoop([&loop] { loop.quit(); });
+	loop.loop();
+	conn->connectDestroyed();
+	::close(fds[1]);
+
+	bool ok = check("output queued for the slow peer is dropped", queued > 0 && dropped == static_cast<int64_t>(queued));
+	ok &= check("dropping does not call the writable callback", calls == before);
+	ok &= check("the shutdown still goes out", eof);
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	CAsyncLog::init();
+	CAsyncLog::setLevel(LOG_LEVEL_ERROR);
+
+	bool ok = true;
+	ok &= streamFromCallback();
+	ok &= dropIsNotWritable();
+
+	CAsyncLog::uninit();
+
+	std::cout << (ok ? "all passed" : "FAILED") << "\n";
+	return ok ? 0 : 1;
+}
+
+#else
+
+int main(int argc, char** argv)
+{
+	std::cout << "writableTest is not supported on Windows\n";
+	return 0;
+}
+
+#endif
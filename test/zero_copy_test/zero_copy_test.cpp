@@ -0,0 +1,304 @@
+#include <atomic>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include "async_log.h"
+#include "event_loop.h"
+#include "tcp_connection.h"
+#include "test_helper.h"
+
+using namespace net;
+
+//Sends large slices with MSG_ZEROCOPY over loopback TCP and checks every
+//byte arrives in order, both when the zero-copy send fails with ENOBUFS
+//and the chain falls back to a copy, and when it succeeds and the kernel
+//reports its completions on the error queue: those come in through
+//handleError() and must neither close the connection nor leave slices
+//held. Slices under the threshold and unix sockets never use it. With
+//made up completions an OutputChain must keep zero-copy after one copied
+//send, pause it after a run of them and try it again later.
+//
+//usage: zeroCopyTest
+
+#if !defined(WIN32) && defined(MSG_ZEROCOPY)
+
+static const size_t kMessageSize = 256 * 1024;
+static const int kMessages = 8;
+
+//MSG_ZEROCOPY sends still to fail with ENOBUFS, and how many did
+static std::atomic<int> g_failZeroCopy(0);
+static std::atomic<int> g_zeroCopySends(0);
+static std::atomic<int> g_zeroCopyFailed(0);
+
+//sends on this fd only pretend to, its error queue holds g_completions
+static int g_fakeFd = -1;
+
+struct Completion
+{
+	uint32_t lo;
+	uint32_t hi;
+	bool     copied;
+};
+static std::deque<Completion> g_completions;
+
+//takes the place of the libc one for libnet too
+extern "C" ssize_t sendmsg(int fd, const struct msghdr* msg, int flags)
+{
+	if ((flags & MSG_ZEROCOPY) != 0)
+	{
+		g_zeroCopySends.fetch_add(1);
+		if (fd == g_fakeFd)
+		{
+			ssize_t n = 0;
+			for (size_t i = 0; i < msg->msg_iovlen; ++i)
+				n += static_cast<ssize_t>(msg->msg_iov[i].iov_len);
+			return n;
+		}
+		if (g_failZeroCopy.load() > 0)
+		{
+			g_failZeroCopy.fetch_sub(1);
+			g_zeroCopyFailed.fetch_add(1);
+			errno = ENOBUFS;
+			return -1;
+		}
+	}
+	return ::syscall(SYS_sendmsg, fd, msg, flags);
+}
+
+extern "C" ssize_t recvmsg(int fd, struct msghdr* msg, int flags)
+{
+	if (fd != g_fakeFd || (flags & MSG_ERRQUEUE) == 0)
+		return ::syscall(SYS_recvmsg, fd, msg, flags);
+	if (g_completions.empty() || msg->msg_controllen < CMSG_SPACE(sizeof(struct sock_extended_err)))
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	Completion completion = g_completions.front();
+	g_completions.pop_front();
+	struct cmsghdr* cm = reinterpret_cast<struct cmsghdr*>(msg->msg_control);
+	cm->cmsg_level = SOL_IP;
+	cm->cmsg_type = IP_RECVERR;
+	cm->cmsg_len = CMSG_LEN(sizeof(struct sock_extended_err));
+	struct sock_extended_err serr;
+	memset(&serr, 0, sizeof(serr));
+	serr.ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+	serr.ee_code = completion.copied ? SO_EE_CODE_ZEROCOPY_COPIED : 0;
+	serr.ee_info = completion.lo;
+	serr.ee_data = completion.hi;
+	memcpy(CMSG_DATA(cm), &serr, sizeof(serr));
+	msg->msg_controllen = CMSG_SPACE(sizeof(struct sock_extended_err));
+	return 0;
+}
+
+struct Outcome
+{
+	bool             zeroCopy = false;      // enableZeroCopy() worked
+	size_t           received = 0;
+	bool             inOrder = true;
+	bool             connected = false;     // still connected once all arrived
+	TcpConnectionStats stats;
+};
+
+//kMessages slices of kMessageSize bytes, the peer reads them in another thread
+static Outcome run(int failZeroCopy, size_t threshold = 16 * 1024)
+{
+	Outcome outcome;
+	int fds[2];
+	if (!tcpPair(fds))
+		return outcome;
+
+	EventLoop loop;
+	TcpConnectionPtr conn(new TcpConnection(&loop, "zeroCopy", fds[0], InetAddress(), InetAddress()));
+	conn->setConnectionCallback([](const TcpConnectionPtr&) {});
+	conn->setCloseCallback([](const TcpConnectionPtr&) {});
+	conn->setMessageCallback([](const TcpConnectionPtr&, Buffer* buffer, Timestamp) { buffer->retrieveAll(); });
+	outcome.zeroCopy = conn->enableZeroCopy(threshold);
+	conn->connectEstablished();
+
+	std::atomic<bool> peerDone(false);
+	std::thread peer([&]
+	{
+		std::vector<char> buf(65536);
+		size_t total = kMessageSize * kMessages;
+		while (outcome.received < total)
+		{
+			ssize_t n = ::read(fds[1], buf.data(), buf.size());
+			if (n <= 0)
+				break;
+			for (ssize_t i = 0; i < n; ++i)
+				outcome.inOrder &= buf[i] == static_cast<char>((outcome.received + i) % 251);
+			outcome.received += static_cast<size_t>(n);
+		}
+		peerDone = true;
+	});
+
+	g_failZeroCopy = failZeroCopy;
+	size_t offset = 0;
+	for (int m = 0; m < kMessages; ++m)
+	{
+		std::string message(kMessageSize, 0);
+		for (size_t i = 0; i < kMessageSize; ++i, ++offset)
+			message[i] = static_cast<char>(offset % 251);
+		conn->send(std::move(message));
+	}
+
+	//until the peer has everything and the kernel completed every zero-copy send, 5s at most
+	int ticks = 0;
+	TimerId timer = loop.runEvery(1000, [&]
+	{
+		if ((peerDone && conn->stats().zeroCopyPending == 0) || ++ticks > 5000)
+			loop.quit();
+	});
+	loop.loop();
+	loop.cancel(timer);
+	//a broken stream ends the peer's read
+	if (!peerDone)
+		::shutdown(fds[1], SHUT_RDWR);
+	peer.join();
+	g_failZeroCopy = 0;
+
+	outcome.connected = conn->connected();
+	outcome.stats = conn->stats();
+	conn->forceClose();
+	loop.queueInLoop([&loop] { loop.quit(); });
+	loop.loop();
+	conn->connectDestroyed();
+	::close(fds[1]);
+	return outcome;
+}
+
+//queues one 64KB slice and writes it, true if that was a zero-copy send
+static bool writeOne(OutputChain* chain, const BufferSlice& slice)
+{
+	int sendsBefore = g_zeroCopySends;
+	int savedErrno = 0;
+	chain->append(slice);
+	chain->writeFd(g_fakeFd, &savedErrno);
+	return g_zeroCopySends != sendsBefore;
+}
+
+//the kernel reports sends [lo, hi] complete
+static void complete(OutputChain* chain, uint32_t lo, uint32_t hi, bool copied)
+{
+	g_completions.push_back(Completion{ lo, hi, copied });
+	chain->handleZeroCopyCompletions(g_fakeFd);
+}
+
+//the pause policy on an OutputChain writing to /dev/null, sends and completions made up
+static bool copiedBackoff()
+{
+	g_fakeFd = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+	OutputChain chain;
+	chain.setZeroCopyThreshold(16 * 1024);
+	BufferSlice slice = BufferSlice::copyOf(std::string(64 * 1024, 'z'));
+	const uint32_t kRun = OutputChain::kZeroCopyCopiedRun;
+	const uint32_t kInterval = OutputChain::kZeroCopyProbeInterval;
+
+	bool first = writeOne(&chain, slice);
+	complete(&chain, 0, 0, true);
+	bool ok = check("one copied send keeps zero-copy", first && !chain.zeroCopyPaused() && writeOne(&chain, slice));
+
+	//sends 1 .. kRun - 1 are reported copied as well, together kRun in a row
+	for (uint32_t i = 2; i < kRun; ++i)
+		writeOne(&chain, slice);
+	complete(&chain, 1, kRun - 1, true);
+	ok &= check("a run of copied sends pauses zero-copy", chain.zeroCopyPaused() && chain.zeroCopyPending() == 0);
+
+	uint32_t plain = 0;
+	while (plain <= kInterval && !writeOne(&chain, slice))
+		++plain;
+	ok &= check("zero-copy is tried again after kZeroCopyProbeInterval writes", plain == kInterval && !chain.zeroCopyPaused(), plain);
+
+	//the probe is not copied, the run starts over
+	complete(&chain, kRun, kRun, false);
+	for (uint32_t i = 1; i < kRun; ++i)
+		writeOne(&chain, slice);
+	complete(&chain, kRun + 1, 2 * kRun - 1, true);
+	ok &= check("a zero-copy completion starts the run over", !chain.zeroCopyPaused() && writeOne(&chain, slice));
+
+	::close(g_fakeFd);
+	g_fakeFd = -1;
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	CAsyncLog::init();
+	CAsyncLog::setLevel(LOG_LEVEL_ERROR);
+
+	bool ok = true;
+	size_t total = kMessageSize * kMessages;
+
+	//every zero-copy send fails, all of it goes out copied
+	int sendsBefore = g_zeroCopySends;
+	Outcome fallback = run(1000);
+	ok &= check("SO_ZEROCOPY is supported", fallback.zeroCopy);
+	ok &= check("ENOBUFS was hit", g_zeroCopyFailed > 0 && g_zeroCopySends - sendsBefore == g_zeroCopyFailed);
+	ok &= check("ENOBUFS: every byte arrives in order", fallback.received == total && fallback.inOrder);
+	ok &= check("ENOBUFS: nothing held for completions", fallback.stats.zeroCopyPending == 0 && fallback.connected);
+
+	//the zero-copy sends succeed, their completions arrive as POLLERR
+	int failedBefore = g_zeroCopyFailed;
+	sendsBefore = g_zeroCopySends;
+	Outcome completions = run(0);
+	ok &= check("zero-copy sends were made", g_zeroCopySends > sendsBefore && g_zeroCopyFailed == failedBefore);
+	ok &= check("zero-copy: every byte arrives in order", completions.received == total && completions.inOrder);
+	ok &= check("completions do not close the connection", completions.connected);
+	ok &= check("completions release the held slices", completions.stats.zeroCopyPending == 0);
+	//loopback always copies, the chain notices and stops pinning pages
+	ok &= check("a copied completion is counted", completions.stats.zeroCopyCopied > 0);
+
+	//slices under the threshold are written at once, never with MSG_ZEROCOPY
+	sendsBefore = g_zeroCopySends;
+	Outcome small = run(0, 2 * kMessageSize);
+	ok &= check("below the threshold: no zero-copy send", small.zeroCopy && g_zeroCopySends == sendsBefore);
+	ok &= check("below the threshold: every byte arrives in order", small.received == total && small.inOrder);
+
+	//SO_ZEROCOPY is for TCP, a unix socket says no and the connection writes as before
+	int fds[2];
+	bool unixRefused = false;
+	if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) == 0)
+	{
+		EventLoop loop;
+		TcpConnectionPtr conn(new TcpConnection(&loop, "unix", fds[0], InetAddress(), InetAddress()));
+		conn->setConnectionCallback([](const TcpConnectionPtr&) {});
+		conn->setCloseCallback([](const TcpConnectionPtr&) {});
+		unixRefused = !conn->enableZeroCopy();
+		conn->connectEstablished();
+		conn->forceClose();
+		loop.queueInLoop([&loop] { loop.quit(); });
+		loop.loop();
+		conn->connectDestroyed();
+		::close(fds[1]);
+	}
+	ok &= check("a unix socket refuses zero-copy", unixRefused);
+
+	ok &= copiedBackoff();
+
+	CAsyncLog::uninit();
+
+	std::cout << (ok ? "all passed" : "FAILED") << "\n";
+	return ok ? 0 : 1;
+}
+
+#else
+
+int main(int argc, char** argv)
+{
+	std::cout << "zeroCopyTest needs MSG_ZEROCOPY, not supported here\n";
+	return 0;
+}
+
+#endif